@@ -0,0 +1,238 @@
+#include "ActivityForecast.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <spdlog/spdlog.h>
+#include <unistd.h>
+
+static constexpr uint64_t kMagic = 0x3154534346424250; // "PBBFCST1"
+
+namespace {
+struct Header {
+  uint64_t magic;
+  uint32_t slots;
+  uint32_t slotSeconds;
+};
+} // namespace
+
+ActivityForecast::ActivityForecast(const char *path)
+    : path_(path ? path : "") {
+  for (auto &s : slots_) {
+    s = Slot{~0u, 0, 0, 0, 0, 0};
+  }
+  if (!path_.empty() && load()) {
+    spdlog::info("Loaded activity forecast from {}.", path_);
+  }
+}
+
+// Seconds from the Monday before the epoch, which was a Thursday, to t in
+// local time.
+static int64_t sinceMonday(time_t t) {
+  struct tm local;
+  localtime_r(&t, &local);
+  return int64_t(t) + local.tm_gmtoff + 3 * 24 * 3600;
+}
+
+uint32_t ActivityForecast::tickFor(time_t t) {
+  return uint32_t(sinceMonday(t) / kSlotSeconds);
+}
+
+time_t ActivityForecast::tickEnd(time_t t) {
+  return t + kSlotSeconds - sinceMonday(t) % kSlotSeconds;
+}
+
+ActivityForecast::Slot &ActivityForecast::touch(uint32_t tick) {
+  Slot &s = slots_[tick % kSlots];
+  const uint32_t week = tick / kSlots;
+  if (s.week != week) {
+    s.week = week;
+    s.weeks = s.weeks - s.weeks / 8 + kOne;
+    s.motion -= s.motion / 8;
+    s.sightings -= s.sightings / 8;
+    s.flags = 0;
+  }
+  return s;
+}
+
+void ActivityForecast::visit(uint32_t tick) {
+  std::lock_guard<std::mutex> lock(lock_);
+  touch(tick);
+}
+
+void ActivityForecast::record(Kind kind, uint32_t tick) {
+  std::lock_guard<std::mutex> lock(lock_);
+  Slot &s = touch(tick);
+  const uint8_t flag = kind == Kind::MOTION ? MOTION_SEEN : SIGHTING_SEEN;
+  if (!(s.flags & flag)) {
+    s.flags |= flag;
+    (kind == Kind::MOTION ? s.motion : s.sightings) += kOne;
+  }
+}
+
+ActivityForecast::Odds ActivityForecast::oddsLocked(uint32_t tick) const {
+  Slot const &s = slots_[tick % kSlots];
+  Odds o;
+  if (s.weeks) {
+    o.weeks = double(s.weeks) / kOne;
+    o.motion = 100u * s.motion / s.weeks;
+    o.sighting = 100u * s.sightings / s.weeks;
+  }
+  return o;
+}
+
+ActivityForecast::Odds ActivityForecast::odds(uint32_t tick) const {
+  std::lock_guard<std::mutex> lock(lock_);
+  return oddsLocked(tick);
+}
+
+bool ActivityForecast::hot(uint32_t tick, unsigned pct) const {
+  // One week of history proves nothing, so want at least two.
+  static constexpr double kMinWeeks = 1.5;
+  std::lock_guard<std::mutex> lock(lock_);
+  for (uint32_t t = tick; t <= tick + 1; ++t) {
+    const Odds o = oddsLocked(t);
+    if (o.weeks >= kMinWeeks && o.motion >= pct && o.sighting >= pct) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ActivityForecast::load() {
+  FILE *f = fopen(path_.c_str(), "r");
+  if (!f) {
+    if (errno != ENOENT) {
+      spdlog::warn("Cannot open activity forecast {}: {}", path_,
+                   strerror(errno));
+    }
+    return false;
+  }
+  Header h;
+  std::array<Slot, kSlots> slots;
+  const bool ok = fread(&h, sizeof(h), 1, f) == 1 && h.magic == kMagic &&
+                  h.slots == kSlots && h.slotSeconds == kSlotSeconds &&
+                  fread(slots.data(), sizeof(slots), 1, f) == 1;
+  fclose(f);
+  if (!ok) {
+    spdlog::warn("Ignoring activity forecast {}: not one of ours.", path_);
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(lock_);
+  slots_ = slots;
+  return true;
+}
+
+bool ActivityForecast::save() const {
+  if (path_.empty()) {
+    return true;
+  }
+  const Header h{kMagic, kSlots, kSlotSeconds};
+  std::array<Slot, kSlots> slots;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    slots = slots_;
+  }
+
+  const std::string tmp = path_ + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "w");
+  if (!f) {
+    spdlog::warn("Cannot write activity forecast {}: {}", tmp,
+                 strerror(errno));
+    return false;
+  }
+  bool ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+            fwrite(slots.data(), sizeof(slots), 1, f) == 1;
+  ok = fclose(f) == 0 && ok;
+  if (!ok || rename(tmp.c_str(), path_.c_str()) == -1) {
+    spdlog::warn("Cannot write activity forecast {}: {}", path_,
+                 strerror(errno));
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+void ActivityForecast::publish(StatusBuffer &buf, uint32_t tick) const {
+  static constexpr const char *kDays[] = {"Mon", "Tue", "Wed", "Thu",
+                                          "Fri", "Sat", "Sun"};
+  auto out = std::back_inserter(buf);
+  for (uint32_t t = tick; t <= tick + 1; ++t) {
+    const unsigned slot = t % kSlots;
+    const unsigned minutes = slot * kSlotSeconds / 60;
+    const Odds o = odds(t);
+    fmt::format_to(out,
+                   "Forecast {} {:02}:{:02}: motion {}% Nazbert {}% over "
+                   "{:.1f} weeks\n",
+                   kDays[minutes / (24 * 60)], minutes / 60 % 24,
+                   minutes % 60, o.motion, o.sighting, o.weeks);
+  }
+}
+
+#ifdef FORECAST_TEST
+#include <cassert>
+int main(void) {
+  const char *path = "/tmp/pounceblat-forecast-test.db";
+  static constexpr uint32_t week = ActivityForecast::kSlots;
+  static constexpr uint32_t slot = 4 * 24 * 4 + 18 * 4; // Fri 18:00.
+  unlink(path);
+
+  {
+    ActivityForecast f(path);
+    assert(!f.hot(slot, 50));
+    // Eight weeks: motion every Friday at 18:00 with Nazbert there on all
+    // but the last two; motion at 03:00 on odd weeks only, never Nazbert.
+    for (uint32_t w = 0; w < 8; ++w) {
+      for (uint32_t t = w * week; t < (w + 1) * week; ++t) {
+        f.visit(t);
+      }
+      f.record(ActivityForecast::Kind::MOTION, w * week + slot);
+      f.record(ActivityForecast::Kind::MOTION, w * week + slot);
+      if (w < 6) {
+        f.record(ActivityForecast::Kind::SIGHTING, w * week + slot);
+      }
+      if (w % 2) {
+        f.record(ActivityForecast::Kind::MOTION, w * week + 12);
+      }
+    }
+    const auto o = f.odds(slot);
+    assert(o.motion == 100);
+    assert(o.sighting > 50 && o.sighting < 100);
+    assert(o.weeks > 5 && o.weeks < 8);
+    // Hot in the slot and the one before it, so scanning is warm on time.
+    assert(f.hot(slot, 50) && f.hot(slot - 1, 50));
+    assert(!f.hot(slot + 1, 50) && !f.hot(slot - 2, 50));
+    assert(!f.hot(slot, 90));
+    // Motion half the time but no Nazbert: nothing to gain.
+    assert(f.odds(12).motion >= 40 && f.odds(12).motion <= 60);
+    assert(!f.hot(12, 1));
+    assert(f.save());
+  }
+
+  // Survives a restart; garbage is ignored.
+  {
+    ActivityForecast f(path);
+    assert(f.hot(slot, 50));
+  }
+  FILE *junk = fopen(path, "w");
+  fputs("not a forecast", junk);
+  fclose(junk);
+  {
+    ActivityForecast f(path);
+    assert(!f.hot(slot, 50));
+  }
+  unlink(path);
+
+  // Ticks start on a Monday; 1970-01-05 was one.
+  setenv("TZ", "UTC", 1);
+  tzset();
+  assert(ActivityForecast::tickFor(4 * 24 * 3600 - 1) % week == week - 1);
+  assert(ActivityForecast::tickFor(4 * 24 * 3600) % week == 0);
+  assert(ActivityForecast::tickEnd(4 * 24 * 3600 - 1) == 4 * 24 * 3600);
+  assert(ActivityForecast::tickEnd(4 * 24 * 3600) == 4 * 24 * 3600 + 900);
+
+  printf("Forecast OK.\n");
+  return 0;
+}
+#endif
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "StatusBuffer.h"
+
+#include <array>
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <string>
+
+// When do things happen in this room? A time-of-week histogram of motion
+// and Nazbert sightings, in 15 minute slots, used to start scanning ahead of
+// the slots where motion with Nazbert about is likely.
+//
+// Time is counted in ticks, i.e. slots since some Monday 00:00; the daemon
+// uses local time, blatsim its own virtual time. For each slot we keep, per
+// week it was observed in, whether there was any motion and whether Nazbert
+// was sighted. Older weeks fade out by 1/8 a week, so habits that change are
+// followed within a month or so.
+class ActivityForecast {
+public:
+  static constexpr unsigned kSlotSeconds = 15 * 60;
+  static constexpr size_t kSlots = 7 * 24 * 3600 / kSlotSeconds;
+
+  enum class Kind { MOTION, SIGHTING };
+
+  struct Odds {
+    double weeks = 0;      // Weeks observed, faded.
+    unsigned motion = 0;   // Percent of those with motion...
+    unsigned sighting = 0; // ...and with Nazbert sighted.
+  };
+
+  // If path is given the histogram is loaded from it, when it exists and
+  // makes sense, and save() writes it back.
+  explicit ActivityForecast(const char *path = nullptr);
+
+  // The tick for a wall clock time, in local time, and when it ends.
+  static uint32_t tickFor(time_t t);
+  static time_t tickEnd(time_t t);
+
+  // The slot of tick is being observed: call at least once per slot while
+  // running. record() implies it.
+  void visit(uint32_t tick);
+  void record(Kind kind, uint32_t tick);
+
+  Odds odds(uint32_t tick) const;
+  // Whether to pre-warm during tick: in this slot or the next, there has
+  // been motion and Nazbert about in at least pct percent of weeks.
+  bool hot(uint32_t tick, unsigned pct) const;
+
+  // Written to a temporary file and renamed into place, so a crash leaves
+  // the old or the new histogram, never half of each.
+  bool save() const;
+
+  // The current and next slots, for the status file.
+  void publish(StatusBuffer &buf, uint32_t tick) const;
+
+private:
+  // Weeks and counts are fixed point, 1 week = kOne.
+  static constexpr uint16_t kOne = 256;
+  enum Flags : uint8_t { MOTION_SEEN = 1, SIGHTING_SEEN = 2 };
+
+  struct Slot {
+    uint32_t week;      // When the slot was last observed.
+    uint16_t weeks;     // Observed...
+    uint16_t motion;    // ...with motion...
+    uint16_t sightings; // ...with Nazbert sighted.
+    uint8_t flags;      // Already counted in week.
+    uint8_t pad;
+  };
+  static_assert(sizeof(Slot) == 12);
+
+  Slot &touch(uint32_t tick);
+  Odds oddsLocked(uint32_t tick) const;
+  bool load();
+
+  const std::string path_;
+  mutable std::mutex lock_;
+  std::array<Slot, kSlots> slots_;
+};
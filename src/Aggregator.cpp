@@ -0,0 +1,709 @@
+// blatagg: collects the telemetry streams of any number of pounceblat
+// daemons (telemetry_socket in their config) into one view of all of them,
+// with a merged history of their state transitions, and answers queries
+// about it.
+//
+// A single thread multiplexes every connection with epoll. Frames are
+// parsed straight out of a small per-connection buffer, so a daemon costs
+// one fd and a few hundred bytes, and hundreds of them are no trouble.
+//
+// Queries are plain text: connect to the query socket, send one line, and
+// read the answer until EOF. `blatagg -q LINE` does exactly that.
+//   status               one line per daemon, then totals
+//   history [NAME] [N]   the last N (default 20) transitions, of one
+//                        daemon or of all of them
+
+#include "Telemetry.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdarg>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <getopt.h>
+#include <map>
+#include <memory>
+#include <stddef.h>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+constexpr const char *kDefaultTelemetry = "/run/blatagg/telemetry.sock";
+constexpr const char *kDefaultQuery = "/run/blatagg/query.sock";
+
+// Same order as BlatMachine::State.
+constexpr const char *kStates[] = {"ARMED", "DISABLED", "GRACE", "RUNNING",
+                                   "SCANNING"};
+constexpr size_t kNumStates = sizeof(kStates) / sizeof(kStates[0]);
+
+constexpr size_t kHistory = 16384; // Transitions kept, over all daemons.
+
+const char *stateName(int s) {
+  return s >= 0 && size_t(s) < kNumStates ? kStates[s] : "?";
+}
+
+struct Daemon {
+  std::string name;
+  uint32_t pid = 0;
+  int fd = -1; // Of its connection, while it has one.
+  int state = -1;
+  uint64_t sinceUs = 0; // When it entered state.
+  uint64_t transitions = 0;
+  uint64_t motion = 0;
+  uint64_t runs = 0;
+  uint64_t disallowed = 0;
+  uint64_t aborts = 0;
+  uint64_t latencyCount = 0; // Since it last connected.
+  uint64_t latencySumUs = 0;
+  uint32_t latencyMaxUs = 0;
+};
+
+struct Transition {
+  uint64_t timeUs;
+  uint32_t daemon; // Index into Aggregator::daemons_.
+  uint8_t from;
+  uint8_t to;
+};
+
+struct Conn {
+  int fd;
+  bool query;
+  int daemon = -1; // Set by HELLO.
+  uint8_t in[512];
+  size_t inLen = 0;
+  std::string out; // Query answer still to be written.
+  size_t outOff = 0;
+};
+
+class Aggregator {
+public:
+  Aggregator() = default;
+  ~Aggregator();
+
+  Aggregator(Aggregator const &) = delete;
+  Aggregator &operator=(Aggregator const &) = delete;
+
+  // Returns false, having said why, if either socket cannot be set up.
+  bool open(const char *telemetryPath, const char *queryPath);
+  // Until stop() is called, from any thread.
+  int run();
+  void stop();
+
+private:
+  int listenOn(const char *path);
+  void accept(int listenFd, bool query);
+  void readTelemetry(Conn &c);
+  void handleFrame(Conn &c, telemetry::FrameType type, const uint8_t *p,
+                   size_t len);
+  void readQuery(Conn &c);
+  void answer(const char *line, std::string &out) const;
+  void writeOut(Conn &c);
+  void drop(Conn &c);
+
+  int epfd_ = -1;
+  int telemetryFd_ = -1;
+  int queryFd_ = -1;
+  int stopFd_ = -1;
+  std::vector<std::string> paths_; // To unlink.
+
+  std::map<int, std::unique_ptr<Conn>> conns_;
+  std::vector<Daemon> daemons_;
+  std::map<std::string, uint32_t> byName_;
+  std::deque<Transition> history_;
+  uint64_t badFrames_ = 0;
+};
+
+Aggregator::~Aggregator() {
+  for (auto &c : conns_) {
+    close(c.first);
+  }
+  for (int fd : {epfd_, telemetryFd_, queryFd_, stopFd_}) {
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+  for (const auto &p : paths_) {
+    unlink(p.c_str());
+  }
+}
+
+int Aggregator::listenOn(const char *path) {
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path %s is too long\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    fprintf(stderr, "socket: %s\n", strerror(errno));
+    return -1;
+  }
+  unlink(path); // Left behind by a previous run.
+  if (bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) ==
+          -1 ||
+      listen(fd, SOMAXCONN) == -1) {
+    fprintf(stderr, "Cannot listen on %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  paths_.push_back(path);
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev);
+  return fd;
+}
+
+bool Aggregator::open(const char *telemetryPath, const char *queryPath) {
+  epfd_ = epoll_create1(EPOLL_CLOEXEC);
+  stopFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (epfd_ == -1 || stopFd_ == -1) {
+    fprintf(stderr, "epoll/eventfd: %s\n", strerror(errno));
+    return false;
+  }
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.fd = stopFd_;
+  epoll_ctl(epfd_, EPOLL_CTL_ADD, stopFd_, &ev);
+
+  telemetryFd_ = listenOn(telemetryPath);
+  queryFd_ = listenOn(queryPath);
+  return telemetryFd_ != -1 && queryFd_ != -1;
+}
+
+void Aggregator::stop() {
+  const uint64_t one = 1;
+  if (write(stopFd_, &one, sizeof(one)) != sizeof(one)) {
+    fprintf(stderr, "Cannot stop: %s\n", strerror(errno));
+  }
+}
+
+int Aggregator::run() {
+  struct epoll_event events[64];
+  while (1) {
+    const int n = epoll_wait(epfd_, events, 64, -1);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "epoll_wait: %s\n", strerror(errno));
+      return 1;
+    }
+    for (int i = 0; i < n; ++i) {
+      const int fd = events[i].data.fd;
+      if (fd == stopFd_) {
+        return 0;
+      } else if (fd == telemetryFd_ || fd == queryFd_) {
+        accept(fd, fd == queryFd_);
+        continue;
+      }
+      auto it = conns_.find(fd);
+      if (it == conns_.end()) {
+        continue; // Dropped earlier in this batch.
+      }
+      Conn &c = *it->second;
+      if (events[i].events & EPOLLOUT) {
+        writeOut(c);
+      } else if (c.query) {
+        readQuery(c);
+      } else {
+        readTelemetry(c);
+      }
+    }
+  }
+}
+
+void Aggregator::accept(int listenFd, bool query) {
+  while (1) {
+    const int fd = accept4(listenFd, nullptr, nullptr,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        fprintf(stderr, "accept: %s\n", strerror(errno));
+      }
+      return;
+    }
+    auto c = std::make_unique<Conn>();
+    c->fd = fd;
+    c->query = query;
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev);
+    conns_[fd] = std::move(c);
+  }
+}
+
+void Aggregator::drop(Conn &c) {
+  if (c.daemon != -1 && daemons_[c.daemon].fd == c.fd) {
+    daemons_[c.daemon].fd = -1;
+  }
+  close(c.fd); // Also removes it from the epoll set.
+  conns_.erase(c.fd);
+}
+
+void Aggregator::readTelemetry(Conn &c) {
+  while (1) {
+    const ssize_t n = read(c.fd, c.in + c.inLen, sizeof(c.in) - c.inLen);
+    if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+      drop(c);
+      return;
+    }
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    c.inLen += n;
+
+    size_t off = 0;
+    telemetry::FrameHeader h;
+    while (c.inLen - off >= sizeof(h)) {
+      memcpy(&h, c.in + off, sizeof(h));
+      if (c.inLen - off < sizeof(h) + h.length) {
+        break;
+      }
+      handleFrame(c, static_cast<telemetry::FrameType>(h.type),
+                  c.in + off + sizeof(h), h.length);
+      off += sizeof(h) + h.length;
+    }
+    memmove(c.in, c.in + off, c.inLen - off);
+    c.inLen -= off;
+  }
+}
+
+// Fixed-size payloads may grow in later versions; only the part this
+// version knows is read.
+template <typename T> bool payload(const uint8_t *p, size_t len, T &out) {
+  if (len < sizeof(T)) {
+    return false;
+  }
+  memcpy(&out, p, sizeof(T));
+  return true;
+}
+
+void Aggregator::handleFrame(Conn &c, telemetry::FrameType type,
+                             const uint8_t *p, size_t len) {
+  if (type == telemetry::FrameType::HELLO) {
+    telemetry::Hello hello;
+    if (!payload(p, len, hello)) {
+      badFrames_++;
+      return;
+    }
+    const std::string name(hello.name,
+                           strnlen(hello.name, sizeof(hello.name)));
+    auto it = byName_.find(name);
+    if (it == byName_.end()) {
+      it = byName_.emplace(name, daemons_.size()).first;
+      daemons_.emplace_back();
+      daemons_.back().name = name;
+    }
+    Daemon &d = daemons_[it->second];
+    if (d.fd != -1 && d.fd != c.fd) {
+      // A restarted daemon can say hello before its old connection closes.
+      conns_[d.fd]->daemon = -1;
+    }
+    // Totals start again from the first STATS on this connection.
+    d.pid = hello.pid;
+    d.fd = c.fd;
+    d.motion = d.runs = d.disallowed = d.aborts = 0;
+    d.latencyCount = d.latencySumUs = d.latencyMaxUs = 0;
+    c.daemon = it->second;
+    return;
+  }
+  if (c.daemon == -1) {
+    badFrames_++; // Nothing is accepted before HELLO.
+    return;
+  }
+
+  Daemon &d = daemons_[c.daemon];
+  switch (type) {
+    case telemetry::FrameType::STATE: {
+      telemetry::State s;
+      if (!payload(p, len, s)) {
+        badFrames_++;
+        break;
+      }
+      if (d.state != s.state) {
+        if (d.state != -1) {
+          history_.push_back(Transition{s.timeUs, uint32_t(c.daemon),
+                                        uint8_t(d.state), s.state});
+          if (history_.size() > kHistory) {
+            history_.pop_front();
+          }
+          d.transitions++;
+        }
+        d.state = s.state;
+        d.sinceUs = s.timeUs;
+      }
+      break;
+    }
+    case telemetry::FrameType::STATS: {
+      telemetry::Stats s;
+      if (!payload(p, len, s)) {
+        badFrames_++;
+        break;
+      }
+      d.motion += s.motion;
+      d.runs += s.runs;
+      d.disallowed += s.disallowed;
+      d.aborts += s.aborts;
+      break;
+    }
+    case telemetry::FrameType::LATENCY: {
+      telemetry::Latency l;
+      if (!payload(p, len, l)) {
+        badFrames_++;
+        break;
+      }
+      d.latencyCount += l.count;
+      d.latencySumUs += l.sumUs;
+      d.latencyMaxUs = std::max(d.latencyMaxUs, l.maxUs);
+      break;
+    }
+    default:
+      break; // From a newer daemon.
+  }
+}
+
+void Aggregator::readQuery(Conn &c) {
+  const ssize_t n = read(c.fd, c.in + c.inLen, sizeof(c.in) - 1 - c.inLen);
+  if (n <= 0) {
+    if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+      drop(c);
+    }
+    return;
+  }
+  c.inLen += n;
+  c.in[c.inLen] = 0;
+  char *nl = strchr(reinterpret_cast<char *>(c.in), '\n');
+  if (!nl && c.inLen < sizeof(c.in) - 1) {
+    return; // Wait for the rest of the line.
+  }
+  if (nl) {
+    *nl = 0;
+  }
+  answer(reinterpret_cast<char *>(c.in), c.out);
+
+  struct epoll_event ev = {};
+  ev.events = EPOLLOUT;
+  ev.data.fd = c.fd;
+  epoll_ctl(epfd_, EPOLL_CTL_MOD, c.fd, &ev);
+  writeOut(c);
+}
+
+void Aggregator::writeOut(Conn &c) {
+  while (c.outOff < c.out.size()) {
+    const ssize_t n =
+        send(c.fd, c.out.data() + c.outOff, c.out.size() - c.outOff,
+             MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EINTR) {
+        return; // EPOLLOUT brings us back.
+      }
+      break;
+    }
+    c.outOff += n;
+  }
+  drop(c);
+}
+
+void appendf(std::string &out, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void appendf(std::string &out, const char *fmt, ...) {
+  char buf[256];
+  va_list ap;
+  va_start(ap, fmt);
+  const int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  out.append(buf, std::min<size_t>(std::max(n, 0), sizeof(buf) - 1));
+}
+
+void Aggregator::answer(const char *line, std::string &out) const {
+  char cmd[16] = {}, name[64] = {};
+  unsigned n = 20;
+  sscanf(line, "%15s %63s %u", cmd, name, &n);
+  if (!strcmp(cmd, "history") && name[0] >= '0' && name[0] <= '9') {
+    n = atoi(name); // "history N"
+    name[0] = 0;
+  }
+
+  if (!strcmp(cmd, "status")) {
+    uint64_t motion = 0, runs = 0, disallowed = 0, aborts = 0;
+    uint64_t latencyCount = 0, latencySumUs = 0, connected = 0;
+    uint32_t latencyMaxUs = 0;
+    uint64_t inState[kNumStates] = {};
+    appendf(out, "%-24s %-8s %-9s %8s %8s %8s %8s %10s %10s\n", "daemon",
+            "pid", "state", "motion", "runs", "disallow", "aborts",
+            "latency-ms", "max-ms");
+    for (const auto &d : daemons_) {
+      appendf(out, "%-24s %-8u %-9s %8llu %8llu %8llu %8llu %10.1f %10.1f\n",
+              d.name.c_str(), d.pid,
+              d.fd != -1 ? stateName(d.state) : "(gone)",
+              (unsigned long long)d.motion, (unsigned long long)d.runs,
+              (unsigned long long)d.disallowed, (unsigned long long)d.aborts,
+              d.latencyCount ? d.latencySumUs / 1e3 / d.latencyCount : 0.0,
+              d.latencyMaxUs / 1e3);
+      motion += d.motion;
+      runs += d.runs;
+      disallowed += d.disallowed;
+      aborts += d.aborts;
+      latencyCount += d.latencyCount;
+      latencySumUs += d.latencySumUs;
+      latencyMaxUs = std::max(latencyMaxUs, d.latencyMaxUs);
+      if (d.fd != -1) {
+        connected++;
+        if (d.state >= 0 && size_t(d.state) < kNumStates) {
+          inState[d.state]++;
+        }
+      }
+    }
+    appendf(out, "%-24s %-8s %-9s %8llu %8llu %8llu %8llu %10.1f %10.1f\n",
+            "TOTAL", "", "", (unsigned long long)motion,
+            (unsigned long long)runs, (unsigned long long)disallowed,
+            (unsigned long long)aborts,
+            latencyCount ? latencySumUs / 1e3 / latencyCount : 0.0,
+            latencyMaxUs / 1e3);
+    appendf(out, "%llu of %zu daemons connected:",
+            (unsigned long long)connected, daemons_.size());
+    for (size_t s = 0; s < kNumStates; ++s) {
+      appendf(out, " %s %llu", kStates[s], (unsigned long long)inState[s]);
+    }
+    appendf(out, "; %llu bad frames\n", (unsigned long long)badFrames_);
+  } else if (!strcmp(cmd, "history")) {
+    std::vector<const Transition *> picked;
+    for (auto it = history_.rbegin();
+         it != history_.rend() && picked.size() < n; ++it) {
+      if (!name[0] || daemons_[it->daemon].name == name) {
+        picked.push_back(&*it);
+      }
+    }
+    for (auto it = picked.rbegin(); it != picked.rend(); ++it) {
+      const Transition &t = **it;
+      const time_t secs = t.timeUs / 1000000;
+      struct tm tm;
+      char when[32];
+      localtime_r(&secs, &tm);
+      strftime(when, sizeof(when), "%F %T", &tm);
+      appendf(out, "%s.%03u %-24s %s -> %s\n", when,
+              unsigned(t.timeUs / 1000 % 1000),
+              daemons_[t.daemon].name.c_str(), stateName(t.from),
+              stateName(t.to));
+    }
+  } else {
+    appendf(out, "Unknown query '%s'; try status or history [NAME] [N].\n",
+            line);
+  }
+}
+
+// Sends line to the query socket and returns the answer in out.
+bool ask(const char *path, const char *line, std::string &out) {
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path %s is too long\n", path);
+    return false;
+  }
+  strcpy(addr.sun_path, path);
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1 ||
+      connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) ==
+          -1) {
+    fprintf(stderr, "Cannot connect to %s: %s\n", path, strerror(errno));
+    if (fd != -1) {
+      close(fd);
+    }
+    return false;
+  }
+  const std::string request = std::string(line) + "\n";
+  if (write(fd, request.data(), request.size()) != ssize_t(request.size())) {
+    fprintf(stderr, "Cannot send query: %s\n", strerror(errno));
+    close(fd);
+    return false;
+  }
+  char buf[4096];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    out.append(buf, n);
+  }
+  close(fd);
+  return true;
+}
+
+} // namespace
+
+#ifdef AGGREGATOR_TEST
+// Many simulated daemons, each a real TelemetryClient on its own socket,
+// stream to an aggregator over localhost; the merged view must add up.
+#include "TelemetryClient.h"
+
+#include <cassert>
+#include <spdlog/spdlog.h>
+#include <thread>
+
+int main(void) {
+  spdlog::set_level(spdlog::level::warn);
+  static constexpr int kDaemons = 300;
+  const char *telemetryPath = "/tmp/blatagg-test.telemetry.sock";
+  const char *queryPath = "/tmp/blatagg-test.query.sock";
+
+  Aggregator agg;
+  assert(agg.open(telemetryPath, queryPath));
+  std::thread server([&agg] { agg.run(); });
+
+  using State = BlatMachine::State;
+  std::vector<std::unique_ptr<TelemetryClient>> daemons;
+  std::vector<BlatStats> stats(kDaemons);
+  for (int i = 0; i < kDaemons; ++i) {
+    daemons.push_back(std::make_unique<TelemetryClient>(
+        telemetryPath, "room" + std::to_string(i),
+        std::chrono::milliseconds(0)));
+    daemons.back()->update(State::ARMED, stats[i],
+                           std::chrono::microseconds(0));
+    assert(daemons.back()->connected());
+  }
+
+  // Each daemon sees motion and a run; every third one is vetoed instead,
+  // with a latency of (1 + i % 5) ms.
+  for (int i = 0; i < kDaemons; ++i) {
+    auto &d = *daemons[i];
+    auto &s = stats[i];
+    s.motion++;
+    d.update(State::SCANNING, s, std::chrono::microseconds(0));
+    if (i % 3 == 0) {
+      s.disallowed++;
+      d.update(State::GRACE, s, std::chrono::milliseconds(1 + i % 5));
+    } else {
+      s.runs++;
+      d.update(State::RUNNING, s, std::chrono::microseconds(0));
+      d.update(State::GRACE, s, std::chrono::microseconds(0));
+    }
+    d.update(State::ARMED, s, std::chrono::microseconds(0));
+  }
+
+  // One daemon goes away and comes back; its totals must not double.
+  daemons[1] = std::make_unique<TelemetryClient>(
+      telemetryPath, "room1", std::chrono::milliseconds(0));
+  daemons[1]->update(State::ARMED, stats[1], std::chrono::microseconds(0));
+
+  // Queries are answered in order with telemetry already received, so give
+  // the server a moment to drain the client sockets first.
+  std::string status;
+  for (int tries = 0; tries < 100; ++tries) {
+    usleep(20000);
+    status.clear();
+    const bool asked = ask(queryPath, "status", status);
+    assert(asked);
+    if (status.find("300 of 300 daemons connected: ARMED 300") !=
+        std::string::npos) {
+      break;
+    }
+  }
+  printf("%s", status.substr(status.find("TOTAL")).c_str());
+  // 100 vetoes with latencies averaging 3ms, at most 5ms.
+  assert(status.find("TOTAL") != std::string::npos);
+  unsigned long long motion, runs, disallowed, aborts;
+  double mean, max;
+  assert(sscanf(status.c_str() + status.find("TOTAL"),
+                "TOTAL %llu %llu %llu %llu %lf %lf", &motion, &runs,
+                &disallowed, &aborts, &mean, &max) == 6);
+  assert(motion == kDaemons && runs == 200 && disallowed == 100);
+  assert(aborts == 0 && max == 5.0 && mean > 2.9 && mean < 3.1);
+  assert(status.find("300 of 300 daemons connected: ARMED 300") !=
+         std::string::npos);
+
+  std::string history;
+  const bool asked = ask(queryPath, "history room3 10", history);
+  assert(asked);
+  printf("%s", history.c_str());
+  assert(history.find("room3    ") != std::string::npos);
+  assert(history.find("SCANNING -> GRACE") != std::string::npos);
+  assert(history.find("room4") == std::string::npos);
+
+  agg.stop();
+  server.join();
+  puts("Aggregator OK.");
+  return 0;
+}
+
+#else
+
+Aggregator *gAggregator;
+
+void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  -t, --telemetry PATH  socket daemons stream to (default %s)\n"
+          "  -Q, --query-socket PATH\n"
+          "                        socket answering queries (default %s)\n"
+          "  -q, --query LINE      ask a running blatagg, e.g. \"status\" or\n"
+          "                        \"history kitchen 50\", and exit\n",
+          argv0, kDefaultTelemetry, kDefaultQuery);
+}
+
+int main(int argc, char *argv[]) {
+  static constexpr struct option long_options[] = {
+      {"telemetry", required_argument, nullptr, 't'},
+      {"query-socket", required_argument, nullptr, 'Q'},
+      {"query", required_argument, nullptr, 'q'},
+      {"help", no_argument, nullptr, 'h'},
+      {nullptr, 0, nullptr, 0},
+  };
+  const char *telemetryPath = kDefaultTelemetry;
+  const char *queryPath = kDefaultQuery;
+  const char *line = nullptr;
+  int ch;
+
+  while ((ch = getopt_long(argc, argv, "t:Q:q:h", long_options, nullptr)) !=
+         -1) {
+    switch (ch) {
+      case 't':
+        telemetryPath = optarg;
+        break;
+      case 'Q':
+        queryPath = optarg;
+        break;
+      case 'q':
+        line = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        return ch == 'h' ? 0 : 1;
+    }
+  }
+  if (line) {
+    std::string answer;
+    if (!ask(queryPath, line, answer)) {
+      return 1;
+    }
+    fputs(answer.c_str(), stdout);
+    return 0;
+  }
+
+  Aggregator agg;
+  if (!agg.open(telemetryPath, queryPath)) {
+    return 1;
+  }
+  // Stop cleanly so that the sockets are unlinked.
+  gAggregator = &agg;
+  signal(SIGTERM, [](int) { gAggregator->stop(); });
+  signal(SIGINT, [](int) { gAggregator->stop(); });
+  return agg.run();
+}
+
+#endif
@@ -0,0 +1,717 @@
+#include "BlatMachine.h"
+#include "Trace.h"
+
+#include <iterator>
+#include <spdlog/spdlog.h>
+
+BlatMachine::BlatMachine(BlatActions &actions, BlatTimings timings,
+                         StatsStore *store, State initial)
+    : actions_(actions), timings_(timings), store_(store), state_(initial) {
+  if (store_) {
+    const auto t = store_->lifetime();
+    stats_.motion = t.motion;
+    stats_.runs = t.runs;
+    stats_.disallowed = t.disallowed;
+    stats_.aborts = t.aborts;
+  }
+}
+
+void BlatMachine::count(StatsStore::Counter c) {
+  switch (c) {
+    case StatsStore::Counter::MOTION:
+      stats_.motion++;
+      break;
+    case StatsStore::Counter::RUNS:
+      stats_.runs++;
+      break;
+    case StatsStore::Counter::DISALLOWED:
+      stats_.disallowed++;
+      break;
+    case StatsStore::Counter::ABORTS:
+      stats_.aborts++;
+      break;
+  }
+  if (store_) {
+    store_->add(c);
+  }
+}
+
+void BlatMachine::disallowed(std::chrono::microseconds latency) {
+  lastLatency_ = latency;
+  count(StatsStore::Counter::DISALLOWED);
+  if (store_) {
+    store_->addLatency(lastLatency_);
+  }
+}
+
+// When whatever is behind an event happened: the sender's timestamp if it
+// gave one that makes sense on our clock, otherwise now. Kernels before 5.7
+// stamp GPIO events with the wall clock, which fails the check.
+std::chrono::steady_clock::time_point BlatMachine::happened(int64_t ns) const {
+  static constexpr auto kMaxAge = std::chrono::seconds(1);
+  const auto now = actions_.now();
+  const std::chrono::steady_clock::time_point t{std::chrono::nanoseconds(ns)};
+  return ns && t <= now && now - t < kMaxAge ? t : now;
+}
+
+void BlatMachine::startPrewarm() {
+  prewarming_ = true;
+  prewarmSince_ = actions_.now();
+  actions_.startScanning(ScanSituation::IDLE);
+}
+
+bool BlatMachine::endPrewarm() {
+  if (!prewarming_) {
+    return false;
+  }
+  prewarming_ = false;
+  lastSighting_.reset();
+  prewarmStats_.scanTime +=
+      std::chrono::duration_cast<std::chrono::microseconds>(actions_.now() -
+                                                            prewarmSince_);
+  return true;
+}
+
+void BlatMachine::setPrewarm(bool enable) {
+  if (enable == prewarm_) {
+    return;
+  }
+  spdlog::info("Pre-warm scanning {}.", enable ? "on" : "off");
+  prewarm_ = enable;
+  if (enable) {
+    prewarmStats_.windows++;
+  }
+  if (state_ != State::ARMED) {
+    return; // Applied on the next return to ARMED.
+  }
+  if (enable) {
+    startPrewarm();
+  } else {
+    endPrewarm();
+    actions_.stopScanning();
+  }
+}
+
+void BlatMachine::transitionTo(State s) {
+  TRACE_SPAN("machine.transitionTo", static_cast<uint64_t>(s));
+  if (s != state_) {
+    spdlog::info("Transition state from {} -> {}", state_, s);
+    actions_.clearTimeout();
+    const bool warm = endPrewarm();
+    state_ = s;
+    switch (s) {
+      case State::ARMED:
+        actions_.setRelay(false);   // Should be a no-op... but can't hurt, eh?
+        actions_.stopScanning();    // likewise.
+        if (prewarm_) {
+          startPrewarm();
+        }
+        break;
+      case State::DISABLED:
+        actions_.setRelay(false);   // Should be a no-op... but can't hurt, eh?
+        actions_.stopScanning();    // likewise.
+        break;
+      case State::GRACE:
+        actions_.setRelay(false);
+        actions_.stopScanning();
+        actions_.setTimeout(Event::Timer::GRACE, timings_.grace);
+        break;
+      case State::RUNNING:
+        // NB: we do *not* stop scanning on this transition, so that if Nazbert
+        // wanders into range while running we detect it and halt ASAP. The
+        // decision is made though, so the radio can back off a little.
+        actions_.setScanSituation(ScanSituation::RUNNING_WATCH);
+        actions_.setRelay(true);
+        actions_.setTimeout(Event::Timer::RUN, timings_.run);
+        break;
+      case State::SCANNING:
+        warmScan_ = warm;
+        if (warm) {
+          // Already listening; just turn it up.
+          prewarmStats_.warmScans++;
+          actions_.setScanSituation(ScanSituation::DECISION_PENDING);
+        } else {
+          actions_.startScanning(ScanSituation::DECISION_PENDING);
+        }
+        actions_.setTimeout(Event::Timer::SCAN, timings_.scan);
+        break;
+    }
+    actions_.stateChanged();
+  } else {
+    spdlog::warn(
+        "Attempted to transition to state {} when already in that state.", s);
+  }
+}
+
+void BlatMachine::handle(Event const &e) {
+  spdlog::debug("Received event {} in state {}", e, state_);
+
+  switch (state_) {
+    case State::ARMED:
+      switch (e.type) {
+        case Event::Type::DISABLE:
+          transitionTo(State::DISABLED);
+          break;
+        case Event::Type::ENABLE:
+          spdlog::warn("Enable ignored in {} state.", state_);
+          break;
+        case Event::Type::DEVICE_READY:
+        case Event::Type::FORECAST:
+        case Event::Type::TELEMETRY:
+          spdlog::debug("Event {} ignored in {} state.", e, state_);
+          break;
+        case Event::Type::MOTION_DETECTED:
+          spdlog::info("Motion detected! Line {}.", e.motion().line);
+          count(StatsStore::Counter::MOTION);
+          motionEdges_ += e.motion().edges;
+          motionAt_ = happened(e.motion().timestampNs);
+          if (lastSighting_ && motionAt_ - *lastSighting_ <= timings_.scan) {
+            spdlog::warn("Nazbert was here {}ms ago, hold yer horses!",
+                         std::chrono::duration_cast<std::chrono::milliseconds>(
+                             motionAt_ - *lastSighting_)
+                             .count());
+            prewarmStats_.atOnce++;
+            disallowed(std::chrono::microseconds(0));
+            actions_.incident("disallowed while pre-warming");
+            transitionTo(State::GRACE);
+          } else {
+            transitionTo(State::SCANNING);
+          }
+          break;
+        case Event::Type::TIMEOUT:
+          spdlog::warn("Unexpected {} in ARMED state.", e);
+          break;
+        case Event::Type::NAZBERT_DETECTED:
+          if (prewarming_) {
+            spdlog::debug("Nazbert about while pre-warming: {}", e);
+            lastSighting_ = happened(e.nazbert().whenNs);
+            break;
+          }
+          spdlog::warn("Unexpected Nazbert in ARMED state: {}", e);
+          lastDisallowedBy_ = e.nazbert();
+          actions_.incident("Nazbert in ARMED state");
+          transitionTo(State::GRACE);
+          break;
+      }
+      break;
+
+    case State::DISABLED:
+      switch (e.type) {
+        case Event::Type::ENABLE:
+          transitionTo(State::ARMED);
+          break;
+        case Event::Type::DISABLE:
+        case Event::Type::MOTION_DETECTED:
+        case Event::Type::TIMEOUT:
+        case Event::Type::NAZBERT_DETECTED:
+        case Event::Type::DEVICE_READY:
+        case Event::Type::FORECAST:
+        case Event::Type::TELEMETRY:
+          spdlog::debug("Event {} ignored in {} state.", e, state_);
+          break;
+      }
+      break;
+
+    case State::GRACE:
+      switch (e.type) {
+        case Event::Type::DISABLE:
+          transitionTo(State::DISABLED);
+          break;
+        case Event::Type::ENABLE:
+          spdlog::warn("Enable ignored in {} state.", state_);
+          break;
+        case Event::Type::MOTION_DETECTED:
+        case Event::Type::NAZBERT_DETECTED:
+        case Event::Type::DEVICE_READY:
+        case Event::Type::FORECAST:
+        case Event::Type::TELEMETRY:
+          spdlog::debug("Event {} ignored in GRACE state.", e);
+          break;
+        case Event::Type::TIMEOUT:
+          transitionTo(State::ARMED);
+          break;
+      }
+      break;
+
+    case State::RUNNING:
+      switch (e.type) {
+        case Event::Type::DISABLE:
+          transitionTo(State::DISABLED);
+          break;
+        case Event::Type::ENABLE:
+          spdlog::warn("Enable ignored in {} state.", state_);
+          break;
+        case Event::Type::DEVICE_READY:
+        case Event::Type::FORECAST:
+        case Event::Type::TELEMETRY:
+          spdlog::debug("Event {} ignored in {} state.", e, state_);
+          break;
+        case Event::Type::MOTION_DETECTED:
+          spdlog::debug("Motion ignored, already in RUNNING state.");
+          break;
+        case Event::Type::TIMEOUT:
+          transitionTo(State::GRACE);
+          break;
+        case Event::Type::NAZBERT_DETECTED:
+          spdlog::warn("Nazbert detected while running oh noes :( {}", e);
+          lastDisallowedBy_ = e.nazbert();
+          count(StatsStore::Counter::ABORTS);
+          actions_.incident("aborted");
+          transitionTo(State::GRACE);
+          break;
+      }
+      break;
+
+    case State::SCANNING:
+      switch (e.type) {
+        case Event::Type::DISABLE:
+          transitionTo(State::DISABLED);
+          break;
+        case Event::Type::ENABLE:
+          spdlog::warn("Enable ignored in {} state.", state_);
+          break;
+        case Event::Type::DEVICE_READY:
+        case Event::Type::FORECAST:
+        case Event::Type::TELEMETRY:
+          spdlog::debug("Event {} ignored in {} state.", e, state_);
+          break;
+        case Event::Type::MOTION_DETECTED:
+          spdlog::info("Motion ignored in scanning state.");
+          break;
+        case Event::Type::TIMEOUT:
+          spdlog::info("Scanning timed out, game on!");
+          count(StatsStore::Counter::RUNS);
+          transitionTo(State::RUNNING);
+          break;
+        case Event::Type::NAZBERT_DETECTED:
+          spdlog::warn(
+              "Nazbert detected in SCANNING state, hold yer horses! {}", e);
+          lastDisallowedBy_ = e.nazbert();
+          const auto latency =
+              std::chrono::duration_cast<std::chrono::microseconds>(
+                  actions_.now() - motionAt_);
+          if (warmScan_) {
+            prewarmStats_.warmDisallowed++;
+            prewarmStats_.warmLatency += latency;
+          } else {
+            prewarmStats_.coldDisallowed++;
+            prewarmStats_.coldLatency += latency;
+          }
+          disallowed(latency);
+          actions_.incident("disallowed");
+          transitionTo(State::GRACE);
+          break;
+      }
+      break;
+  }
+}
+
+const char *BlatMachine::stateName(State s) {
+  switch (s) {
+    case BlatMachine::State::ARMED:
+      return "ARMED";
+    case BlatMachine::State::DISABLED:
+      return "DISABLED";
+    case BlatMachine::State::GRACE:
+      return "GRACE";
+    case BlatMachine::State::RUNNING:
+      return "RUNNING";
+    case BlatMachine::State::SCANNING:
+      return "SCANNING";
+  }
+  return "Impossible!";
+}
+
+void BlatMachine::formatStatus(StatusBuffer &buf) const {
+  auto out = std::back_inserter(buf);
+  fmt::format_to(out, "Current state: {}\n", stateName(state_));
+  fmt::format_to(out, "\n");
+  fmt::format_to(out, "Motion detected: {}\n", stats_.motion);
+  fmt::format_to(out, "Runs: {}\n", stats_.runs);
+  fmt::format_to(out, "Disallowed due to Nazbert: {}\n", stats_.disallowed);
+  fmt::format_to(out, "Aborted due to Nazbert: {}\n", stats_.aborts);
+  fmt::format_to(out, "Motion edges: {}\n", motionEdges_);
+  if (lastDisallowedBy_) {
+    auto const &n = *lastDisallowedBy_;
+    fmt::format_to(out,
+                   "Last stopped by: {:02X}:{:02X}:{:02X}:{:02X}:{:02X}:{:02X} "
+                   "RSSI {} on hci{}\n",
+                   n.addr[5], n.addr[4], n.addr[3], n.addr[2], n.addr[1],
+                   n.addr[0], n.rssi, n.adapter);
+  }
+
+  // Disallowed pre-warmed runs would otherwise have taken as long as the
+  // cold ones do, so that is what they saved.
+  const PrewarmStats &p = prewarmStats_;
+  const auto ms = [](std::chrono::microseconds us, unsigned n) {
+    return n ? us.count() / 1000.0 / n : 0.0;
+  };
+  fmt::format_to(out, "\n");
+  fmt::format_to(out,
+                 "Pre-warm: {}, windows {}, scanning {:.1f}s, warm scans {}, "
+                 "disallowed at once {}\n",
+                 prewarm_ ? "on" : "off", p.windows, p.scanTime.count() / 1e6,
+                 p.warmScans, p.atOnce);
+  fmt::format_to(out,
+                 "Disallow latency ms: cold {:.0f} ({}), warm {:.0f} ({}), "
+                 "at once 0 ({})\n",
+                 ms(p.coldLatency, p.coldDisallowed), p.coldDisallowed,
+                 ms(p.warmLatency, p.warmDisallowed), p.warmDisallowed,
+                 p.atOnce);
+  const unsigned helped = p.warmDisallowed + p.atOnce;
+  if (p.coldDisallowed && helped) {
+    const double cold = ms(p.coldLatency, p.coldDisallowed);
+    const double warm = ms(p.warmLatency, helped);
+    fmt::format_to(out,
+                   "Pre-warm saved (est.): SCANNING {:.1f}s, motion to "
+                   "decision {:.0f}ms -> {:.0f}ms\n",
+                   (cold - warm) * helped / 1000, cold, warm);
+  }
+}
+
+#ifdef ALLOC_TEST
+// Drives the state machine through every state with a fake scanner and
+// relay, and fails if anything touches the heap once the daemon would have
+// finished starting up. glibc's malloc family is interposed; operator new
+// goes through malloc so that is covered too. Stats are published, stored
+// and flushed, blats played and incidents dumped by the daemon's own code,
+// and the scanner's parser is run on captured advertising reports.
+#include "Config.h"
+#include "DaemonStatus.h"
+#include "Scanner.h"
+
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <spdlog/sinks/basic_file_sink.h>
+#include <thread>
+#include <vector>
+
+extern "C" {
+void *__libc_malloc(size_t);
+void *__libc_calloc(size_t, size_t);
+void *__libc_realloc(void *, size_t);
+void *__libc_memalign(size_t, size_t);
+void __libc_free(void *);
+}
+
+static std::atomic<bool> gArmed{false};
+static std::atomic<unsigned long> gAllocs{0};
+
+static inline void noteAlloc() {
+  if (gArmed.load(std::memory_order_relaxed)) {
+    gAllocs.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+extern "C" {
+void *malloc(size_t n) {
+  noteAlloc();
+  return __libc_malloc(n);
+}
+void *calloc(size_t n, size_t m) {
+  noteAlloc();
+  return __libc_calloc(n, m);
+}
+void *realloc(void *p, size_t n) {
+  noteAlloc();
+  return __libc_realloc(p, n);
+}
+void *memalign(size_t a, size_t n) {
+  noteAlloc();
+  return __libc_memalign(a, n);
+}
+void *aligned_alloc(size_t a, size_t n) { return memalign(a, n); }
+int posix_memalign(void **p, size_t a, size_t n) {
+  *p = memalign(a, n);
+  return *p ? 0 : ENOMEM;
+}
+void free(void *p) { __libc_free(p); }
+}
+
+// Stands in for PounceBlat: a persistent fake scanner thread which reports
+// Nazbert whenever he is "in range" and a scan is running. Everything else
+// is the daemon's.
+class FakeBlat : public BlatActions, private RelayChannels {
+public:
+  FakeBlat(StatsStore &store, FlightRecorder &recorder)
+      : store_(store), recorder_(recorder),
+        profiler_(std::chrono::milliseconds(20)), scanning_(false),
+        nazbertNear_(false), shutdown_(false),
+        scanThread_([this] { this->scanThread(); }) {
+    assert(BlatPattern::parse("1:1/1x2 2:1", pattern_));
+  }
+  ~FakeBlat() {
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      shutdown_ = true;
+    }
+    cv_.notify_all();
+    scanThread_.join();
+  }
+
+  void setRelay(bool enable) override {
+    if (!enable) {
+      patterns_.stop();
+      relay_ = false;
+    } else {
+      patterns_.play(*this, pattern_);
+    }
+  }
+  void startScanning(ScanSituation) override {
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      scanning_ = true;
+    }
+    cv_.notify_all();
+  }
+  void setScanSituation(ScanSituation) override {}
+  void stopScanning() override {
+    std::lock_guard<std::mutex> lock(lock_);
+    scanning_ = false;
+  }
+  void setTimeout(Event::Timer which,
+                  std::chrono::milliseconds delay) override {
+    eq.setTimeout(which, delay);
+  }
+  void clearTimeout() override { eq.clearTimeout(); }
+  void stateChanged() override {
+    StatusBuffer buf;
+    DaemonStatus{*machine, &store_, profiler_, patterns_, forecast_,
+                 &recorder_}
+        .publish(buf);
+    writeStatusFile("/dev/shm/pounceblat-alloc-test.status", buf);
+  }
+  void incident(const char *what) override { recorder_.dump(what); }
+
+  void setNazbertNear(bool near) {
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      nazbertNear_ = near;
+    }
+    cv_.notify_all();
+  }
+
+  EventQueue eq;
+  BlatMachine *machine = nullptr;
+  std::atomic<bool> relay_{false};
+  std::atomic<bool> prewarm{false}; // Applied on FORECAST.
+
+private:
+  void scanThread() {
+    std::unique_lock<std::mutex> lock(lock_);
+    while (!shutdown_) {
+      cv_.wait_for(lock, std::chrono::milliseconds(1));
+      if (scanning_ && nazbertNear_) {
+        const auto when = std::chrono::steady_clock::now().time_since_epoch();
+        Event::Nazbert n{{0x66, 0x7e, 0x5b, 0x32, 0x15, 0xf1}, -60, 0, 0};
+        n.whenNs =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(when).count();
+        eq.send(Event::nazbertDetected(n));
+      }
+    }
+  }
+
+  int setChannel(unsigned, bool enable) override {
+    relay_ = enable;
+    return 0;
+  }
+
+  StatsStore &store_;
+  FlightRecorder &recorder_;
+  SelfProfiler profiler_;
+  PatternScheduler patterns_;
+  ActivityForecast forecast_;
+  BlatPattern pattern_;
+  std::mutex lock_;
+  std::condition_variable cv_;
+  bool scanning_;
+  bool nazbertNear_;
+  bool shutdown_;
+  std::thread scanThread_;
+};
+
+// An LE advertising report event as read from the HCI socket.
+static std::vector<uint8_t> advertisingReport(BdAddr const &addr,
+                                              int8_t rssi) {
+  static constexpr uint8_t kData[] = {0x02, 0x01, 0x06, 0x03, 0x03, 0xaa,
+                                      0xfe};
+  std::vector<uint8_t> p = {0x04, 0x3e, 0, 0x02, 1, 0x00, 0x00};
+  p.insert(p.end(), addr.begin(), addr.end());
+  p.push_back(sizeof(kData));
+  p.insert(p.end(), kData, kData + sizeof(kData));
+  p.push_back(uint8_t(rssi));
+  p[2] = p.size() - 3;
+  return p;
+}
+
+// What the scan thread does with a batch of packets, minus the socket.
+static void scanPackets(Config const &config, FlightRecorder &recorder,
+                        std::vector<std::vector<uint8_t>> const &packets) {
+  EventQueue eq;
+  std::optional<Scanner::Clock::time_point> firstSighting;
+  unsigned reports = 0;
+  for (auto const &p : packets) {
+    recorder.record(p.data(), p.size(), 0);
+    reports += Scanner::parsePacket(config, 0, ScanSituation::DECISION_PENDING,
+                                    eq, p.data(), p.size(), firstSighting);
+  }
+  assert(reports == packets.size() && firstSighting);
+  const Event e = eq.wait();
+  assert(e.type == Event::Type::NAZBERT_DETECTED && e.nazbert().rssi == -60);
+}
+
+static void waitForState(BlatMachine const &m, BlatMachine::State s) {
+  const auto giveUp =
+      std::chrono::steady_clock::now() + std::chrono::seconds(2);
+  while (m.state() != s) {
+    assert(std::chrono::steady_clock::now() < giveUp);
+    std::this_thread::sleep_for(std::chrono::microseconds(200));
+  }
+}
+
+// One lap through every state and transition the daemon normally makes.
+static void lap(FakeBlat &blat, BlatMachine const &m) {
+  using State = BlatMachine::State;
+  static constexpr Event md{.type = Event::Type::MOTION_DETECTED};
+  static constexpr Event en{.type = Event::Type::ENABLE};
+  static constexpr Event dis{.type = Event::Type::DISABLE};
+  static constexpr Event fc{.type = Event::Type::FORECAST};
+
+  // Coast is clear: scan, run, grace, back to armed.
+  blat.eq.send(md);
+  waitForState(m, State::RUNNING);
+  waitForState(m, State::GRACE);
+  waitForState(m, State::ARMED);
+
+  // Nazbert about: disallowed.
+  blat.setNazbertNear(true);
+  blat.eq.send(md);
+  waitForState(m, State::GRACE);
+  blat.setNazbertNear(false);
+  waitForState(m, State::ARMED);
+
+  // Nazbert turns up mid-run: abort.
+  blat.eq.send(md);
+  waitForState(m, State::RUNNING);
+  blat.setNazbertNear(true);
+  waitForState(m, State::GRACE);
+  blat.setNazbertNear(false);
+  waitForState(m, State::ARMED);
+
+  // Pre-warmed: Nazbert heard before the motion means no scan at all...
+  blat.prewarm = true;
+  blat.eq.send(fc);
+  blat.setNazbertNear(true);
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  blat.eq.send(md);
+  waitForState(m, State::GRACE);
+  blat.setNazbertNear(false);
+  waitForState(m, State::ARMED);
+
+  // ...and otherwise the scan is already running.
+  blat.eq.send(md);
+  waitForState(m, State::RUNNING);
+  waitForState(m, State::GRACE);
+  waitForState(m, State::ARMED);
+  blat.prewarm = false;
+  blat.eq.send(fc);
+
+  // Motion flood while disabled, then back on.
+  blat.eq.send(dis);
+  waitForState(m, State::DISABLED);
+  for (int i = 0; i < 100; ++i) {
+    blat.eq.send(md);
+  }
+  // ENABLE discards whatever is left of it, so no scan follows.
+  blat.eq.send(en);
+  waitForState(m, State::ARMED);
+}
+
+int main(void) {
+  spdlog::set_default_logger(
+      spdlog::basic_logger_mt("alloc-test", "/dev/null"));
+  spdlog::set_level(spdlog::level::debug);
+
+  BlatTimings timings;
+  timings.grace = std::chrono::milliseconds(20);
+  timings.scan = std::chrono::milliseconds(10);
+  timings.run = std::chrono::milliseconds(10);
+
+  char dir[] = "/tmp/pounceblat-alloc-test-XXXXXX";
+  assert(mkdtemp(dir));
+  const std::string statsPath = std::string(dir) + "/stats";
+  ConfigWatcher config;
+  ConfigWatcher::Reader reader = config.reader();
+  StatsStore store(statsPath.c_str());
+  FlightRecorder recorder(dir, std::chrono::seconds(2));
+
+  std::vector<std::vector<uint8_t>> packets;
+  for (int i = 0; i < 64; ++i) {
+    const BdAddr stranger = {uint8_t(i), 0x22, 0x33, 0x44, 0x55, 0x66};
+    packets.push_back(advertisingReport(stranger, -50));
+  }
+  packets.push_back(advertisingReport(reader->blessedDevices[0], -60));
+
+  FakeBlat blat(store, recorder);
+  BlatMachine machine(blat, timings, &store);
+  blat.machine = &machine;
+
+  std::atomic<bool> done{false};
+  std::thread dispatch([&] {
+    while (!done) {
+      const Event e = blat.eq.wait();
+      reader.refresh();
+      if (e.type == Event::Type::FORECAST) {
+        machine.setPrewarm(blat.prewarm);
+      }
+      machine.handle(e);
+    }
+  });
+
+  // First lap is part of startup: it gets one-time lazy initialisation
+  // (time zone data, stdio, ...) out of the way.
+  lap(blat, machine);
+  scanPackets(*reader, recorder, packets);
+  while (recorder.stats().dumps == 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  gArmed = true;
+  static constexpr int kLaps = 50;
+  for (int i = 0; i < kLaps; ++i) {
+    lap(blat, machine);
+    scanPackets(*reader, recorder, packets);
+  }
+  gArmed = false;
+
+  done = true;
+  blat.eq.send(Event{.type = Event::Type::ENABLE});
+  dispatch.join();
+
+  const auto &st = machine.stats();
+  const auto &pw = machine.prewarmStats();
+  printf("%d laps: motion %llu runs %llu disallowed %llu aborts %llu\n",
+         kLaps, (unsigned long long)st.motion, (unsigned long long)st.runs,
+         (unsigned long long)st.disallowed, (unsigned long long)st.aborts);
+  printf("Pre-warmed: disallowed at once %u, warm scans %u\n", pw.atOnce,
+         pw.warmScans);
+  assert(pw.atOnce == kLaps + 1 && pw.warmScans == kLaps + 1);
+  const auto fr = recorder.stats();
+  printf("Flight recorder: %u dumps, %u folded\n", fr.dumps, fr.folded);
+  assert(fr.dumps > 1);
+  for (unsigned i = 0; i < FlightRecorder::kMaxDumps; ++i) {
+    unlink(recorder.dumpPath(i).c_str());
+  }
+  unlink(statsPath.c_str());
+  rmdir(dir);
+  if (gAllocs) {
+    printf("FAIL: %lu allocations after startup.\n", gAllocs.load());
+    return 1;
+  }
+  puts("No allocations after startup.");
+  return 0;
+}
+#endif
@@ -0,0 +1,134 @@
+#pragma once
+
+#include "EventQueue.h"
+#include "ScanScheduler.h"
+#include "StatsStore.h"
+#include "StatusBuffer.h"
+
+#include <chrono>
+#include <optional>
+
+// Lifetime counts, as wide as StatsStore keeps them.
+struct BlatStats {
+  uint64_t motion = 0;
+  uint64_t runs = 0;
+  uint64_t disallowed = 0;
+  uint64_t aborts = 0;
+};
+
+// Pre-warm scanning, and what it bought versus starting every scan from
+// cold on motion.
+struct PrewarmStats {
+  unsigned windows = 0;                  // Times pre-warming was switched on.
+  std::chrono::microseconds scanTime{0}; // Spent scanning while ARMED.
+  unsigned atOnce = 0;    // Motion disallowed on an earlier sighting.
+  unsigned warmScans = 0; // SCANNING entered with the scan already running.
+  // Motion to decision for disallowed runs, by how their scan started.
+  unsigned coldDisallowed = 0;
+  std::chrono::microseconds coldLatency{0};
+  unsigned warmDisallowed = 0;
+  std::chrono::microseconds warmLatency{0};
+};
+
+struct BlatTimings {
+  std::chrono::milliseconds grace{10000};
+  std::chrono::milliseconds scan{5000};
+  std::chrono::milliseconds run{5000};
+};
+
+// Everything the state machine does to the world outside it. PounceBlat
+// implements this with real devices; tests and tools substitute their own.
+class BlatActions {
+public:
+  virtual ~BlatActions() {}
+
+  virtual void setRelay(bool enable) = 0;
+  virtual void startScanning(ScanSituation situation) = 0;
+  virtual void setScanSituation(ScanSituation situation) = 0;
+  virtual void stopScanning() = 0;
+  virtual void setTimeout(Event::Timer which,
+                          std::chrono::milliseconds delay) = 0;
+  virtual void clearTimeout() = 0;
+  virtual void stateChanged() = 0; // Time to publish stats.
+  // Nazbert stopped or aborted a blat; what is a literal saying how.
+  virtual void incident(const char *what) {}
+
+  // The machine's clock; blatsim runs it on virtual time.
+  virtual std::chrono::steady_clock::time_point now() const {
+    return std::chrono::steady_clock::now();
+  }
+};
+
+// The pounce/blat state machine, free of any hardware.
+class BlatMachine {
+public:
+  enum class State { ARMED, DISABLED, GRACE, RUNNING, SCANNING };
+
+  // If store is given, counters start from its lifetime totals and every
+  // change is recorded there too. The initial state is entered without
+  // calling any actions, so it should be ARMED or DISABLED.
+  explicit BlatMachine(BlatActions &actions, BlatTimings timings = {},
+                       StatsStore *store = nullptr,
+                       State initial = State::ARMED);
+
+  void handle(Event const &e);
+
+  State state() const { return state_; }
+  BlatStats const &stats() const { return stats_; }
+  // Motion to decision, for the latest run disallowed by a detection.
+  std::chrono::microseconds lastLatency() const { return lastLatency_; }
+  BlatTimings const &timings() const { return timings_; }
+  // Applies from the next timeout set, i.e. the next transition.
+  void setTimings(BlatTimings const &timings) { timings_ = timings; }
+
+  // While pre-warming, ARMED keeps an IDLE scan running, so that motion
+  // with Nazbert sighted within the last scan timeout is disallowed at
+  // once, and otherwise SCANNING starts with the radio already listening.
+  // Runs still need a full SCANNING timeout with no sighting.
+  void setPrewarm(bool enable);
+  PrewarmStats const &prewarmStats() const { return prewarmStats_; }
+
+  void formatStatus(StatusBuffer &buf) const;
+
+  static const char *stateName(State s);
+
+private:
+  void transitionTo(State s);
+  void count(StatsStore::Counter c);
+  void startPrewarm();
+  bool endPrewarm(); // Returns whether the scan was running.
+  void disallowed(std::chrono::microseconds latency);
+  std::chrono::steady_clock::time_point happened(int64_t ns) const;
+
+  BlatActions &actions_;
+  BlatTimings timings_;
+  StatsStore *store_;
+  State state_;
+  BlatStats stats_;
+  std::chrono::steady_clock::time_point motionAt_; // Behind SCANNING.
+  uint64_t motionEdges_ = 0;
+  std::optional<Event::Nazbert> lastDisallowedBy_;
+  std::chrono::microseconds lastLatency_{0};
+
+  bool prewarm_ = false;    // Wanted.
+  bool prewarming_ = false; // ARMED and scanning.
+  bool warmScan_ = false;   // The SCANNING in progress started warm.
+  std::chrono::steady_clock::time_point prewarmSince_;
+  std::optional<std::chrono::steady_clock::time_point> lastSighting_;
+  PrewarmStats prewarmStats_;
+};
+
+template <> struct fmt::formatter<BlatMachine::State> {
+  constexpr auto parse(format_parse_context &ctx) {
+    auto it = ctx.begin();
+    if (it != ctx.end() && *it != '}') {
+      throw format_error("invalid format");
+    }
+    return it;
+  }
+
+  template <typename FormatContext>
+  auto format(const BlatMachine::State &s, FormatContext &ctx) {
+    return format_to(ctx.out(), "{}", BlatMachine::stateName(s));
+  }
+};
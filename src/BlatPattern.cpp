@@ -0,0 +1,434 @@
+#include "BlatPattern.h"
+#include "Trace.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <new>
+#include <poll.h>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+using std::chrono::milliseconds;
+
+milliseconds BlatPattern::Step::on(unsigned pulse) const {
+  if (repeat <= 1) {
+    return milliseconds(onFirstMs);
+  }
+  const int64_t span = int64_t(onLastMs) - onFirstMs;
+  return milliseconds(onFirstMs + span * pulse / (repeat - 1));
+}
+
+milliseconds BlatPattern::Step::off(unsigned pulse) const {
+  return periodMs ? milliseconds(periodMs) - on(pulse) : milliseconds(offMs);
+}
+
+milliseconds BlatPattern::duration() const {
+  milliseconds total{0};
+  for (size_t s = 0; s < count; ++s) {
+    for (unsigned i = 0; i < steps[s].repeat; ++i) {
+      total += steps[s].on(i) + steps[s].off(i);
+    }
+  }
+  return total;
+}
+
+// Reads a decimal number of at most max from *p, advancing it.
+static bool parseUnsigned(const char *&p, unsigned long max, uint32_t &out) {
+  if (*p < '0' || *p > '9') {
+    return false;
+  }
+  char *end;
+  errno = 0;
+  const unsigned long n = strtoul(p, &end, 10);
+  if (errno || n > max) {
+    return false;
+  }
+  p = end;
+  out = n;
+  return true;
+}
+
+static bool parseStep(const char *p, BlatPattern::Step &step,
+                      const char *&why) {
+  static constexpr unsigned long kMaxMs = 10 * 60 * 1000;
+  uint32_t channel, repeat = 1;
+  step = {};
+  why = "expected CH:";
+  if (!parseUnsigned(p, 4, channel) || *p++ != ':') {
+    return false;
+  }
+  why = "expected a time in ms";
+  if (!parseUnsigned(p, kMaxMs, step.onFirstMs)) {
+    return false;
+  }
+  step.onLastMs = step.onFirstMs;
+  const bool ramp = *p == '-';
+  if (ramp && !parseUnsigned(++p, kMaxMs, step.onLastMs)) {
+    return false;
+  }
+  if (*p == '/') {
+    if (!parseUnsigned(++p, kMaxMs, ramp ? step.periodMs : step.offMs)) {
+      return false;
+    }
+  } else if (ramp) {
+    why = "a ramp needs a /PERIOD";
+    return false;
+  }
+  if (*p == 'x' && !parseUnsigned(++p, UINT16_MAX, repeat)) {
+    why = "expected a repeat count";
+    return false;
+  }
+  if (*p) {
+    why = "unexpected characters";
+    return false;
+  }
+  if (ramp && step.periodMs < std::max(step.onFirstMs, step.onLastMs)) {
+    why = "ramp period is shorter than its longest pulse";
+    return false;
+  }
+  if (!repeat) {
+    why = "repeat count must be at least 1";
+    return false;
+  }
+  step.channel = channel;
+  step.repeat = repeat;
+  return true;
+}
+
+bool BlatPattern::parse(const char *text, BlatPattern &pattern) {
+  BlatPattern p;
+  std::string copy(text);
+  char *save;
+  for (char *tok = strtok_r(copy.data(), " \t", &save); tok;
+       tok = strtok_r(nullptr, " \t", &save)) {
+    if (p.count == kMaxSteps) {
+      spdlog::error("Blat pattern has more than {} steps.", kMaxSteps);
+      return false;
+    }
+    const char *why;
+    if (!parseStep(tok, p.steps[p.count], why)) {
+      spdlog::error("Bad blat pattern step '{}': {}.", tok, why);
+      return false;
+    }
+    p.count++;
+  }
+  pattern = p;
+  return true;
+}
+
+namespace {
+
+// Room for the frame of PatternScheduler::run(), which holds a copy of its
+// pattern. Only one runs at a time; the other is a spare.
+constexpr size_t kFrameSize = 1024;
+constexpr size_t kFrames = 2;
+alignas(std::max_align_t) uint8_t gFrames[kFrames][kFrameSize];
+std::atomic<bool> gFrameUsed[kFrames];
+
+} // namespace
+
+void *PatternTask::promise_type::operator new(size_t size) {
+  if (size <= kFrameSize) {
+    for (size_t i = 0; i < kFrames; ++i) {
+      if (!gFrameUsed[i].exchange(true, std::memory_order_acquire)) {
+        return gFrames[i];
+      }
+    }
+  }
+  return ::operator new(size);
+}
+
+void PatternTask::promise_type::operator delete(void *p, size_t size) {
+  for (size_t i = 0; i < kFrames; ++i) {
+    if (p == gFrames[i]) {
+      gFrameUsed[i].store(false, std::memory_order_release);
+      return;
+    }
+  }
+  ::operator delete(p, size);
+}
+
+PatternScheduler::PatternScheduler()
+    : stopping_(false), flow_(0), relay_(nullptr), channels_(0),
+      lateSum_(0) {
+  timerFd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timerFd_ == -1) {
+    spdlog::error("Cannot create pattern timer: {}", strerror(errno));
+    throw std::runtime_error("Cannot create pattern timer.");
+  }
+  wakeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wakeFd_ == -1) {
+    spdlog::error("Cannot create pattern eventfd: {}", strerror(errno));
+    close(timerFd_);
+    throw std::runtime_error("Cannot create pattern eventfd.");
+  }
+  thread_ = std::thread([this] { this->schedulerThread(); });
+}
+
+PatternScheduler::~PatternScheduler() {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    stopLocked();
+    stopping_ = true;
+  }
+  const uint64_t one = 1;
+  if (write(wakeFd_, &one, sizeof(one)) != sizeof(one)) {
+    spdlog::warn("Cannot wake pattern scheduler: {}", strerror(errno));
+  }
+  thread_.join();
+  close(wakeFd_);
+  close(timerFd_);
+}
+
+// Deadlines are absolute, so time spent switching relays or waking up late
+// is taken out of the next wait rather than accumulating along the pattern.
+PatternTask PatternScheduler::run(RelayChannels &relay, BlatPattern pattern) {
+  auto t = Clock::now();
+  for (size_t s = 0; s < pattern.count; ++s) {
+    const auto &step = pattern.steps[s];
+    for (unsigned i = 0; i < step.repeat; ++i) {
+      if (step.channel) {
+        channels_ |= 1 << step.channel;
+        relay.setChannel(step.channel, true);
+      }
+      t += step.on(i);
+      co_await sleepUntil(t);
+      if (step.channel) {
+        relay.setChannel(step.channel, false);
+      }
+      if (step.off(i).count()) {
+        t += step.off(i);
+        co_await sleepUntil(t);
+      }
+    }
+  }
+}
+
+void PatternScheduler::play(RelayChannels &relay, BlatPattern const &pattern) {
+  std::lock_guard<std::mutex> lock(lock_);
+  stopLocked();
+  relay_ = &relay;
+  flow_ = Tracer::flow();
+  schedule(run(relay, pattern).handle, Clock::now());
+  rearm();
+}
+
+void PatternScheduler::stop() {
+  std::lock_guard<std::mutex> lock(lock_);
+  stopLocked();
+  rearm();
+}
+
+void PatternScheduler::stopLocked() {
+  if (task_) {
+    task_.destroy(); // Suspended, since we hold the lock.
+    task_ = nullptr;
+  }
+  for (unsigned channel = 1; channel <= 4; ++channel) {
+    if (channels_ & 1 << channel) {
+      relay_->setChannel(channel, false);
+    }
+  }
+  channels_ = 0;
+}
+
+void PatternScheduler::rearm() {
+  struct itimerspec its = {};
+  if (task_) {
+    const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        deadline_.time_since_epoch())
+                        .count();
+    // 0 would disarm; a deadline that early is long past anyway.
+    its.it_value.tv_sec = ns / 1000000000;
+    its.it_value.tv_nsec = std::max<int64_t>(ns % 1000000000, 1);
+  }
+  if (timerfd_settime(timerFd_, TFD_TIMER_ABSTIME, &its, nullptr) == -1) {
+    spdlog::error("Cannot arm pattern timer: {}", strerror(errno));
+  }
+}
+
+void PatternScheduler::schedulerThread() {
+  Tracer::registerThread("patterns");
+  struct pollfd fds[2] = {{timerFd_, POLLIN, 0}, {wakeFd_, POLLIN, 0}};
+
+  while (1) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      spdlog::error("Pattern scheduler poll() failed: {}", strerror(errno));
+      return;
+    }
+    uint64_t count;
+    if (fds[0].revents & POLLIN &&
+        read(timerFd_, &count, sizeof(count)) != sizeof(count)) {
+      continue; // Re-armed under our feet.
+    }
+
+    std::lock_guard<std::mutex> lock(lock_);
+    if (stopping_) {
+      return;
+    }
+    const auto now = Clock::now();
+    if (!task_ || deadline_ > now) {
+      continue;
+    }
+
+    const auto late =
+        std::chrono::duration_cast<std::chrono::microseconds>(now - deadline_);
+    stats_.wakeups++;
+    stats_.lateOver1ms += late > milliseconds(1);
+    stats_.maxLate = std::max(stats_.maxLate, late);
+    lateSum_ += late;
+
+    std::coroutine_handle<> h = task_;
+    task_ = nullptr;
+    {
+      TraceFlow flow(flow_);
+      TRACE_SPAN("pattern.step", late.count());
+      h.resume(); // Until it sleeps again, or finishes.
+    }
+    if (h.done()) {
+      h.destroy();
+      channels_ = 0; // Everything it switched on, it switched off.
+    }
+    rearm();
+  }
+}
+
+PatternTimingStats PatternScheduler::stats() const {
+  std::lock_guard<std::mutex> lock(lock_);
+  PatternTimingStats s = stats_;
+  if (s.wakeups) {
+    s.meanLate = lateSum_ / s.wakeups;
+  }
+  return s;
+}
+
+void PatternScheduler::publish(StatusBuffer &buf) const {
+  const auto s = stats();
+  if (!s.wakeups) {
+    return;
+  }
+  fmt::format_to(std::back_inserter(buf),
+                 "Pattern timing: {} steps, late by {}us mean, {}us max, "
+                 "{} over 1ms\n",
+                 s.wakeups, s.meanLate.count(), s.maxLate.count(),
+                 s.lateOver1ms);
+}
+
+#ifdef PATTERN_TEST
+#include <cassert>
+#include <cstdio>
+
+// Records every switch, timestamped.
+class RecordingRelay : public RelayChannels {
+public:
+  struct Edge {
+    PatternScheduler::Clock::time_point when;
+    unsigned channel;
+    bool on;
+  };
+
+  int setChannel(unsigned channel, bool enable) override {
+    std::lock_guard<std::mutex> lock(lock_);
+    edges_[count_++ % kMax] = {PatternScheduler::Clock::now(), channel, enable};
+    return 0;
+  }
+
+  size_t count() {
+    std::lock_guard<std::mutex> lock(lock_);
+    return count_;
+  }
+  Edge edge(size_t i) {
+    std::lock_guard<std::mutex> lock(lock_);
+    return edges_[i];
+  }
+
+private:
+  static constexpr size_t kMax = 256;
+  std::mutex lock_;
+  Edge edges_[kMax];
+  size_t count_ = 0;
+};
+
+int main(void) {
+  BlatPattern p;
+  assert(BlatPattern::parse("", p) && p.empty());
+  assert(!BlatPattern::parse("5:100", p));
+  assert(!BlatPattern::parse("1:abc", p));
+  assert(!BlatPattern::parse("1:10-20x3", p));
+  assert(!BlatPattern::parse("1:10-200/100x3", p));
+  assert(!BlatPattern::parse("1:10/10x0", p));
+  assert(BlatPattern::parse("1:20/30x5 0:40 2:10-50/60x3 1:100", p));
+  assert(p.count == 4);
+  assert(p.steps[2].on(0) == milliseconds(10));
+  assert(p.steps[2].on(1) == milliseconds(30));
+  assert(p.steps[2].off(2) == milliseconds(10));
+  assert(p.duration() == milliseconds(5 * 50 + 40 + 3 * 60 + 100));
+
+  // Play it and compare every edge with the plan.
+  PatternScheduler scheduler;
+  RecordingRelay relay;
+  const auto start = PatternScheduler::Clock::now();
+  scheduler.play(relay, p);
+  usleep((p.duration().count() + 50) * 1000);
+
+  struct {
+    unsigned channel;
+    bool on;
+    int atMs;
+  } plan[32];
+  size_t planned = 0;
+  int t = 0;
+  for (size_t s = 0; s < p.count; ++s) {
+    const auto &step = p.steps[s];
+    for (unsigned i = 0; i < step.repeat; ++i) {
+      if (step.channel) {
+        plan[planned++] = {step.channel, true, t};
+      }
+      t += step.on(i).count();
+      if (step.channel) {
+        plan[planned++] = {step.channel, false, t};
+      }
+      t += step.off(i).count();
+    }
+  }
+  assert(relay.count() == planned);
+  std::chrono::microseconds worst{0};
+  for (size_t i = 0; i < planned; ++i) {
+    const auto e = relay.edge(i);
+    assert(e.channel == plan[i].channel && e.on == plan[i].on);
+    const auto error = std::chrono::duration_cast<std::chrono::microseconds>(
+        (e.when - start) - milliseconds(plan[i].atMs));
+    worst = std::max(worst, error < error.zero() ? -error : error);
+  }
+  const auto s = scheduler.stats();
+  printf("%zu edges, worst %ldus off plan; %lu steps late by %ldus mean, "
+         "%ldus max\n",
+         planned, long(worst.count()), (unsigned long)s.wakeups,
+         long(s.meanLate.count()), long(s.maxLate.count()));
+  assert(worst < milliseconds(2));
+
+  // Abort mid-pulse: off at once, and nothing more afterwards.
+  assert(BlatPattern::parse("3:1000 4:1000", p));
+  const size_t before = relay.count();
+  scheduler.play(relay, p);
+  usleep(50000);
+  scheduler.stop();
+  assert(relay.count() == before + 2);
+  assert(relay.edge(before + 1).channel == 3 && !relay.edge(before + 1).on);
+  usleep(1100000);
+  assert(relay.count() == before + 2);
+
+  puts("Patterns OK.");
+  return 0;
+}
+#endif
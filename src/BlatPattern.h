@@ -0,0 +1,142 @@
+#pragma once
+
+#include "StatusBuffer.h"
+
+#include <array>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+// What a pattern drives; Relay in the daemon, a recorder in tests.
+class RelayChannels {
+public:
+  virtual ~RelayChannels() {}
+  virtual int setChannel(unsigned channel, bool enable) = 0;
+};
+
+// A blat pattern: a sequence of steps, each a train of pulses on one relay.
+//
+// Written as space-separated steps, e.g. "1:200/300x5 2:100-900/1000x4":
+//   CH:ON            relay CH on for ON ms
+//   CH:ON/OFF        on for ON ms, then off for OFF ms
+//   CH:A-B/PERIOD    a ramp: pulses every PERIOD ms, on-time going from A to
+//                    B ms across the repeats
+//   ...xN            any of those N times
+// Channel 0 is a pause: nothing is switched for the on-time.
+struct BlatPattern {
+  struct Step {
+    uint8_t channel;
+    uint16_t repeat;
+    uint32_t onFirstMs; // On-time of the first and last pulse; the ones
+    uint32_t onLastMs;  // between are interpolated.
+    uint32_t offMs;     // Fixed off-time, or
+    uint32_t periodMs;  // if non-zero, pulses start this far apart.
+
+    std::chrono::milliseconds on(unsigned pulse) const;
+    std::chrono::milliseconds off(unsigned pulse) const;
+  };
+
+  static constexpr size_t kMaxSteps = 16;
+  std::array<Step, kMaxSteps> steps;
+  size_t count = 0;
+
+  bool empty() const { return count == 0; }
+  std::chrono::milliseconds duration() const;
+
+  // Returns false, having logged why, if text does not parse.
+  static bool parse(const char *text, BlatPattern &pattern);
+};
+
+// Coroutine type of a running pattern. Frames come from a small static
+// pool so that starting a pattern does not touch the heap.
+class PatternTask {
+public:
+  struct promise_type {
+    PatternTask get_return_object() {
+      return PatternTask(
+          std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    // Started, and destroyed once finished, by the scheduler.
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+
+    static void *operator new(size_t size);
+    static void operator delete(void *p, size_t size);
+  };
+
+  explicit PatternTask(std::coroutine_handle<promise_type> h) : handle(h) {}
+  std::coroutine_handle<promise_type> handle;
+};
+
+struct PatternTimingStats {
+  uint64_t wakeups = 0;
+  uint64_t lateOver1ms = 0;
+  std::chrono::microseconds meanLate{0};
+  std::chrono::microseconds maxLate{0};
+};
+
+// Runs patterns as coroutines on one thread, woken by an absolute timerfd
+// (which, unlike poll() timeouts, gets no timer slack), so a pattern costs
+// no thread of its own. Pattern code only ever runs with lock_ held, so
+// stop() waits for at most the relay write in progress before cutting a
+// pattern off.
+class PatternScheduler {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  PatternScheduler();
+  ~PatternScheduler();
+
+  PatternScheduler(PatternScheduler const &) = delete;
+  PatternScheduler &operator=(PatternScheduler const &) = delete;
+
+  // Start pattern on relay, from now, after stopping anything running.
+  void play(RelayChannels &relay, BlatPattern const &pattern);
+  // Abort whatever is running. Once this returns, every relay the pattern
+  // used has been switched off and the pattern will not touch them again.
+  void stop();
+
+  PatternTimingStats stats() const;
+  void publish(StatusBuffer &buf) const;
+
+  // co_await sleepUntil(t) in a pattern.
+  struct Sleep {
+    PatternScheduler &scheduler;
+    Clock::time_point deadline;
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) {
+      scheduler.schedule(h, deadline);
+    }
+    void await_resume() const noexcept {}
+  };
+  Sleep sleepUntil(Clock::time_point t) { return Sleep{*this, t}; }
+
+private:
+  PatternTask run(RelayChannels &relay, BlatPattern pattern);
+  // From pattern code, so with lock_ held.
+  void schedule(std::coroutine_handle<> h, Clock::time_point deadline) {
+    task_ = h;
+    deadline_ = deadline;
+  }
+  void rearm();
+  void stopLocked();
+  void schedulerThread();
+
+  int timerFd_;
+  int wakeFd_;
+
+  mutable std::mutex lock_;
+  bool stopping_;
+  std::coroutine_handle<> task_; // The pattern running, if any,
+  Clock::time_point deadline_;   // and when it next wants to run.
+  uint64_t flow_; // Trace flow of the event that started it.
+  RelayChannels *relay_;
+  unsigned channels_; // Bit n if relay n may be on.
+  PatternTimingStats stats_;
+  std::chrono::microseconds lateSum_;
+  std::thread thread_;
+};
@@ -0,0 +1,448 @@
+#include "Config.h"
+#include "Trace.h"
+
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <poll.h>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::chrono::milliseconds;
+
+static bool parseAddress(const char *s, BdAddr &addr) {
+  unsigned b[6];
+  char trailing;
+  if (sscanf(s, "%2x:%2x:%2x:%2x:%2x:%2x%c", &b[5], &b[4], &b[3], &b[2],
+             &b[1], &b[0], &trailing) != 6) {
+    return false;
+  }
+  for (size_t i = 0; i < addr.size(); ++i) {
+    addr[i] = b[i];
+  }
+  return true;
+}
+
+static bool parseNumber(const char *s, long min, long max, long &value) {
+  char *end;
+  errno = 0;
+  value = strtol(s, &end, 0);
+  return !errno && end != s && !*end && value >= min && value <= max;
+}
+
+bool Config::load(const char *path, Config &config) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    spdlog::warn("Cannot open config {}: {}", path, strerror(errno));
+    return false;
+  }
+
+  Config c;
+  bool blessedSeen = false;
+  bool ok = true;
+  char *line = nullptr;
+  size_t cap = 0;
+  unsigned lineNo = 0;
+
+  while (getline(&line, &cap, f) != -1) {
+    lineNo++;
+    if (char *hash = strchr(line, '#')) {
+      *hash = 0;
+    }
+
+    // Split "key = value" and trim both.
+    char *key = line + strspn(line, " \t");
+    char *eq = strchr(key, '=');
+    char *end = key + strlen(key);
+    while (end > key && isspace((unsigned char)end[-1])) {
+      *--end = 0;
+    }
+    if (!*key) {
+      continue;
+    }
+    if (!eq) {
+      spdlog::error("{}:{}: expected key = value.", path, lineNo);
+      ok = false;
+      continue;
+    }
+    char *value = eq + 1 + strspn(eq + 1, " \t");
+    do {
+      *eq = 0;
+    } while (eq > key && isspace((unsigned char)*--eq));
+
+    long n = 0;
+    bool valid = true;
+    if (!strcmp(key, "blessed")) {
+      BdAddr addr;
+      valid = parseAddress(value, addr);
+      if (valid) {
+        if (!blessedSeen) {
+          c.blessedDevices.clear(); // The file replaces the defaults.
+          blessedSeen = true;
+        }
+        c.blessedDevices.push_back(addr);
+      }
+    } else if (!strcmp(key, "rssi_threshold")) {
+      valid = parseNumber(value, -127, 20, n);
+      c.rssiThreshold = n;
+    } else if (!strcmp(key, "grace_ms")) {
+      valid = parseNumber(value, 1, INT_MAX, n);
+      c.timings.grace = milliseconds(n);
+    } else if (!strcmp(key, "scan_ms")) {
+      valid = parseNumber(value, 1, INT_MAX, n);
+      c.timings.scan = milliseconds(n);
+    } else if (!strcmp(key, "run_ms")) {
+      valid = parseNumber(value, 1, INT_MAX, n);
+      c.timings.run = milliseconds(n);
+    } else if (!strcmp(key, "blat_pattern")) {
+      valid = BlatPattern::parse(value, c.blatPattern);
+    } else if (!strcmp(key, "prewarm_pct")) {
+      valid = parseNumber(value, 0, 100, n);
+      c.prewarmPct = n;
+    } else if (!strcmp(key, "gpio_chip")) {
+      c.gpioChip = value;
+    } else if (!strcmp(key, "gpio_line")) {
+      valid = parseNumber(value, 0, 1023, n);
+      c.gpioLine = n;
+    } else if (!strcmp(key, "i2c_device")) {
+      c.i2cDevice = value;
+    } else if (!strcmp(key, "i2c_address")) {
+      valid = parseNumber(value, 0x03, 0x77, n);
+      c.i2cAddress = n;
+    } else if (!strcmp(key, "relay_channel")) {
+      valid = parseNumber(value, 1, 4, n);
+      c.relayChannel = n;
+    } else if (!strcmp(key, "relay_max_on_ms")) {
+      valid = parseNumber(value, 1, INT_MAX, n);
+      c.relayMaxOn = milliseconds(n);
+    } else if (!strcmp(key, "telemetry_socket")) {
+      c.telemetrySocket = value;
+    } else if (!strcmp(key, "telemetry_name")) {
+      c.telemetryName = value;
+    } else if (!strcmp(key, "flight_recorder_dir")) {
+      c.flightRecorderDir = value;
+    } else if (!strcmp(key, "flight_recorder_s")) {
+      valid = parseNumber(value, 1, 3600, n);
+      c.flightRecorderWindow = std::chrono::seconds(n);
+    } else {
+      spdlog::error("{}:{}: unknown key {}.", path, lineNo, key);
+      ok = false;
+      continue;
+    }
+    if (!valid) {
+      spdlog::error("{}:{}: bad value '{}' for {}.", path, lineNo, value, key);
+      ok = false;
+    }
+  }
+  free(line);
+  fclose(f);
+
+  if (c.blatPattern.duration() > c.timings.run) {
+    spdlog::warn("{}: blat_pattern is longer than run_ms and will be cut "
+                 "short.",
+                 path);
+  }
+  if (c.relayMaxOn < c.timings.run) {
+    spdlog::error("{}: relay_max_on_ms is shorter than run_ms.", path);
+    ok = false;
+  }
+  if (ok) {
+    config = std::move(c);
+  }
+  return ok;
+}
+
+ConfigWatcher::ConfigWatcher(Config const &config)
+    : current_(nullptr), inotifyFd_(-1), wakeFd_(-1) {
+  for (auto &seen : seen_) {
+    seen.store(kFree);
+  }
+  publish(new Config(config));
+}
+
+ConfigWatcher::ConfigWatcher(const char *path)
+    : path_(path ? path : ""), current_(nullptr), inotifyFd_(-1),
+      wakeFd_(-1) {
+  for (auto &seen : seen_) {
+    seen.store(kFree);
+  }
+  auto *config = new Config;
+  if (path) {
+    struct stat st;
+    if (stat(path, &st) == 0) {
+      if (!Config::load(path, *config)) {
+        delete config;
+        throw std::runtime_error("Invalid config file.");
+      }
+      spdlog::info("Loaded config {}.", path);
+    } else {
+      spdlog::info("No config {}, using defaults.", path);
+    }
+  }
+  publish(config);
+
+  if (!path) {
+    return;
+  }
+
+  // Watch the directory, not the file: editors and config management
+  // usually write a new file and rename it over the old one.
+  const size_t slash = path_.rfind('/');
+  const std::string dir = slash == std::string::npos ? "."
+                          : slash == 0               ? "/"
+                                                     : path_.substr(0, slash);
+  inotifyFd_ = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+  if (inotifyFd_ == -1 || inotify_add_watch(inotifyFd_, dir.c_str(),
+                                             IN_CLOSE_WRITE | IN_MOVED_TO) ==
+                               -1) {
+    spdlog::warn("Cannot watch {} for config changes: {}", dir,
+                 strerror(errno));
+    return;
+  }
+  wakeFd_ = eventfd(0, EFD_CLOEXEC);
+  if (wakeFd_ == -1) {
+    spdlog::warn("Cannot create config watcher eventfd: {}", strerror(errno));
+    return;
+  }
+  watchThread_ = std::thread([this] { this->watchThread(); });
+}
+
+ConfigWatcher::~ConfigWatcher() {
+  if (watchThread_.joinable()) {
+    const uint64_t one = 1;
+    if (write(wakeFd_, &one, sizeof(one)) != sizeof(one)) {
+      spdlog::warn("Cannot wake config watcher: {}", strerror(errno));
+    }
+    watchThread_.join();
+  }
+  if (wakeFd_ != -1) {
+    close(wakeFd_);
+  }
+  if (inotifyFd_ != -1) {
+    close(inotifyFd_);
+  }
+  for (auto *config : retired_) {
+    delete config;
+  }
+  delete current_.load();
+}
+
+ConfigWatcher::Reader::Reader(ConfigWatcher &watcher,
+                              std::atomic<unsigned> &seen)
+    : watcher_(watcher), seen_(seen),
+      config_(watcher.current_.load(std::memory_order_acquire)) {
+  seen_.store(config_->version, std::memory_order_release);
+}
+
+ConfigWatcher::Reader::~Reader() {
+  seen_.store(kFree, std::memory_order_release);
+}
+
+bool ConfigWatcher::Reader::refresh() {
+  Config const *latest = watcher_.current_.load(std::memory_order_acquire);
+  if (latest == config_) {
+    return false;
+  }
+  config_ = latest;
+  // Everything done with the old snapshot happens before this store, which
+  // is what lets the writer free it.
+  seen_.store(latest->version, std::memory_order_release);
+  return true;
+}
+
+ConfigWatcher::Reader ConfigWatcher::reader() {
+  // A claimed slot reads zero until the Reader records what it holds, which
+  // keeps reclaim() away from the snapshot it is about to load.
+  for (auto &seen : seen_) {
+    unsigned expected = kFree;
+    if (seen.compare_exchange_strong(expected, 0)) {
+      return Reader(*this, seen);
+    }
+  }
+  throw std::runtime_error("Too many config readers.");
+}
+
+void ConfigWatcher::publish(Config *config) {
+  std::lock_guard<std::mutex> lock(lock_);
+  Config const *old = current_.load();
+  config->version = old ? old->version + 1 : 1;
+  current_.store(config, std::memory_order_release);
+  if (old) {
+    retired_.push_back(old);
+  }
+  reclaim();
+}
+
+// Frees retired snapshots that no Reader can still be using. Called with
+// lock_ held.
+void ConfigWatcher::reclaim() {
+  unsigned oldestSeen = kFree;
+  for (const auto &seen : seen_) {
+    oldestSeen = std::min(oldestSeen, seen.load(std::memory_order_acquire));
+  }
+  for (auto it = retired_.begin(); it != retired_.end();) {
+    if ((*it)->version < oldestSeen) {
+      delete *it;
+      it = retired_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void ConfigWatcher::watchThread() {
+  Tracer::registerThread("config");
+  const size_t slash = path_.rfind('/');
+  const std::string name =
+      slash == std::string::npos ? path_ : path_.substr(slash + 1);
+  struct pollfd fds[2] = {{inotifyFd_, POLLIN, 0}, {wakeFd_, POLLIN, 0}};
+
+  while (1) {
+    // Readers that have moved on since the last reload may have released
+    // something; catch up with them every so often.
+    const int rc = poll(fds, 2, 60 * 1000);
+    if (rc == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      spdlog::error("Config watcher poll() failed: {}", strerror(errno));
+      return;
+    }
+    if (fds[1].revents) {
+      return;
+    }
+    if (!rc) {
+      std::lock_guard<std::mutex> lock(lock_);
+      reclaim();
+      continue;
+    }
+
+    char buf[4096] __attribute__((aligned(__alignof__(inotify_event))));
+    bool changed = false;
+    ssize_t len;
+    while ((len = read(inotifyFd_, buf, sizeof(buf))) > 0) {
+      for (char *p = buf; p < buf + len;) {
+        const auto *ev = reinterpret_cast<const inotify_event *>(p);
+        if (ev->len && name == ev->name) {
+          changed = true;
+        }
+        p += sizeof(inotify_event) + ev->len;
+      }
+    }
+    if (!changed) {
+      continue;
+    }
+
+    auto *config = new Config;
+    if (!Config::load(path_.c_str(), *config)) {
+      spdlog::warn("Keeping the previous config.");
+      delete config;
+      continue;
+    }
+
+    Config const &old = current();
+    if (config->gpioChip != old.gpioChip ||
+        config->gpioLine != old.gpioLine ||
+        config->i2cDevice != old.i2cDevice ||
+        config->i2cAddress != old.i2cAddress ||
+        config->relayChannel != old.relayChannel ||
+        config->relayMaxOn != old.relayMaxOn ||
+        config->telemetrySocket != old.telemetrySocket ||
+        config->telemetryName != old.telemetryName ||
+        config->flightRecorderDir != old.flightRecorderDir ||
+        config->flightRecorderWindow != old.flightRecorderWindow) {
+      spdlog::warn("Hardware, telemetry and flight recorder settings in {} "
+                   "apply after a restart.",
+                   path_);
+    }
+    publish(config);
+    spdlog::info("Reloaded config {} (version {}): {} blessed devices, RSSI "
+                 "threshold {}.",
+                 path_, config->version, config->blessedDevices.size(),
+                 config->rssiThreshold);
+  }
+}
+
+#ifdef CONFIG_TEST
+#include <cassert>
+int main(void) {
+  char dir[] = "/tmp/pounceblat-config-XXXXXX";
+  assert(mkdtemp(dir));
+  const std::string path = std::string(dir) + "/pounceblat.conf";
+  auto writeFile = [&path](const char *text) {
+    // Write and rename, as an editor would.
+    const std::string tmp = path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "w");
+    fputs(text, f);
+    fclose(f);
+    rename(tmp.c_str(), path.c_str());
+  };
+
+  writeFile("# comment\n"
+            "blessed = AA:BB:CC:DD:EE:FF\n"
+            "blessed=01:02:03:04:05:06 # trailing comment\n"
+            "rssi_threshold = -80\n"
+            "grace_ms = 2000\n");
+  ConfigWatcher watcher(path.c_str());
+  auto reader = watcher.reader();
+  assert(reader->blessedDevices.size() == 2);
+  assert((reader->blessedDevices[0] == BdAddr{0xff, 0xee, 0xdd, 0xcc, 0xbb,
+                                              0xaa}));
+  assert(reader->rssiThreshold == -80);
+  assert(reader->timings.grace == milliseconds(2000));
+  assert(reader->timings.scan == Config().timings.scan);
+  const Config *first = &*reader;
+
+  // A bad file changes nothing.
+  writeFile("rssi_threshold = loud\n");
+  usleep(100000);
+  assert(!reader.refresh());
+
+  writeFile("rssi_threshold = -60\n");
+  for (int i = 0; i < 100 && !reader.refresh(); ++i) {
+    usleep(10000);
+  }
+  assert(reader->rssiThreshold == -60);
+  assert(reader->blessedDevices == Config().blessedDevices);
+  assert(&*reader != first);
+
+  // Readers hammering refresh() while the file keeps changing.
+  std::atomic<bool> done{false};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 2; ++t) {
+    threads.emplace_back([&watcher, &done] {
+      auto r = watcher.reader();
+      while (!done) {
+        r.refresh();
+        assert(r->rssiThreshold <= -50 && r->rssiThreshold >= -99);
+      }
+    });
+  }
+  for (int i = 50; i < 100; ++i) {
+    writeFile(fmt::format("rssi_threshold = -{}\n", i).c_str());
+    usleep(2000);
+  }
+  done = true;
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  // Slots are recycled as Readers come and go.
+  for (size_t i = 0; i < 2 * ConfigWatcher::kMaxReaders; ++i) {
+    auto r = watcher.reader();
+    assert(r->blessedDevices == Config().blessedDevices);
+  }
+
+  unlink(path.c_str());
+  rmdir(dir);
+  puts("Config OK.");
+  return 0;
+}
+#endif
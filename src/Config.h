@@ -0,0 +1,117 @@
+#pragma once
+
+#include "BlatMachine.h"
+#include "BlatPattern.h"
+#include "ScanScheduler.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A Bluetooth device address in bdaddr_t byte order, i.e. reversed from the
+// way it is written.
+using BdAddr = std::array<uint8_t, 6>;
+
+// Everything that used to be a literal. A Config is immutable once
+// published; changing anything means publishing a new one.
+struct Config {
+  // Picked up by running threads.
+  std::vector<BdAddr> blessedDevices{{0x66, 0x7e, 0x5b, 0x32, 0x15, 0xf1}};
+  int rssiThreshold = kDefaultRssiThreshold;
+  BlatTimings timings;
+  BlatPattern blatPattern; // Empty: the relay is simply on while RUNNING.
+  // Pre-warm scanning ahead of time slots with motion and Nazbert about in
+  // at least this percentage of weeks; 0 never does.
+  unsigned prewarmPct = 50;
+
+  // Only read at startup; changes are logged and wait for a restart.
+  std::string gpioChip = "gpiochip0";
+  unsigned gpioLine = 4;
+  std::string i2cDevice = "/dev/i2c-1";
+  unsigned i2cAddress = 0x10;
+  unsigned relayChannel = 1; // 1-4.
+  std::chrono::milliseconds relayMaxOn{7000}; // RUNNING timeout plus slack.
+  std::string telemetrySocket; // blatagg to stream to; empty for none.
+  std::string telemetryName;   // Defaults to the host name.
+  // Where HCI traffic around incidents is dumped; empty for nowhere.
+  std::string flightRecorderDir = "/var/lib/pounceblat/incidents";
+  std::chrono::seconds flightRecorderWindow{30};
+
+  unsigned version = 0; // Set when published.
+
+  // Parses "key = value" lines; '#' starts a comment. Returns false, having
+  // logged why, if anything in the file is not understood.
+  static bool load(const char *path, Config &config);
+};
+
+// Owns the current Config and swaps in a new one whenever the file changes.
+//
+// Readers never lock: each reader thread keeps a Reader, uses the snapshot
+// it holds, and calls refresh() at a point where it holds no references
+// into it (top of its loop). An old snapshot is freed once every Reader has
+// refreshed past it, so a snapshot in use is never freed under its user.
+class ConfigWatcher {
+public:
+  // Without a path the defaults are used and nothing is watched. A missing
+  // file also means defaults, but it is watched for; a file that exists but
+  // does not parse throws.
+  explicit ConfigWatcher(const char *path = nullptr);
+  explicit ConfigWatcher(Config const &config);
+  ~ConfigWatcher();
+
+  ConfigWatcher(ConfigWatcher const &) = delete;
+  ConfigWatcher &operator=(ConfigWatcher const &) = delete;
+
+  static constexpr size_t kMaxReaders = 4;
+
+  class Reader {
+  public:
+    ~Reader();
+    Reader(Reader const &) = delete;
+    Reader &operator=(Reader const &) = delete;
+
+    Config const &operator*() const { return *config_; }
+    Config const *operator->() const { return config_; }
+
+    // Returns true if a newer snapshot was picked up.
+    bool refresh();
+
+  private:
+    friend class ConfigWatcher;
+    Reader(ConfigWatcher &watcher, std::atomic<unsigned> &seen);
+
+    ConfigWatcher &watcher_;
+    std::atomic<unsigned> &seen_;
+    Config const *config_;
+  };
+
+  // At most kMaxReaders at a time.
+  Reader reader();
+
+  // The latest snapshot, for startup. It may be freed after the next
+  // reload, so threads that keep running must use a Reader.
+  Config const &current() const { return *current_.load(); }
+
+private:
+  void publish(Config *config);
+  void reclaim();
+  void watchThread();
+
+  const std::string path_;
+  std::atomic<Config const *> current_;
+  // Per Reader slot, the version of the snapshot it holds; kFree for none.
+  static constexpr unsigned kFree = ~0u;
+  std::array<std::atomic<unsigned>, kMaxReaders> seen_;
+
+  std::mutex lock_; // Writers only.
+  std::vector<Config const *> retired_;
+
+  int inotifyFd_;
+  int wakeFd_;
+  std::thread watchThread_;
+};
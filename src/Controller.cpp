@@ -1,9 +1,11 @@
 #include "Controller.h"
+#include "Trace.h"
 #include <spdlog/spdlog.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
 static constexpr const char *gFifo = "/dev/shm/pounceblat.fifo";
+static constexpr const char *gTraceFile = "/dev/shm/pounceblat.trace.json";
 
 Controller::Controller() : terminating_(false) {
   if (mkfifo(gFifo, 0666) != 0) {
@@ -52,6 +54,7 @@ void Controller::controlThread(EventQueue &eq) {
   static constexpr Event disableEvent{.type = Event::Type::DISABLE};
   int rc;
 
+  Tracer::registerThread("controller");
   while (!terminating_) {
     int inFd = open(gFifo, O_RDONLY);
 
@@ -71,6 +74,15 @@ void Controller::controlThread(EventQueue &eq) {
           spdlog::info("Controller received disable request.");
           eq.send(disableEvent);
           break;
+        case 'R':
+          Tracer::enable(true);
+          break;
+        case 'r':
+          Tracer::enable(false);
+          break;
+        case 'W':
+          Tracer::dump(gTraceFile);
+          break;
         default:
           spdlog::warn("Controller received unknown request {}.", c);
           break;
@@ -0,0 +1,15 @@
+#include "DaemonStatus.h"
+
+void DaemonStatus::publish(StatusBuffer &buf) const {
+  machine.formatStatus(buf);
+  if (store) {
+    store->publish(buf);
+    store->flush();
+  }
+  profiler.publish(buf);
+  patterns.publish(buf);
+  forecast.publish(buf, ActivityForecast::tickFor(time(nullptr)));
+  if (recorder) {
+    recorder->publish(buf);
+  }
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "ActivityForecast.h"
+#include "BlatMachine.h"
+#include "BlatPattern.h"
+#include "FlightRecorder.h"
+#include "SelfProfiler.h"
+#include "StatsStore.h"
+#include "StatusBuffer.h"
+
+// Everything in the status file that does not need a device. PounceBlat
+// publishes it on every state change, and the allocation test goes through
+// the same code, so that the daemon's own publishing is what it checks.
+struct DaemonStatus {
+  BlatMachine const &machine;
+  StatsStore const *store; // May be null.
+  SelfProfiler const &profiler;
+  PatternScheduler const &patterns;
+  ActivityForecast const &forecast;
+  FlightRecorder const *recorder; // May be null.
+
+  // Appends it all to buf, and starts writing the stats store back.
+  void publish(StatusBuffer &buf) const;
+};
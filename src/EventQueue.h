@@ -1,21 +1,138 @@
 #pragma once
 
+#include <array>
 #include <chrono>
 #include <condition_variable>
-#include <deque>
+#include <cstdint>
 #include <mutex>
 #include <optional>
 #include <spdlog/spdlog.h>
+#include <type_traits>
 
+// Events are small, trivially copyable values: a type tag plus whatever the
+// sender knew about it, so that the queue copies them around without ever
+// touching the heap and the machine can act on the details.
 class Event {
 public:
-  enum class Type {
+  enum class Type : uint8_t {
     DISABLE,
     ENABLE,
     MOTION_DETECTED,
     NAZBERT_DETECTED,
-    TIMEOUT
+    TIMEOUT,
+    DEVICE_READY, // A device finished coming up after startup.
+    FORECAST,     // A new activity forecast slot has begun.
+    TELEMETRY,    // Time to retry or refresh the telemetry connection.
   } type;
+
+  // The machine's timers; a TIMEOUT says which one it was set for.
+  enum class Timer : uint8_t { GRACE, SCAN, RUN };
+
+  // Number of identical events folded into this one while it was queued.
+  uint32_t count = 1;
+
+  // Trace flow linking the spans this event passes through, 0 if untraced.
+  // A folded event's flow ends at its send.
+  uint64_t flow = 0;
+
+  // Times are steady_clock nanoseconds, 0 if the sender did not say.
+  struct Nazbert {
+    uint8_t addr[6]; // bdaddr_t byte order, i.e. reversed.
+    int8_t rssi;
+    uint8_t adapter; // HCI device id.
+    int64_t whenNs;  // The advertising report was parsed.
+  };
+  struct Motion {
+    uint32_t line;
+    uint32_t edges;      // Rising edges, including any folded in.
+    int64_t timestampNs; // The kernel's, from the GPIO line event.
+  };
+  union Payload {
+    Nazbert nazbert;
+    Motion motion;
+    Timer timer;
+  } payload{};
+
+  static constexpr Event nazbertDetected(Nazbert const &n) {
+    return Event{.type = Type::NAZBERT_DETECTED, .payload = {.nazbert = n}};
+  }
+  static constexpr Event motionDetected(Motion const &m) {
+    return Event{.type = Type::MOTION_DETECTED, .payload = {.motion = m}};
+  }
+  static constexpr Event timeout(Timer t) {
+    return Event{.type = Type::TIMEOUT, .payload = {.timer = t}};
+  }
+
+  // Only meaningful for events of the matching type.
+  Nazbert const &nazbert() const { return payload.nazbert; }
+  Motion const &motion() const { return payload.motion; }
+  Timer timer() const { return payload.timer; }
+
+  // Folds a later event of the same type into this one, which keeps its
+  // own details: the first sighting or edge is the one that matters.
+  void fold(Event const &e) {
+    count += e.count;
+    if (type == Type::MOTION_DETECTED) {
+      payload.motion.edges += e.payload.motion.edges;
+    }
+  }
+
+  // Safety-critical events are delivered ahead of anything merely
+  // informational, no matter how much of the latter is queued.
+  enum class Priority { CRITICAL, NORMAL };
+  static constexpr size_t kPriorities = 2;
+
+  static constexpr Priority priority(Type t) {
+    return t == Type::MOTION_DETECTED || t == Type::FORECAST ||
+                   t == Type::TELEMETRY
+               ? Priority::NORMAL
+               : Priority::CRITICAL;
+  }
+
+  static constexpr const char *typeName(Type t) {
+    switch (t) {
+      case Type::DISABLE:
+        return "DISABLE";
+      case Type::ENABLE:
+        return "ENABLE";
+      case Type::MOTION_DETECTED:
+        return "MOTION_DETECTED";
+      case Type::NAZBERT_DETECTED:
+        return "NAZBERT_DETECTED";
+      case Type::TIMEOUT:
+        return "TIMEOUT";
+      case Type::DEVICE_READY:
+        return "DEVICE_READY";
+      case Type::FORECAST:
+        return "FORECAST";
+      case Type::TELEMETRY:
+        return "TELEMETRY";
+    }
+    return "bogus";
+  }
+
+  static constexpr const char *timerName(Timer t) {
+    switch (t) {
+      case Timer::GRACE:
+        return "GRACE";
+      case Timer::SCAN:
+        return "SCAN";
+      case Timer::RUN:
+        return "RUN";
+    }
+    return "bogus";
+  }
+};
+
+static_assert(sizeof(Event) <= 64, "Event should fit in a cache line.");
+static_assert(std::is_trivially_copyable_v<Event>);
+
+struct EventQueueStats {
+  uint64_t sent = 0;
+  uint64_t coalesced = 0; // Sends folded into an already queued event.
+  uint64_t dropped = 0;   // Sends refused because the lane was full.
+  uint64_t superseded = 0; // Motion and modes discarded by a later mode.
+  size_t maxDepth = 0;
 };
 
 class EventQueue {
@@ -23,25 +140,86 @@ public:
   EventQueue() {}
   ~EventQueue() {}
 
-  void send(Event const &);
+  void send(Event e);
   Event wait();
 
-  void setTimeout(std::chrono::milliseconds delay) {
+  // wait() returns Event::timeout(which) once delay has passed with nothing
+  // else to deliver.
+  void setTimeout(Event::Timer which, std::chrono::milliseconds delay) {
     deadline_ = std::chrono::steady_clock::now() + delay;
+    timer_ = which;
   }
   void clearTimeout() { deadline_ = std::nullopt; }
 
+  EventQueueStats stats();
+
 private:
-  std::deque<Event> queue_;
+  bool empty() const;
+
+  // Fixed-capacity FIFO, so that the queue never allocates after
+  // construction. Coalescing keeps real-world depth to a handful; running
+  // out of room means something upstream has gone badly wrong.
+  static constexpr size_t kLaneCapacity = 16;
+  struct Lane {
+    std::array<Event, kLaneCapacity> slots;
+    size_t head = 0;
+    size_t size = 0;
+
+    bool empty() const { return size == 0; }
+    bool full() const { return size == kLaneCapacity; }
+    Event &back() { return slots[(head + size - 1) % kLaneCapacity]; }
+    void push(Event e) { slots[(head + size++) % kLaneCapacity] = e; }
+    Event pop() {
+      Event e = slots[head];
+      head = (head + 1) % kLaneCapacity;
+      size--;
+      return e;
+    }
+    // Removes every event of type t, keeping the rest in order and folding
+    // together neighbours that only it kept apart. Returns how many sends
+    // were removed, counting folded ones.
+    uint64_t remove(Event::Type t) {
+      uint64_t removed = 0;
+      size_t kept = 0;
+      for (size_t i = 0; i < size; ++i) {
+        Event const &e = slots[(head + i) % kLaneCapacity];
+        Event &last = slots[(head + kept - 1) % kLaneCapacity];
+        if (e.type == t) {
+          removed += e.count;
+        } else if (kept && last.type == e.type) {
+          last.fold(e);
+        } else {
+          slots[(head + kept++) % kLaneCapacity] = e;
+        }
+      }
+      size = kept;
+      return removed;
+    }
+  };
+
+  // One lane per Event::Priority, highest priority first. An event sent
+  // while an event of the same type is at the tail of its lane is coalesced
+  // into it. Only the tail is considered, so that the order of different
+  // events is kept.
+  //
+  // ENABLE and DISABLE are one mode change, of which only the newest is
+  // kept: sending one discards any queued, so at most one is ever queued,
+  // and the last slot of the lane is kept for it so that it is never
+  // dropped. It also overtakes motion, so motion still queued is discarded:
+  // it happened in the old mode, and delivering it after the change would
+  // e.g. start a scan on motion seen while DISABLED.
+  std::array<Lane, Event::kPriorities> lanes_;
+  EventQueueStats stats_;
   std::mutex lock_;
   std::condition_variable cv_;
   std::optional<std::chrono::time_point<std::chrono::steady_clock>> deadline_;
+  Event::Timer timer_ = Event::Timer::GRACE;
 };
 
 template <> struct fmt::formatter<Event> {
   constexpr auto parse(format_parse_context &ctx) {
     auto it = ctx.begin();
-    if (*it != '}') {
+    if (it != ctx.end() && *it != '}') {
       throw format_error("invalid format");
     }
     return it;
@@ -49,24 +227,36 @@ template <> struct fmt::formatter<Event> {
 
   template <typename FormatContext>
   auto format(const Event &e, FormatContext &ctx) {
-    const char *name = "bogus";
+    auto out = format_to(ctx.out(), "{}", Event::typeName(e.type));
     switch (e.type) {
-      case Event::Type::DISABLE:
-        name = "DISABLE";
+      case Event::Type::NAZBERT_DETECTED: {
+        auto const &n = e.nazbert();
+        out = format_to(out,
+                        " {:02X}:{:02X}:{:02X}:{:02X}:{:02X}:{:02X} RSSI {} "
+                        "hci{} at {:.6f}",
+                        n.addr[5], n.addr[4], n.addr[3], n.addr[2], n.addr[1],
+                        n.addr[0], n.rssi, n.adapter, n.whenNs / 1e9);
         break;
-      case Event::Type::ENABLE:
-        name = "ENABLE";
-        break;
-      case Event::Type::MOTION_DETECTED:
-        name = "MOTION_DETECTED";
+      }
+      case Event::Type::MOTION_DETECTED: {
+        auto const &m = e.motion();
+        out = format_to(out, " line {} edges {} at {:.6f}", m.line, m.edges,
+                        m.timestampNs / 1e9);
         break;
+      }
       case Event::Type::TIMEOUT:
-        name = "TIMEOUT";
+        out = format_to(out, " {}", Event::timerName(e.timer()));
         break;
-      case Event::Type::NAZBERT_DETECTED:
-        name = "NAZBERT_DETECTED";
+      case Event::Type::DISABLE:
+      case Event::Type::ENABLE:
+      case Event::Type::DEVICE_READY:
+      case Event::Type::FORECAST:
+      case Event::Type::TELEMETRY:
         break;
     }
-    return format_to(ctx.out(), "{}", name);
+    if (e.count > 1) {
+      out = format_to(out, " x{}", e.count);
+    }
+    return out;
   }
 };
@@ -0,0 +1,377 @@
+#include "FlightRecorder.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <endian.h>
+#include <fcntl.h>
+#include <iterator>
+#include <spdlog/spdlog.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// btsnoop: a file header, then per packet a record header and the packet.
+// Everything is big-endian.
+constexpr char kBtsnoopMagic[8] = {'b', 't', 's', 'n', 'o', 'o', 'p', 0};
+constexpr uint32_t kBtsnoopVersion = 1;
+constexpr uint32_t kDatalinkH4 = 1002; // Packets start with their H4 type.
+constexpr uint32_t kFlagsReceivedEvent = 0x3;
+// btsnoop counts microseconds from midnight, January 1st, 0 AD.
+constexpr int64_t kBtsnoopEpochUs = 0x00dcddb30f2f8000;
+
+struct __attribute__((packed)) BtsnoopHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t datalink;
+};
+
+struct __attribute__((packed)) BtsnoopRecord {
+  uint32_t originalLength;
+  uint32_t includedLength;
+  uint32_t flags;
+  uint32_t drops;
+  int64_t timestamp;
+};
+
+// A path, built without touching the heap.
+using Path = fmt::basic_memory_buffer<char, PATH_MAX>;
+
+// Batches writes to fd, so that a dump takes a few syscalls rather than two
+// per packet, without stdio's heap buffer.
+class DumpWriter {
+public:
+  explicit DumpWriter(int fd) : fd_(fd) {}
+
+  bool add(const void *p, size_t n) {
+    if (len_ + n > sizeof(buf_) && !flush()) {
+      return false;
+    }
+    memcpy(buf_ + len_, p, n);
+    len_ += n;
+    return true;
+  }
+
+  bool flush() {
+    const uint8_t *p = buf_;
+    while (len_) {
+      const ssize_t n = write(fd_, p, len_);
+      if (n == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+      p += n;
+      len_ -= n;
+    }
+    return true;
+  }
+
+private:
+  int fd_;
+  uint8_t buf_[64 * 1024];
+  size_t len_ = 0;
+};
+
+int64_t wallClockUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000ll + ts.tv_nsec / 1000;
+}
+
+} // namespace
+
+FlightRecorder::FlightRecorder(std::string dir, std::chrono::seconds window)
+    : dir_(std::move(dir)), window_(window), head_(0), pending_(nullptr),
+      shutdown_(false) {
+  if (mkdir(dir_.c_str(), 0755) == -1 && errno != EEXIST) {
+    spdlog::warn("Cannot create flight recorder directory {}: {}", dir_,
+                 strerror(errno));
+  }
+  thread_ = std::thread([this] { dumpThread(); });
+}
+
+FlightRecorder::~FlightRecorder() {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    shutdown_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+}
+
+void FlightRecorder::record(const uint8_t *packet, size_t len,
+                            int64_t timeUs) {
+  const uint64_t n = head_.load(std::memory_order_relaxed);
+  Slot &s = slots_[n % kSlots];
+  len = std::min(len, kMaxPacket);
+
+  s.seq.store(2 * n + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  s.timeUs = timeUs;
+  s.len = len;
+  memcpy(s.data, packet, len);
+  s.seq.store(2 * (n + 1), std::memory_order_release);
+  head_.store(n + 1, std::memory_order_release);
+}
+
+void FlightRecorder::dump(const char *why) {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    if (pending_) {
+      stats_.folded++;
+      return;
+    }
+    pending_ = why;
+  }
+  cv_.notify_all();
+}
+
+FlightRecorderStats FlightRecorder::stats() const {
+  std::lock_guard<std::mutex> lock(lock_);
+  FlightRecorderStats st = stats_;
+  st.packets = head_.load(std::memory_order_relaxed);
+  return st;
+}
+
+void FlightRecorder::publish(StatusBuffer &buf) const {
+  const auto st = stats();
+  auto out = std::back_inserter(buf);
+  out = fmt::format_to(out,
+                       "Flight recorder: {} packets, {} dumps ({} requests "
+                       "folded), last ",
+                       st.packets, st.dumps, st.folded);
+  if (st.lastDump < 0) {
+    out = fmt::format_to(out, "none");
+  } else {
+    out = formatPath(out, st.lastDump);
+  }
+  fmt::format_to(out, "\n");
+}
+
+std::string FlightRecorder::dumpPath(unsigned n) const {
+  std::string path;
+  formatPath(std::back_inserter(path), n);
+  return path;
+}
+
+// The first free file, or failing that the oldest.
+unsigned FlightRecorder::pickFile() const {
+  unsigned oldest = 0;
+  time_t oldestTime = 0;
+  for (unsigned i = 0; i < kMaxDumps; ++i) {
+    Path path;
+    formatPath(std::back_inserter(path), i);
+    path.push_back('\0');
+    struct stat st;
+    if (stat(path.data(), &st) == -1) {
+      return i;
+    }
+    if (i == 0 || st.st_mtime < oldestTime) {
+      oldest = i;
+      oldestTime = st.st_mtime;
+    }
+  }
+  return oldest;
+}
+
+void FlightRecorder::writeDump(const char *why) {
+  TRACE_SPAN("flightRecorder.dump");
+  const unsigned file = pickFile();
+  Path path, tmp;
+  formatPath(std::back_inserter(path), file);
+  formatPath(std::back_inserter(tmp), file);
+  path.push_back('\0');
+  fmt::format_to(std::back_inserter(tmp), ".tmp");
+  tmp.push_back('\0');
+  const int fd =
+      open(tmp.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    spdlog::warn("Cannot write HCI dump {}: {}", tmp.data(), strerror(errno));
+    return;
+  }
+  DumpWriter w(fd);
+
+  BtsnoopHeader h;
+  memcpy(h.magic, kBtsnoopMagic, sizeof(h.magic));
+  h.version = htobe32(kBtsnoopVersion);
+  h.datalink = htobe32(kDatalinkH4);
+  bool ok = w.add(&h, sizeof(h));
+
+  // Oldest first. Anything overwritten since head was read, or still being
+  // written, fails the sequence check and is skipped.
+  const int64_t cutoff =
+      wallClockUs() -
+      std::chrono::duration_cast<std::chrono::microseconds>(window_).count();
+  const uint64_t head = head_.load(std::memory_order_acquire);
+  unsigned written = 0;
+  for (uint64_t n = head > kSlots ? head - kSlots : 0; ok && n < head; ++n) {
+    Slot const &s = slots_[n % kSlots];
+    const uint64_t seq = s.seq.load(std::memory_order_acquire);
+    if (seq != 2 * (n + 1)) {
+      continue;
+    }
+    const int64_t timeUs = s.timeUs;
+    const uint32_t len = std::min<uint32_t>(s.len, kMaxPacket);
+    uint8_t data[kMaxPacket];
+    memcpy(data, s.data, len);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (s.seq.load(std::memory_order_relaxed) != seq || timeUs < cutoff) {
+      continue;
+    }
+
+    BtsnoopRecord r;
+    r.originalLength = htobe32(len);
+    r.includedLength = htobe32(len);
+    r.flags = htobe32(kFlagsReceivedEvent);
+    r.drops = 0;
+    r.timestamp = htobe64(timeUs + kBtsnoopEpochUs);
+    ok = w.add(&r, sizeof(r)) && w.add(data, len);
+    written++;
+  }
+
+  ok = w.flush() && ok;
+  ok = close(fd) == 0 && ok;
+  if (!ok || rename(tmp.data(), path.data()) == -1) {
+    spdlog::warn("Cannot write HCI dump {}: {}", path.data(), strerror(errno));
+    unlink(tmp.data());
+    return;
+  }
+  spdlog::info("Wrote {} HCI packets from the last {}s to {} ({}).", written,
+               window_.count(), path.data(), why);
+  std::lock_guard<std::mutex> lock(lock_);
+  stats_.dumps++;
+  stats_.lastDump = file;
+}
+
+void FlightRecorder::dumpThread() {
+  Tracer::registerThread("flight-recorder");
+  std::unique_lock<std::mutex> lock(lock_);
+
+  while (1) {
+    cv_.wait(lock, [this] { return shutdown_ || pending_; });
+    if (shutdown_) {
+      break;
+    }
+    const char *why = pending_;
+    pending_ = nullptr;
+    lock.unlock();
+    writeDump(why);
+    lock.lock();
+  }
+}
+
+#ifdef FLIGHT_RECORDER_TEST
+#include <cassert>
+#include <vector>
+
+// Reads a dump back, checking that it is well formed and that every packet
+// is one the writer made whole: each is filled with its own number.
+static std::vector<uint32_t> readDump(std::string const &path) {
+  std::vector<uint32_t> numbers;
+  FILE *f = fopen(path.c_str(), "r");
+  assert(f);
+  BtsnoopHeader h;
+  assert(fread(&h, sizeof(h), 1, f) == 1);
+  assert(!memcmp(h.magic, kBtsnoopMagic, sizeof(h.magic)));
+  assert(be32toh(h.datalink) == kDatalinkH4);
+  int64_t last = 0;
+  BtsnoopRecord r;
+  while (fread(&r, sizeof(r), 1, f) == 1) {
+    const uint32_t len = be32toh(r.includedLength);
+    assert(len >= 1 + sizeof(uint32_t) && len <= FlightRecorder::kMaxPacket);
+    uint8_t data[FlightRecorder::kMaxPacket];
+    assert(fread(data, len, 1, f) == 1);
+    assert(data[0] == 0x04); // HCI_EVENT_PKT
+    uint32_t n;
+    memcpy(&n, data + 1, sizeof(n));
+    for (uint32_t i = 1 + sizeof(n); i < len; ++i) {
+      assert(data[i] == uint8_t(n));
+    }
+    const int64_t t = int64_t(be64toh(r.timestamp));
+    assert(t >= last);
+    last = t;
+    numbers.push_back(n);
+  }
+  fclose(f);
+  return numbers;
+}
+
+int main(void) {
+  char dir[] = "/tmp/pounceblat-flight-recorder-XXXXXX";
+  assert(mkdtemp(dir));
+  auto waitForDumps = [](FlightRecorder const &fr, unsigned n) {
+    for (int i = 0; i < 500 && fr.stats().dumps < n; ++i) {
+      usleep(10000);
+    }
+    assert(fr.stats().dumps == n);
+  };
+
+  {
+    FlightRecorder fr(dir, std::chrono::seconds(2));
+    auto packet = [](uint32_t n, uint8_t *p) {
+      const size_t len = 1 + sizeof(n) + n % 200;
+      p[0] = 0x04;
+      memcpy(p + 1, &n, sizeof(n));
+      memset(p + 1 + sizeof(n), uint8_t(n), len - 1 - sizeof(n));
+      return len;
+    };
+
+    // Old traffic, outside the window, then a little recent traffic.
+    uint8_t p[FlightRecorder::kMaxPacket];
+    const int64_t now = wallClockUs();
+    for (uint32_t n = 0; n < 100; ++n) {
+      fr.record(p, packet(n, p), now - 10000000);
+    }
+    for (uint32_t n = 100; n < 150; ++n) {
+      fr.record(p, packet(n, p), now);
+    }
+    StatusBuffer buf;
+    fr.publish(buf);
+    assert(fmt::to_string(buf) == "Flight recorder: 150 packets, 0 dumps (0 "
+                                  "requests folded), last none\n");
+    fr.dump("test");
+    waitForDumps(fr, 1);
+    buf.clear();
+    fr.publish(buf);
+    assert(fmt::to_string(buf).ends_with("last " + fr.dumpPath(0) + "\n"));
+    auto numbers = readDump(fr.dumpPath(fr.stats().lastDump));
+    assert(numbers.size() == 50 && numbers.front() == 100);
+
+    // Dumping while the ring is lapped as fast as one thread can go: only
+    // whole packets come out, in order.
+    std::atomic<bool> done{false};
+    std::thread writer([&] {
+      uint8_t p[FlightRecorder::kMaxPacket];
+      for (uint32_t n = 150; !done; ++n) {
+        fr.record(p, packet(n, p), wallClockUs());
+      }
+    });
+    for (unsigned i = 2; i <= FlightRecorder::kMaxDumps + 2; ++i) {
+      fr.dump("test");
+      waitForDumps(fr, i);
+      numbers = readDump(fr.dumpPath(fr.stats().lastDump));
+      assert(!numbers.empty() && numbers.size() <= FlightRecorder::kSlots);
+      assert(std::is_sorted(numbers.begin(), numbers.end()));
+    }
+    done = true;
+    writer.join();
+    printf("%llu packets recorded, last dump had %zu.\n",
+           (unsigned long long)fr.stats().packets, numbers.size());
+  }
+
+  // Files are reused once there are kMaxDumps of them.
+  for (unsigned i = 0; i < FlightRecorder::kMaxDumps; ++i) {
+    const std::string path = fmt::format("{}/incident-{:02}.btsnoop", dir, i);
+    assert(unlink(path.c_str()) == 0);
+  }
+  assert(rmdir(dir) == 0);
+  puts("Flight recorder OK.");
+  return 0;
+}
+#endif
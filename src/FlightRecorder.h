@@ -0,0 +1,85 @@
+#pragma once
+
+#include "StatusBuffer.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+struct FlightRecorderStats {
+  uint64_t packets = 0; // Recorded since startup.
+  unsigned dumps = 0;   // Files written.
+  unsigned folded = 0;  // Dump requests folded into one already pending.
+  int lastDump = -1;    // Number of the file last written, -1 if none.
+};
+
+// The last few seconds of raw HCI events, kept in memory so that the radio
+// traffic behind a disallow or an abort can be looked at afterwards.
+//
+// The scan thread is the only writer; recording a packet is a memcpy into
+// a fixed ring, with no locks and no allocation. Slots carry a sequence
+// number, odd while being written, so the dump thread can copy the ring out
+// while it is still being filled and skip any slot overwritten under it.
+// Dumps are written as btsnoop files (H4, as Wireshark and btmon read) on
+// the recorder's own thread, into a small set of files reused oldest first.
+// Neither recording, dumping nor publishing allocates.
+class FlightRecorder {
+public:
+  static constexpr size_t kSlots = 4096;
+  static constexpr size_t kMaxPacket = 260; // HCI_MAX_EVENT_SIZE.
+  static constexpr unsigned kMaxDumps = 16;
+
+  // Dumps go to dir, which is created if need be, and cover the last window
+  // of traffic.
+  FlightRecorder(std::string dir, std::chrono::seconds window);
+  ~FlightRecorder();
+
+  FlightRecorder(FlightRecorder const &) = delete;
+  FlightRecorder &operator=(FlightRecorder const &) = delete;
+
+  // Scan thread only. timeUs is wall clock time, in us since the epoch.
+  void record(const uint8_t *packet, size_t len, int64_t timeUs);
+
+  // Returns at once; the file is written on the recorder's thread. Requests
+  // made while one is pending are folded into it. why should be a literal.
+  void dump(const char *why);
+
+  FlightRecorderStats stats() const;
+  void publish(StatusBuffer &buf) const;
+
+  // Where dump number n goes.
+  std::string dumpPath(unsigned n) const;
+
+private:
+  struct alignas(64) Slot {
+    // 2 * (record number + 1) once written, odd while being written.
+    std::atomic<uint64_t> seq{0};
+    int64_t timeUs;
+    uint32_t len;
+    uint8_t data[kMaxPacket];
+  };
+
+  template <typename Out> Out formatPath(Out out, unsigned n) const {
+    return fmt::format_to(out, "{}/incident-{:02}.btsnoop", dir_, n);
+  }
+  unsigned pickFile() const;
+  void writeDump(const char *why);
+  void dumpThread();
+
+  const std::string dir_;
+  const std::chrono::seconds window_;
+  std::array<Slot, kSlots> slots_;
+  std::atomic<uint64_t> head_; // Records written.
+
+  mutable std::mutex lock_;
+  std::condition_variable cv_;
+  const char *pending_; // Why, if a dump is wanted.
+  bool shutdown_;
+  FlightRecorderStats stats_; // Apart from packets.
+  std::thread thread_;
+};
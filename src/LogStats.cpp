@@ -0,0 +1,652 @@
+// blatlog: rebuilds what pounceblat did from its rotating spdlog files:
+// the state transition timeline, per-hour motion/run/disallow/abort counts,
+// RSSI distributions per blessed device and scan durations.
+//
+// Files are memory-mapped and split into lines with memchr(), which glibc
+// vectorises; each line is classified by a couple of byte compares, so the
+// whole thing runs at memory bandwidth rather than at iostream speed.
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <getopt.h>
+#include <map>
+#include <poll.h>
+#include <string>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+constexpr const char *kDefaultLog = "/tmp/pounceblat.log";
+constexpr int kRotatedFiles = 3; // As passed to rotating_logger_mt().
+
+// Same order as BlatMachine::State; names have unique first letters.
+constexpr const char *kStates[] = {"ARMED", "DISABLED", "GRACE", "RUNNING",
+                                   "SCANNING"};
+constexpr size_t kNumStates = sizeof(kStates) / sizeof(kStates[0]);
+
+struct HourCounts {
+  uint64_t motion = 0;
+  uint64_t runs = 0;
+  uint64_t disallowed = 0;
+  uint64_t aborts = 0;
+  uint64_t scanMs = 0;
+};
+
+struct Device {
+  std::string addr;
+  uint64_t rssi[128] = {}; // Indexed by -RSSI.
+  uint64_t sightings = 0;
+};
+
+struct Analysis {
+  bool timeline = false; // Print transitions as they are found.
+
+  uint64_t bytes = 0;
+  uint64_t lines = 0;
+  uint64_t unparsed = 0; // Lines without a timestamp (e.g. perror()).
+  uint64_t restarts = 0;
+
+  std::map<int64_t, HourCounts> hours; // Keyed by hour since the epoch.
+  uint64_t transitions[kNumStates][kNumStates] = {};
+  std::vector<Device> devices;
+  std::vector<uint32_t> scanMs;
+
+  // Parser state that carries across lines and files.
+  int64_t scanStartMs = -1;
+  char day[10] = {};
+  int64_t dayMs = 0;
+};
+
+// "[2026-10-19 10:20:04.052] " -> ms since the epoch, in the log's own
+// wall clock. The date part changes rarely, so timegm() runs once a day.
+bool parseTimestamp(const char *p, const char *end, Analysis &a,
+                    int64_t &ms) {
+  if (end - p < 26 || p[0] != '[' || p[11] != ' ' || p[24] != ']') {
+    return false;
+  }
+  if (memcmp(a.day, p + 1, sizeof(a.day)) != 0) {
+    struct tm tm = {};
+    if (sscanf(p + 1, "%4d-%2d-%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday) !=
+        3) {
+      return false;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    memcpy(a.day, p + 1, sizeof(a.day));
+    a.dayMs = int64_t(timegm(&tm)) * 1000;
+  }
+  auto d = [p](int i) { return p[i] - '0'; };
+  ms = a.dayMs + (d(12) * 10 + d(13)) * 3600000ll +
+       (d(15) * 10 + d(16)) * 60000ll + (d(18) * 10 + d(19)) * 1000ll +
+       d(21) * 100 + d(22) * 10 + d(23);
+  return true;
+}
+
+int stateIndex(const char *p, const char *end) {
+  for (size_t i = 0; i < kNumStates; ++i) {
+    const size_t len = strlen(kStates[i]);
+    if (p[0] == kStates[i][0] && size_t(end - p) >= len &&
+        memcmp(p, kStates[i], len) == 0) {
+      return int(i);
+    }
+  }
+  return -1;
+}
+
+bool startsWith(const char *p, const char *end, const char *prefix,
+                size_t len) {
+  return size_t(end - p) >= len && memcmp(p, prefix, len) == 0;
+}
+#define STARTS_WITH(p, end, lit) startsWith(p, end, lit, sizeof(lit) - 1)
+
+std::string formatMs(int64_t ms) {
+  const time_t t = ms / 1000;
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  char buf[32];
+  strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+  return std::string(buf) + "." + std::to_string(1000 + ms % 1000).substr(1);
+}
+
+void parseLine(const char *p, const char *end, Analysis &a) {
+  int64_t ms;
+  a.lines++;
+  if (!parseTimestamp(p, end, a, ms)) {
+    a.unparsed++;
+    return;
+  }
+
+  // Skip "[logger] [level] "; the logger name is only there for the
+  // rotating file logger.
+  const char *msg = p + 26;
+  while (msg < end && *msg == '[') {
+    const char *close = static_cast<const char *>(memchr(msg, ']', end - msg));
+    if (!close) {
+      return;
+    }
+    msg = close + 2;
+  }
+  if (msg >= end) {
+    return;
+  }
+
+  HourCounts *hour = nullptr;
+  auto hourOf = [&]() -> HourCounts & {
+    if (!hour) {
+      hour = &a.hours[ms / 3600000];
+    }
+    return *hour;
+  };
+
+  switch (*msg) {
+    case 'T':
+      if (STARTS_WITH(msg, end, "Transition state from ")) {
+        const char *from = msg + sizeof("Transition state from ") - 1;
+        const int f = stateIndex(from, end);
+        if (f < 0) {
+          return;
+        }
+        const char *to = from + strlen(kStates[f]) + sizeof(" -> ") - 1;
+        const int t = to < end ? stateIndex(to, end) : -1;
+        if (t < 0) {
+          return;
+        }
+        a.transitions[f][t]++;
+        if (a.timeline) {
+          printf("%.23s %s -> %s\n", p + 1, kStates[f], kStates[t]);
+        }
+      }
+      break;
+
+    case 'M':
+      if (STARTS_WITH(msg, end, "Motion detected!")) {
+        hourOf().motion++;
+      }
+      break;
+
+    case 'S':
+      if (STARTS_WITH(msg, end, "Scanning timed out")) {
+        hourOf().runs++;
+      } else if (STARTS_WITH(msg, end, "Scanning for BLE devices (")) {
+        // One line per scan segment; the scan starts at the first.
+        if (a.scanStartMs < 0) {
+          a.scanStartMs = ms;
+        }
+      }
+      break;
+
+    case 'D':
+      if (STARTS_WITH(msg, end, "Done scanning for BLE devices.") &&
+          a.scanStartMs >= 0) {
+        const int64_t d = std::max<int64_t>(0, ms - a.scanStartMs);
+        a.scanMs.push_back(uint32_t(d));
+        hourOf().scanMs += d;
+        a.scanStartMs = -1;
+      }
+      break;
+
+    case 'N':
+      if (STARTS_WITH(msg, end, "Nazbert detected in SCANNING") ||
+          STARTS_WITH(msg, end, "Nazbert was here")) { // Pre-warm, at once.
+        hourOf().disallowed++;
+      } else if (STARTS_WITH(msg, end, "Nazbert detected while running")) {
+        hourOf().aborts++;
+      }
+      break;
+
+    case 'B': {
+      // "Blessed device F1:15:32:5B:7E:66 is in range with RSSI -65"
+      static constexpr char kPrefix[] = "Blessed device ";
+      static constexpr char kRssi[] = " is in range with RSSI ";
+      const char *addr = msg + sizeof(kPrefix) - 1;
+      const char *rssi = addr + 17 + sizeof(kRssi) - 1;
+      if (rssi >= end || !STARTS_WITH(msg, end, kPrefix) ||
+          memcmp(addr + 17, kRssi, sizeof(kRssi) - 1) != 0) {
+        return;
+      }
+      const long value = strtol(rssi, nullptr, 10);
+      auto dev = std::find_if(
+          a.devices.begin(), a.devices.end(),
+          [addr](Device const &d) { return !d.addr.compare(0, 17, addr, 17); });
+      if (dev == a.devices.end()) {
+        a.devices.emplace_back();
+        dev = a.devices.end() - 1;
+        dev->addr.assign(addr, 17);
+      }
+      dev->sightings++;
+      dev->rssi[std::clamp<long>(-value, 0, 127)]++;
+      break;
+    }
+
+    case 'H':
+      if (STARTS_WITH(msg, end, "Here starts blatting!")) {
+        a.restarts++;
+        a.scanStartMs = -1; // A scan cut short by a restart never ended.
+        if (a.timeline) {
+          printf("%.23s restart\n", p + 1);
+        }
+      }
+      break;
+  }
+}
+
+// Feeds every complete line in [p, end) to the parser and returns where the
+// unterminated tail, if any, starts.
+const char *parseLines(const char *p, const char *end, Analysis &a) {
+  while (p < end) {
+    const char *nl = static_cast<const char *>(memchr(p, '\n', end - p));
+    if (!nl) {
+      break;
+    }
+    parseLine(p, nl, a);
+    p = nl + 1;
+  }
+  return p;
+}
+
+// Returns the number of bytes consumed (up to the last newline), or -1.
+off_t analyseFile(const char *path, Analysis &a, bool mustExist) {
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    if (mustExist || errno != ENOENT) {
+      fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+    }
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    fprintf(stderr, "Cannot stat %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+
+  void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Cannot map %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  const char *begin = static_cast<const char *>(map);
+  const char *tail = parseLines(begin, begin + st.st_size, a);
+  a.bytes += st.st_size;
+  munmap(map, st.st_size);
+  return tail - begin;
+}
+
+// spdlog's rotating sink names backups "base.N.ext".
+std::string rotatedName(std::string const &path, int n) {
+  const size_t slash = path.rfind('/');
+  const size_t dot = path.rfind('.');
+  if (dot == std::string::npos || dot == 0 ||
+      (slash != std::string::npos && dot < slash + 2)) {
+    return path + "." + std::to_string(n);
+  }
+  return path.substr(0, dot) + "." + std::to_string(n) + path.substr(dot);
+}
+
+uint64_t percentile(std::vector<uint32_t> const &sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  return sorted[std::min(sorted.size() - 1, size_t(p * sorted.size()))];
+}
+
+void report(Analysis &a) {
+  printf("Transitions (from -> to: count)%s\n",
+         a.restarts ? "" : ", no restarts seen");
+  for (size_t f = 0; f < kNumStates; ++f) {
+    for (size_t t = 0; t < kNumStates; ++t) {
+      if (a.transitions[f][t]) {
+        printf("  %-8s -> %-8s %llu\n", kStates[f], kStates[t],
+               (unsigned long long)a.transitions[f][t]);
+      }
+    }
+  }
+  if (a.restarts) {
+    printf("  restarts %llu\n", (unsigned long long)a.restarts);
+  }
+
+  printf("\nhour,motion,runs,disallowed,aborts,scan_s\n");
+  for (const auto &[hour, c] : a.hours) {
+    printf("%.13s:00,%llu,%llu,%llu,%llu,%.1f\n",
+           formatMs(hour * 3600000).c_str(), (unsigned long long)c.motion,
+           (unsigned long long)c.runs, (unsigned long long)c.disallowed,
+           (unsigned long long)c.aborts, c.scanMs / 1000.0);
+  }
+
+  for (const auto &dev : a.devices) {
+    printf("\nRSSI for %s: %llu sightings\n", dev.addr.c_str(),
+           (unsigned long long)dev.sightings);
+    uint64_t peak = 0;
+    for (int bin = 0; bin < 128; bin += 5) {
+      uint64_t n = 0;
+      for (int i = bin; i < std::min(bin + 5, 128); ++i) {
+        n += dev.rssi[i];
+      }
+      peak = std::max(peak, n);
+    }
+    for (int bin = 0; bin < 128; bin += 5) {
+      uint64_t n = 0;
+      for (int i = bin; i < std::min(bin + 5, 128); ++i) {
+        n += dev.rssi[i];
+      }
+      if (n) {
+        printf("  %4d..%4d dBm %8llu %s\n", -std::min(bin + 4, 127), -bin,
+               (unsigned long long)n,
+               std::string(size_t(40.0 * n / peak + 0.5), '#').c_str());
+      }
+    }
+  }
+
+  std::sort(a.scanMs.begin(), a.scanMs.end());
+  printf("\nScans: %zu", a.scanMs.size());
+  if (!a.scanMs.empty()) {
+    printf(", ms: min %llu p50 %llu p90 %llu p99 %llu max %llu",
+           (unsigned long long)a.scanMs.front(),
+           (unsigned long long)percentile(a.scanMs, 0.5),
+           (unsigned long long)percentile(a.scanMs, 0.9),
+           (unsigned long long)percentile(a.scanMs, 0.99),
+           (unsigned long long)a.scanMs.back());
+  }
+  printf("\n");
+}
+
+volatile sig_atomic_t gStop = 0;
+
+void onSignal(int) { gStop = 1; }
+
+// Parses whatever is appended to path from offset on, reopening the file
+// when the logger rotates it, until interrupted.
+int follow(std::string const &path, off_t offset, Analysis &a) {
+  const int in = inotify_init1(IN_CLOEXEC);
+  if (in == -1) {
+    fprintf(stderr, "inotify_init1: %s\n", strerror(errno));
+    return 1;
+  }
+  // Watch the directory: rotation renames the file we are reading and
+  // creates a new one in its place.
+  const size_t slash = path.rfind('/');
+  const std::string dir =
+      slash == std::string::npos ? "." : path.substr(0, slash ? slash : 1);
+  if (inotify_add_watch(in, dir.c_str(), IN_MODIFY | IN_CREATE | IN_MOVED_TO) ==
+      -1) {
+    fprintf(stderr, "Cannot watch %s: %s\n", dir.c_str(), strerror(errno));
+    close(in);
+    return 1;
+  }
+
+  struct sigaction sa = {};
+  sa.sa_handler = onSignal;
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st = {};
+  if (fd != -1) {
+    fstat(fd, &st);
+  }
+  std::string pending; // Unterminated last line.
+  std::vector<char> buf(1 << 16);
+
+  auto drain = [&]() {
+    ssize_t n;
+    while (fd != -1 && (n = pread(fd, buf.data(), buf.size(), offset)) > 0) {
+      offset += n;
+      a.bytes += n;
+      pending.append(buf.data(), n);
+      const char *rest =
+          parseLines(pending.data(), pending.data() + pending.size(), a);
+      pending.erase(0, rest - pending.data());
+    }
+    fflush(stdout);
+  };
+
+  while (!gStop) {
+    drain();
+
+    struct stat now;
+    if (stat(path.c_str(), &now) == 0 &&
+        (fd == -1 || now.st_ino != st.st_ino || now.st_dev != st.st_dev)) {
+      // Rotated. The logger may have written to the old file after the
+      // drain above and before the rename, so drain it once more.
+      if (fd != -1) {
+        drain();
+        close(fd);
+      }
+      fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd != -1) {
+        fstat(fd, &st);
+      }
+      offset = 0;
+      pending.clear();
+      continue;
+    }
+
+    struct pollfd pfd = {in, POLLIN, 0};
+    if (poll(&pfd, 1, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "poll: %s\n", strerror(errno));
+      break;
+    }
+    char events[4096] __attribute__((aligned(__alignof__(inotify_event))));
+    if (read(in, events, sizeof(events)) == -1 && errno != EINTR) {
+      fprintf(stderr, "inotify read: %s\n", strerror(errno));
+      break;
+    }
+  }
+
+  if (fd != -1) {
+    close(fd);
+  }
+  close(in);
+  return 0;
+}
+
+} // namespace
+
+#ifdef LOG_STATS_TEST
+// A synthetic log, in the daemon's own words, through the parser; then the
+// same through --follow across a rotation.
+#include <cassert>
+#include <pthread.h>
+#include <thread>
+
+static const char kLog[] =
+    "[2026-10-19 10:00:00.000] [pounceblat] [info] Here starts blatting!\n"
+    "[2026-10-19 10:00:00.100] [pounceblat] [info] Transition state from "
+    "DISABLED -> ARMED\n"
+    "[2026-10-19 10:05:00.000] [pounceblat] [info] Motion detected! Line 4.\n"
+    "[2026-10-19 10:05:00.001] [pounceblat] [info] Transition state from "
+    "ARMED -> SCANNING\n"
+    "[2026-10-19 10:05:00.002] [pounceblat] [info] Scanning for BLE devices "
+    "(DECISION_PENDING, 50.0% duty)...\n"
+    "[2026-10-19 10:05:00.500] [pounceblat] [info] Blessed device "
+    "F1:15:32:5B:7E:66 is in range with RSSI -65\n"
+    "[2026-10-19 10:05:00.501] [pounceblat] [warning] Nazbert detected in "
+    "SCANNING state, hold yer horses! NAZBERT_DETECTED F1:15:32:5B:7E:66 "
+    "RSSI -65 hci0 at 1.500000\n"
+    "[2026-10-19 10:05:00.502] [pounceblat] [info] Transition state from "
+    "SCANNING -> GRACE\n"
+    "[2026-10-19 10:05:00.503] [pounceblat] [info] Done scanning for BLE "
+    "devices.\n"
+    "[2026-10-19 10:10:00.000] [pounceblat] [info] Transition state from "
+    "GRACE -> ARMED\n"
+    "[2026-10-19 10:10:00.001] [pounceblat] [info] Pre-warm scanning for BLE "
+    "devices (idle, 25.0% duty)...\n"
+    "[2026-10-19 10:40:00.000] [pounceblat] [info] Motion detected! Line 4.\n"
+    "[2026-10-19 10:40:00.001] [pounceblat] [warning] Nazbert was here 800ms "
+    "ago, hold yer horses!\n"
+    "[2026-10-19 10:40:00.002] [pounceblat] [info] Transition state from "
+    "ARMED -> GRACE\n"
+    "[2026-10-19 10:40:00.003] [pounceblat] [info] Done scanning for BLE "
+    "devices.\n"
+    "ioctl(I2C_SLAVE): No such device\n"
+    "[2026-10-19 11:00:00.000] [pounceblat] [info] Motion detected! Line 4.\n"
+    "[2026-10-19 11:00:00.001] [pounceblat] [info] Transition state from "
+    "ARMED -> SCANNING\n"
+    "[2026-10-19 11:00:00.002] [pounceblat] [info] Scanning for BLE devices "
+    "(DECISION_PENDING, 50.0% duty)...\n"
+    "[2026-10-19 11:00:05.002] [pounceblat] [info] Scanning timed out, game "
+    "on!\n"
+    "[2026-10-19 11:00:05.003] [pounceblat] [info] Transition state from "
+    "SCANNING -> RUNNING\n"
+    "[2026-10-19 11:00:06.000] [pounceblat] [info] Blessed device "
+    "F1:15:32:5B:7E:66 is in range with RSSI -70\n"
+    "[2026-10-19 11:00:06.001] [pounceblat] [warning] Nazbert detected while "
+    "running oh noes :( NAZBERT_DETECTED F1:15:32:5B:7E:66 RSSI -70 hci0 at "
+    "2.000000\n"
+    "[2026-10-19 11:00:06.002] [pounceblat] [info] Transition state from "
+    "RUNNING -> GRACE\n"
+    "[2026-10-19 11:00:06.003] [pounceblat] [info] Done scanning for BLE "
+    "devices.\n";
+
+static const char kMotion[] =
+    "[2026-10-19 12:00:00.000] [pounceblat] [info] Motion detected! Line 4.\n";
+
+static void append(const char *path, const char *text) {
+  FILE *f = fopen(path, "a");
+  assert(f);
+  fputs(text, f);
+  fclose(f);
+}
+
+int main(void) {
+  static constexpr int64_t kHour = int64_t(1792404000) / 3600; // 10:00.
+  const std::string path = "/tmp/blatlog-test.log";
+  const std::string rotated = rotatedName(path, 1);
+  unlink(path.c_str());
+  unlink(rotated.c_str());
+  append(path.c_str(), kLog);
+  {
+    Analysis a;
+    assert(analyseFile(path.c_str(), a, true) == off_t(sizeof(kLog) - 1));
+    report(a);
+    assert(a.lines == 25 && a.unparsed == 1 && a.restarts == 1);
+    assert(a.hours.size() == 2);
+    HourCounts const &ten = a.hours[kHour];
+    HourCounts const &eleven = a.hours[kHour + 1];
+    assert(ten.motion == 2 && ten.disallowed == 2 && ten.runs == 0);
+    assert(eleven.motion == 1 && eleven.runs == 1 && eleven.aborts == 1);
+    assert(a.transitions[0][4] == 2 && a.transitions[4][2] == 1);
+    assert(a.transitions[0][2] == 1 && a.transitions[2][0] == 1);
+    assert(a.devices.size() == 1 && a.devices[0].sightings == 2);
+    assert(a.devices[0].rssi[65] == 1 && a.devices[0].rssi[70] == 1);
+    // Pre-warming is not a scan.
+    assert(a.scanMs.size() == 2 && a.scanMs[0] == 501 &&
+           a.scanMs[1] == 6001);
+  }
+
+  // Following: lines written to the old file around the rotation count,
+  // and so do those in its replacement.
+  Analysis a;
+  std::thread follower([&] { follow(path, 0, a); });
+  usleep(100000);
+  append(path.c_str(), kMotion);
+  assert(rename(path.c_str(), rotated.c_str()) == 0);
+  append(rotated.c_str(), kMotion);
+  append(path.c_str(), kMotion);
+  usleep(100000);
+  pthread_kill(follower.native_handle(), SIGINT);
+  follower.join();
+  assert(a.hours[kHour + 2].motion == 3);
+  assert(a.lines == 28);
+  unlink(path.c_str());
+  unlink(rotated.c_str());
+  puts("blatlog OK.");
+  return 0;
+}
+
+#else
+
+void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [options] [LOGFILE]\n"
+          "  --timeline       print every state transition\n"
+          "  --follow         keep reading LOGFILE as it grows; report on ^C\n"
+          "  --current-only   skip the rotated files\n"
+          "LOGFILE is what was passed to pounceblat --logfile (%s).\n",
+          argv0, kDefaultLog);
+}
+
+int main(int argc, char *argv[]) {
+  static constexpr struct option long_options[] = {
+      {"timeline", no_argument, nullptr, 't'},
+      {"follow", no_argument, nullptr, 'f'},
+      {"current-only", no_argument, nullptr, 'c'},
+      {"help", no_argument, nullptr, 'h'},
+      {nullptr, 0, nullptr, 0},
+  };
+  Analysis a;
+  bool followMode = false;
+  bool currentOnly = false;
+  int ch;
+
+  while ((ch = getopt_long(argc, argv, "tfch", long_options, nullptr)) !=
+         -1) {
+    switch (ch) {
+      case 't':
+        a.timeline = true;
+        break;
+      case 'f':
+        followMode = true;
+        break;
+      case 'c':
+        currentOnly = true;
+        break;
+      default:
+        usage(argv[0]);
+        return ch == 'h' ? 0 : 1;
+    }
+  }
+  const std::string path = optind < argc ? argv[optind] : kDefaultLog;
+
+  const auto start = std::chrono::steady_clock::now();
+  if (!currentOnly) {
+    for (int n = kRotatedFiles; n > 0; --n) {
+      analyseFile(rotatedName(path, n).c_str(), a, false);
+    }
+  }
+  const off_t consumed = analyseFile(path.c_str(), a, !followMode);
+  if (consumed < 0 && !followMode) {
+    return 1;
+  }
+  const double elapsed = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+  fprintf(stderr, "%llu lines (%llu unparsed), %.1f MB in %.3fs (%.0f MB/s)\n",
+          (unsigned long long)a.lines, (unsigned long long)a.unparsed,
+          a.bytes / 1e6, elapsed,
+          a.bytes / 1e6 / std::max(elapsed, 1e-9));
+
+  if (followMode) {
+    a.timeline = true;
+    if (follow(path, std::max<off_t>(consumed, 0), a)) {
+      return 1;
+    }
+  }
+
+  report(a);
+  return 0;
+}
+#endif
@@ -1,208 +1,378 @@
 #include "PounceBlat.h"
+#include "DaemonStatus.h"
+#include "SdNotify.h"
+#include "SelfProfiler.h"
+#include "Trace.h"
 
-#include <iostream>
+#include <ctime>
+#include <iterator>
 #include <unistd.h>
 
 #include <spdlog/spdlog.h>
 
-PounceBlat::PounceBlat(std::vector<std::string> blessedDevices)
-    : scanner_(blessedDevices), state_(State::ARMED) {}
-
-void PounceBlat::transitionTo(State s) {
-  if (s != state_) {
-    spdlog::debug("Transition state from {} -> {}", state_, s);
-    eq_.clearTimeout();
-    state_ = s;
-    switch (s) {
-      case State::ARMED:
-        relay_.set(false);       // Should be a no-op... but can't hurt, eh?
-        scanner_.stopScanning(); // likewise.
-        break;
-      case State::DISABLED:
-        relay_.set(false);       // Should be a no-op... but can't hurt, eh?
-        scanner_.stopScanning(); // likewise.
-        break;
-      case State::GRACE:
-        relay_.set(false);
-        scanner_.stopScanning();
-        eq_.setTimeout(std::chrono::seconds(10));
-        break;
-      case State::RUNNING:
-        // NB: we do *not* stop scanning on this transition, so that if Nazbert
-        // wanders into range while running we detect it and halt ASAP.
-        relay_.set(true);
-        eq_.setTimeout(std::chrono::seconds(5)); // FIXME: configurable runtime?
-        break;
-      case State::SCANNING:
-        scanner_.startScanning(eq_);
-        eq_.setTimeout(std::chrono::seconds(5)); // FIXME: configurable runtime?
+using std::chrono::milliseconds;
+
+static std::unique_ptr<StatsStore> openStatsStore(const char *path) {
+  if (!path) {
+    return nullptr;
+  }
+  try {
+    return std::make_unique<StatsStore>(path);
+  } catch (std::runtime_error const &) {
+    spdlog::warn("Continuing without persistent stats.");
+    return nullptr;
+  }
+}
+
+static std::unique_ptr<TelemetryClient> openTelemetry(Config const &c) {
+  if (c.telemetrySocket.empty()) {
+    return nullptr;
+  }
+  std::string name = c.telemetryName;
+  if (name.empty()) {
+    char host[64] = {};
+    gethostname(host, sizeof(host) - 1);
+    name = host;
+  }
+  return std::make_unique<TelemetryClient>(c.telemetrySocket, name);
+}
+
+static std::unique_ptr<FlightRecorder> openRecorder(Config const &c) {
+  if (c.flightRecorderDir.empty()) {
+    return nullptr;
+  }
+  return std::make_unique<FlightRecorder>(c.flightRecorderDir,
+                                          c.flightRecorderWindow);
+}
+
+static milliseconds msSince(std::chrono::steady_clock::time_point t) {
+  return std::chrono::duration_cast<milliseconds>(
+      std::chrono::steady_clock::now() - t);
+}
+
+PounceBlat::PounceBlat(ConfigWatcher &config, const char *statsPath,
+                       const char *forecastPath)
+    : configWatcher_(config), config_(config.reader()),
+      start_(Clock::now()), store_(openStatsStore(statsPath)),
+      forecast_(forecastPath), telemetry_(openTelemetry(*config_)),
+      recorder_(openRecorder(*config_)),
+      machine_(*this, config_->timings, store_.get(), State::DISABLED),
+      live_(false), wantEnabled_(true), stopping_(false),
+      bringups_{{{"relay", true},
+                 {"sensor", true},
+                 {"scanner", true},
+                 {"controller", false}}},
+      busySince_(0) {
+  // Hardware settings are only read here; see Config.
+  Config const &c = *config_;
+  bringUp(RELAY, pendingRelay_, [c] {
+    return std::make_unique<Relay>(c.i2cDevice.c_str(), c.i2cAddress,
+                                   c.relayChannel, c.relayMaxOn);
+  });
+  bringUp(SENSOR, pendingSensor_, [c] {
+    return std::make_unique<Sensor>(c.gpioChip, c.gpioLine);
+  });
+  bringUp(SCANNER, pendingScanner_,
+          [this] {
+            return std::make_unique<Scanner>(configWatcher_, recorder_.get());
+          });
+  bringUp(CONTROLLER, pendingController_,
+          [] { return std::make_unique<Controller>(); });
+
+  const auto interval = sdWatchdogInterval();
+  if (interval.count()) {
+    heartbeat_ = std::thread([this, interval] { heartbeat(interval); });
+  }
+  forecastTicks_ = std::thread([this] { forecastTicks(); });
+  if (telemetry_) {
+    telemetryTicks_ = std::thread(
+        [this, retry = telemetry_->retry()] { telemetryTicks(retry); });
+  }
+}
+
+PounceBlat::~PounceBlat() {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  for (auto &b : bringups_) {
+    b.thread.join();
+  }
+  if (heartbeat_.joinable()) {
+    heartbeat_.join();
+  }
+  forecastTicks_.join();
+  if (telemetryTicks_.joinable()) {
+    telemetryTicks_.join();
+  }
+  forecast_.save();
+  if (controller_) {
+    controller_->stop();
+  }
+}
+
+// Constructs a device on its own thread, retrying with backoff until it
+// works, then hands it to the dispatch thread.
+template <typename T, typename Make>
+void PounceBlat::bringUp(Device d, std::unique_ptr<T> &pending, Make make) {
+  bringups_[d].thread = std::thread([this, d, &pending, make] {
+    Bringup &b = bringups_[d];
+    milliseconds backoff(100);
+
+    while (1) {
+      const auto attemptStart = Clock::now();
+      std::string error;
+      try {
+        auto device = make();
+        std::lock_guard<std::mutex> lock(lock_);
+        pending = std::move(device);
+        b.attempts++;
+        b.upAfter = msSince(start_);
+        spdlog::info("{} up after {}ms ({} attempts, last took {}ms).", b.name,
+                     b.upAfter->count(), b.attempts,
+                     msSince(attemptStart).count());
         break;
+      } catch (std::exception const &e) {
+        error = e.what();
+      }
+
+      std::unique_lock<std::mutex> lock(lock_);
+      b.attempts++;
+      b.lastError = error;
+      if (b.attempts == 1 || b.attempts % 10 == 0) {
+        spdlog::warn("Cannot bring up {} (attempt {}): {}. Retrying.", b.name,
+                     b.attempts, error);
+      }
+      if (cv_.wait_for(lock, backoff, [this] { return stopping_; })) {
+        return;
+      }
+      backoff = std::min(backoff * 2, milliseconds(5000));
     }
+    eq_.send(Event{.type = Event::Type::DEVICE_READY});
+  });
+}
+
+// Dispatch thread: takes ownership of whatever has come up, and goes live
+// once every critical device is here.
+void PounceBlat::adoptDevices() {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    if (pendingRelay_) {
+      relay_ = std::move(pendingRelay_);
+      bringups_[RELAY].adopted = true;
+    }
+    if (pendingSensor_) {
+      sensor_ = std::move(pendingSensor_);
+      sensor_->monitor(eq_);
+      bringups_[SENSOR].adopted = true;
+    }
+    if (pendingScanner_) {
+      scanner_ = std::move(pendingScanner_);
+      bringups_[SCANNER].adopted = true;
+    }
+    if (pendingController_) {
+      controller_ = std::move(pendingController_);
+      controller_->run(eq_);
+      bringups_[CONTROLLER].adopted = true;
+    }
+  }
+
+  std::string missing;
+  for (const auto &b : bringups_) {
+    if (b.critical && !b.adopted) {
+      missing += missing.empty() ? "" : ", ";
+      missing += b.name;
+    }
+  }
+  if (!missing.empty()) {
+    sdNotify(fmt::format("STATUS=Waiting for {}", missing).c_str());
     publishStats();
-  } else {
-    spdlog::warn(
-        "Attempted to transition to state {} when already in that state.");
+    return;
+  }
+  if (live_) {
+    publishStats();
+    return;
+  }
+
+  live_ = true;
+  struct timespec boot;
+  clock_gettime(CLOCK_BOOTTIME, &boot);
+  spdlog::info("Critical devices live {}ms after start, {:.1f}s after boot.",
+               msSince(start_).count(), boot.tv_sec + boot.tv_nsec / 1e9);
+  sdNotify(wantEnabled_ ? "READY=1\nSTATUS=Armed" : "READY=1\nSTATUS=Disabled");
+  if (wantEnabled_) {
+    machine_.handle(Event{.type = Event::Type::ENABLE});
   }
+  publishStats();
 }
 
-void PounceBlat::run() {
-  sensor_.monitor(eq_);
-  controller_.run(eq_);
+// Pings the systemd watchdog for as long as the dispatch thread keeps
+// getting through its events.
+void PounceBlat::heartbeat(std::chrono::microseconds interval) {
+  Tracer::registerThread("heartbeat");
+  const auto period = interval / 2;
+  bool stuck = false;
+  std::unique_lock<std::mutex> lock(lock_);
 
-  publishStats();
+  while (!cv_.wait_for(lock, period, [this] { return stopping_; })) {
+    const int64_t busy = busySince_.load(std::memory_order_relaxed);
+    const auto busyFor = std::chrono::nanoseconds(
+        busy ? Clock::now().time_since_epoch().count() - busy : 0);
+    if (busyFor > period) {
+      if (!stuck) {
+        spdlog::error("Dispatch stuck on one event for {}ms, letting the "
+                      "systemd watchdog fire.",
+                      std::chrono::duration_cast<milliseconds>(busyFor)
+                          .count());
+      }
+      stuck = true;
+      continue;
+    }
+    stuck = false;
+    sdNotify("WATCHDOG=1");
+  }
+}
 
-  while (1) {
-    Event e = eq_.wait();
-
-    spdlog::debug("Received event {} in state {}", e, state_);
-
-    switch (state_) {
-      case State::ARMED:
-        switch (e.type) {
-          case Event::Type::DISABLE:
-            transitionTo(State::DISABLED);
-            break;
-          case Event::Type::ENABLE:
-            spdlog::warn("Enable ignored in {} state.", state_);
-            break;
-          case Event::Type::MOTION_DETECTED:
-            spdlog::info("Motion detected!");
-            stats_.motion++;
-            transitionTo(State::SCANNING);
-            break;
-          case Event::Type::TIMEOUT:
-            spdlog::warn("Unexpected timeout event in ARMED state.");
-            break;
-          case Event::Type::NAZBERT_DETECTED:
-            spdlog::warn("Unexpected Nazbert in ARMED state.");
-            transitionTo(State::GRACE);
-            break;
-        }
-        break;
+// Wakes the dispatch thread as each forecast slot begins, and saves the
+// forecast while it is about it, off the dispatch thread.
+void PounceBlat::forecastTicks() {
+  Tracer::registerThread("forecast");
+  std::unique_lock<std::mutex> lock(lock_);
 
-      case State::DISABLED:
-        switch (e.type) {
-          case Event::Type::ENABLE:
-            transitionTo(State::ARMED);
-            break;
-          case Event::Type::DISABLE:
-          case Event::Type::MOTION_DETECTED:
-          case Event::Type::TIMEOUT:
-          case Event::Type::NAZBERT_DETECTED:
-            spdlog::debug("Event {} ignored in {} state.", e, state_);
-            break;
-        }
-        break;
+  do {
+    eq_.send(Event{.type = Event::Type::FORECAST});
+    lock.unlock();
+    forecast_.save();
+    lock.lock();
+  } while (!cv_.wait_until(
+      lock,
+      std::chrono::system_clock::from_time_t(
+          ActivityForecast::tickEnd(time(nullptr))),
+      [this] { return stopping_; }));
+}
 
-      case State::GRACE:
-        switch (e.type) {
-          case Event::Type::DISABLE:
-            transitionTo(State::DISABLED);
-            break;
-          case Event::Type::ENABLE:
-            spdlog::warn("Enable ignored in {} state.", state_);
-            break;
-          case Event::Type::MOTION_DETECTED:
-          case Event::Type::NAZBERT_DETECTED:
-            spdlog::debug("Event {} ignored in GRACE state.", e);
-            break;
-          case Event::Type::TIMEOUT:
-            transitionTo(State::ARMED);
-            break;
-        }
-        break;
+// Has the dispatch thread update telemetry even while the machine stays in
+// one state, so that a lost aggregator is reconnected and a dead connection
+// is noticed without waiting for the next state change.
+void PounceBlat::telemetryTicks(std::chrono::milliseconds interval) {
+  Tracer::registerThread("telemetry");
+  std::unique_lock<std::mutex> lock(lock_);
 
-      case State::RUNNING:
-        switch (e.type) {
-          case Event::Type::DISABLE:
-            transitionTo(State::DISABLED);
-            break;
-          case Event::Type::ENABLE:
-            spdlog::warn("Enable ignored in {} state.", state_);
-            break;
-          case Event::Type::MOTION_DETECTED:
-            spdlog::debug("Motion ignored, already in RUNNING state.");
-            break;
-          case Event::Type::TIMEOUT:
-            transitionTo(State::GRACE);
-            break;
-          case Event::Type::NAZBERT_DETECTED:
-            spdlog::warn("Nazbert detected while running oh noes :(");
-            stats_.aborts++;
-            transitionTo(State::GRACE);
-            break;
-        }
-        break;
+  while (!cv_.wait_for(lock, interval, [this] { return stopping_; })) {
+    eq_.send(Event{.type = Event::Type::TELEMETRY});
+  }
+}
 
-      case State::SCANNING:
-        switch (e.type) {
-          case Event::Type::DISABLE:
-            transitionTo(State::DISABLED);
-            break;
-          case Event::Type::ENABLE:
-            spdlog::warn("Enable ignored in {} state.", state_);
-            break;
-          case Event::Type::MOTION_DETECTED:
-            spdlog::info("Motion ignored in scanning state.");
-            break;
-          case Event::Type::TIMEOUT:
-            spdlog::info("Scanning timed out, game on!");
-            stats_.runs++;
-            transitionTo(State::RUNNING);
-            break;
-          case Event::Type::NAZBERT_DETECTED:
-            spdlog::warn(
-                "Nazbert detected in SCANNING state, hold yer horses!");
-            stats_.disallowed++;
-            transitionTo(State::GRACE);
-            break;
-        }
-        break;
+// Dispatch thread: pre-warm or not for the slot just begun.
+void PounceBlat::updatePrewarm() {
+  const uint32_t tick = ActivityForecast::tickFor(time(nullptr));
+  forecast_.visit(tick);
+  const unsigned pct = config_->prewarmPct;
+  machine_.setPrewarm(pct && forecast_.hot(tick, pct));
+}
+
+static PerfLoop gDispatchLoop("dispatch");
+
+void PounceBlat::run() {
+  Tracer::registerThread("dispatch");
+  publishStats();
+
+  while (1) {
+    const Event e = eq_.wait();
+    if (config_.refresh()) {
+      machine_.setTimings(config_->timings);
+    }
+    busySince_.store(Clock::now().time_since_epoch().count(),
+                     std::memory_order_relaxed);
+    TraceFlow flow(e.flow);
+    TRACE_SPAN("machine.handle", static_cast<uint64_t>(e.type));
+    PerfScope perf(gDispatchLoop);
+    if (e.type == Event::Type::DEVICE_READY) {
+      adoptDevices();
+    } else if (e.type == Event::Type::FORECAST) {
+      updatePrewarm();
+    } else if (e.type == Event::Type::TELEMETRY) {
+      telemetry_->update(machine_.state(), machine_.stats(),
+                         machine_.lastLatency());
+    } else if (live_) {
+      if (e.type == Event::Type::MOTION_DETECTED) {
+        forecast_.record(ActivityForecast::Kind::MOTION,
+                         ActivityForecast::tickFor(time(nullptr)));
+      } else if (e.type == Event::Type::NAZBERT_DETECTED) {
+        forecast_.record(ActivityForecast::Kind::SIGHTING,
+                         ActivityForecast::tickFor(time(nullptr)));
+      }
+      machine_.handle(e);
+    } else if (e.type == Event::Type::ENABLE) {
+      wantEnabled_ = true; // Applied once we go live.
+    } else if (e.type == Event::Type::DISABLE) {
+      wantEnabled_ = false;
     }
+    busySince_.store(0, std::memory_order_relaxed);
   }
 }
 
-const char *PounceBlat::stateName(State s) {
-  switch (s) {
-    case PounceBlat::State::ARMED:
-      return "ARMED";
-    case PounceBlat::State::DISABLED:
-      return "DISABLED";
-    case PounceBlat::State::GRACE:
-      return "GRACE";
-    case PounceBlat::State::RUNNING:
-      return "RUNNING";
-    case PounceBlat::State::SCANNING:
-      return "SCANNING";
+void PounceBlat::setRelay(bool enable) {
+  if (!enable) {
+    patterns_.stop();
+    relay_->set(false);
+  } else if (config_->blatPattern.empty()) {
+    relay_->set(true);
+  } else {
+    patterns_.play(*relay_, config_->blatPattern);
   }
-  return "Impossible!";
 }
 
-void PounceBlat::publishStats() {
-  char tmpName[] = "/dev/shm/pounceblat.status.XXXXXX";
-  int tmpFd = mkstemp(tmpName);
-  if (tmpFd == -1) {
-    spdlog::warn("Cannot create temporary status file: {}", strerror(errno));
-    return;
+void PounceBlat::stateChanged() {
+  publishStats();
+  if (telemetry_) {
+    telemetry_->update(machine_.state(), machine_.stats(),
+                       machine_.lastLatency());
   }
-  dprintf(tmpFd, "Current state: %s\n", stateName(state_));
-  dprintf(tmpFd, "\n");
-  dprintf(tmpFd, "Motion detected: %u\n", stats_.motion);
-  dprintf(tmpFd, "Runs: %u\n", stats_.runs);
-  dprintf(tmpFd, "Disallowed due to Nazbert: %u\n", stats_.disallowed);
-  dprintf(tmpFd, "Aborted due to Nazbert: %u\n", stats_.aborts);
+}
 
-  if (close(tmpFd) == -1) {
-    spdlog::warn("Error writing temporary status file: {}", strerror(errno));
-    return;
-  }
+void PounceBlat::publishStats() {
+  TRACE_SPAN("publishStats");
+  StatusBuffer buf;
+  auto out = std::back_inserter(buf);
 
-  if (chmod(tmpName, 0444) == -1) {
-    spdlog::warn("Error chmoding temporary status file: {}", strerror(errno));
-    return;
+  DaemonStatus{machine_, store_.get(), profiler_, patterns_, forecast_,
+               recorder_.get()}
+      .publish(buf);
+
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    for (const auto &b : bringups_) {
+      if (b.upAfter) {
+        fmt::format_to(out, "Device {}: up after {}ms, {} attempts\n", b.name,
+                       b.upAfter->count(), b.attempts);
+      } else {
+        fmt::format_to(out, "Device {}: DOWN after {} attempts: {}\n", b.name,
+                       b.attempts, b.lastError);
+      }
+    }
   }
 
-  if (rename(tmpName, "/dev/shm/pounceblat.status") == -1) {
-    spdlog::warn("Error renaming temporary stats file: {}", strerror(errno));
+  if (relay_) {
+    const auto wd = relay_->watchdogStats();
+    fmt::format_to(out, "Relay watchdog interventions: {}\n",
+                   wd.interventions);
+    fmt::format_to(out, "Relay watchdog overrun ms: last {} max {}\n",
+                   wd.lastOverrun.count(), wd.maxOverrun.count());
   }
+  if (scanner_) {
+    const auto rx = scanner_->rxStats();
+    fmt::format_to(out,
+                   "HCI rx: wakeups {} packets {} max batch {} drops {} "
+                   "risky scans {}\n",
+                   rx.wakeups, rx.packets, rx.maxBatch, rx.drops,
+                   rx.riskyScans);
+    fmt::format_to(out, "HCI rx backlog bytes: max {} of {}\n",
+                   rx.maxBacklog, rx.rcvbuf);
+    fmt::format_to(out, "\n");
+    scanner_->scheduler().publish(buf);
+  }
+
+  writeStatusFile("/dev/shm/pounceblat.status", buf);
 }
@@ -1,52 +1,128 @@
 #pragma once
 
+#include "ActivityForecast.h"
+#include "BlatMachine.h"
+#include "Config.h"
 #include "Controller.h"
 #include "EventQueue.h"
+#include "FlightRecorder.h"
 #include "Relay.h"
 #include "Scanner.h"
+#include "SelfProfiler.h"
 #include "Sensor.h"
+#include "StatsStore.h"
+#include "TelemetryClient.h"
 
-struct BlatStats {
-  unsigned motion = 0;
-  unsigned runs = 0;
-  unsigned disallowed = 0;
-  unsigned aborts = 0;
-};
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
 
-class PounceBlat {
+class PounceBlat : private BlatActions {
 public:
-  explicit PounceBlat(std::vector<std::string> blessedDevices);
+  // statsPath and forecastPath may be null, in which case stats or the
+  // activity forecast are not persisted.
+  //
+  // Devices are brought up in the background, each retrying until it comes
+  // up, so a missing or slow device neither kills the daemon nor holds up
+  // the others. The machine stays DISABLED until every critical device is
+  // live, at which point systemd is told we are ready.
+  PounceBlat(ConfigWatcher &config, const char *statsPath,
+             const char *forecastPath);
+  ~PounceBlat();
   void run();
 
-  enum class State { ARMED, DISABLED, GRACE, RUNNING, SCANNING };
-  static const char *stateName(State s);
+  using State = BlatMachine::State;
 
 private:
-  Relay relay_;
-  Sensor sensor_;
-  EventQueue eq_;
-  Scanner scanner_;
-  Controller controller_;
+  using Clock = std::chrono::steady_clock;
 
-  State state_;
+  enum Device { RELAY, SENSOR, SCANNER, CONTROLLER, DEVICES };
 
-  BlatStats stats_;
+  struct Bringup {
+    const char *name;
+    bool critical; // Nothing is blatted until all of these are live.
+    std::thread thread;
+    // Guarded by lock_.
+    unsigned attempts = 0;
+    std::string lastError;
+    std::optional<std::chrono::milliseconds> upAfter;
+    // Dispatch thread only.
+    bool adopted = false;
+  };
 
-  void transitionTo(State s);
+  template <typename T, typename Make>
+  void bringUp(Device d, std::unique_ptr<T> &pending, Make make);
+  void adoptDevices();
+  void heartbeat(std::chrono::microseconds interval);
+  void forecastTicks();
+  void telemetryTicks(std::chrono::milliseconds interval);
+  void updatePrewarm();
   void publishStats();
-};
 
-template <> struct fmt::formatter<PounceBlat::State> {
-  constexpr auto parse(format_parse_context &ctx) {
-    auto it = ctx.begin();
-    if (*it != '}') {
-      throw format_error("invalid format");
-    }
-    return it;
-  }
+  ConfigWatcher &configWatcher_;
+  ConfigWatcher::Reader config_; // Dispatch thread only.
+  const Clock::time_point start_;
+  EventQueue eq_;
+  std::unique_ptr<StatsStore> store_;
+  SelfProfiler profiler_;
+  ActivityForecast forecast_;
+  std::unique_ptr<TelemetryClient> telemetry_; // Dispatch thread only.
+  std::unique_ptr<FlightRecorder> recorder_;    // Fed by the scanner.
+
+  BlatMachine machine_;
 
-  template <typename FormatContext>
-  auto format(const PounceBlat::State &s, FormatContext &ctx) {
-    return format_to(ctx.out(), "{}", PounceBlat::stateName(s));
+  // Owned by the dispatch thread once adopted.
+  std::unique_ptr<Relay> relay_;
+  std::unique_ptr<Sensor> sensor_;
+  std::unique_ptr<Scanner> scanner_;
+  std::unique_ptr<Controller> controller_;
+  // After relay_, so that it is destroyed first: stopping a pattern that is
+  // still playing switches the relay off.
+  PatternScheduler patterns_;
+  bool live_;        // All critical devices adopted.
+  bool wantEnabled_; // Last ENABLE/DISABLE seen before going live.
+
+  std::mutex lock_;
+  std::condition_variable cv_;
+  bool stopping_;
+  std::array<Bringup, DEVICES> bringups_;
+  // Brought up but not yet adopted.
+  std::unique_ptr<Relay> pendingRelay_;
+  std::unique_ptr<Sensor> pendingSensor_;
+  std::unique_ptr<Scanner> pendingScanner_;
+  std::unique_ptr<Controller> pendingController_;
+
+  // For the systemd watchdog: when the dispatch thread started on the event
+  // it is handling, in steady_clock ns, or 0 when it is waiting for one.
+  std::atomic<int64_t> busySince_;
+  std::thread heartbeat_;
+  std::thread forecastTicks_; // Sends FORECAST as each slot begins.
+  std::thread telemetryTicks_; // Sends TELEMETRY, if telemetry is on.
+
+  // BlatActions. None of these are called before the devices are live.
+  void setRelay(bool enable) override;
+  void startScanning(ScanSituation situation) override {
+    scanner_->startScanning(eq_, situation);
+  }
+  void setScanSituation(ScanSituation situation) override {
+    scanner_->setSituation(situation);
+  }
+  void stopScanning() override { scanner_->stopScanning(); }
+  void setTimeout(Event::Timer which,
+                  std::chrono::milliseconds delay) override {
+    eq_.setTimeout(which, delay);
+  }
+  void clearTimeout() override { eq_.clearTimeout(); }
+  void stateChanged() override;
+  void incident(const char *what) override {
+    if (recorder_) {
+      recorder_->dump(what);
+    }
   }
 };
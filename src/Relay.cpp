@@ -2,40 +2,99 @@
 #include <cstdio>
 #include <fcntl.h>
 #include <linux/i2c-dev.h>
+#include <spdlog/spdlog.h>
 #include <stdexcept>
 #include <sys/ioctl.h>
 #include <unistd.h>
 
 #include "Relay.h"
+#include "Trace.h"
 
-Relay::Relay() {
-  fd_ = open("/dev/i2c-1", O_RDWR);
-  if (fd_ == -1) {
+// Opened before anything else in Relay is constructed, so that failing
+// here, as bring-up does over and over while the device is missing, starts
+// no watchdog thread and leaves no fd behind.
+static int openDevice(const char *device, unsigned address) {
+  const int fd = open(device, O_RDWR | O_CLOEXEC);
+  if (fd == -1) {
     perror("Opening i2c device for relay");
     throw std::runtime_error("opening relay");
   }
-  if (ioctl(fd_, I2C_SLAVE, 0x10) < 0) {
+  if (ioctl(fd, I2C_SLAVE, address) < 0) {
     perror("ioctl(I2C_SLAVE)");
+    close(fd);
     throw std::runtime_error("initializing relay");
   }
+  return fd;
 }
 
-Relay::~Relay() { close(fd_); }
+Relay::Relay(const char *device, unsigned address, unsigned channel,
+             std::chrono::milliseconds maxOn)
+    : fd_{openDevice(device, address)}, channel_(channel), on_(0),
+      watchdog_(maxOn, [this] { return this->forceOff(); }) {}
 
-int Relay::set(bool enabled) {
+Relay::Fd::~Fd() {
+  if (fd != -1) {
+    close(fd);
+  }
+}
+
+int Relay::write(unsigned channel, bool enabled) {
   uint8_t buf[2];
-  buf[0] = 1; // register, i.e. relay number 1-4
+  buf[0] = channel; // register, i.e. relay number 1-4
   buf[1] = enabled ? 0xff : 0;
-  if (write(fd_, buf, 2) != 2) {
+  if (::write(fd_.fd, buf, 2) != 2) {
     perror("I2C write failed");
     return -1;
   }
   return 0;
 }
 
+int Relay::setChannel(unsigned channel, bool enabled) {
+  TRACE_SPAN("relay.set", channel << 1 | enabled);
+  std::lock_guard<std::mutex> lock(lock_);
+  int rc = write(channel, enabled);
+  if (enabled) {
+    // Arm even if the write failed; we don't know what state the relay is in.
+    if (!on_) {
+      watchdog_.arm();
+    }
+    on_ |= 1 << channel;
+  } else {
+    if (!rc) {
+      on_ &= ~(1 << channel);
+    }
+    if (!on_) {
+      watchdog_.disarm();
+    }
+  }
+  return rc;
+}
+
+// Called on the watchdog thread.
+bool Relay::forceOff() {
+  std::lock_guard<std::mutex> lock(lock_);
+  if (!on_ || watchdog_.pending()) {
+    return false; // Switched off or re-armed since the timer fired.
+  }
+  spdlog::error("Relay on for more than {}ms, watchdog switching it off!",
+                watchdog_.maxOn().count());
+  for (unsigned channel = 1; channel <= 4; ++channel) {
+    if ((on_ & 1 << channel) && !write(channel, false)) {
+      on_ &= ~(1 << channel);
+    }
+  }
+  if (on_) {
+    // Try again at the next expiry.
+    watchdog_.arm();
+  }
+  return true;
+}
+
 #ifdef RELAY_TEST
+#include "Config.h"
 int main(void) {
-  Relay r;
+  const Config c;
+  Relay r(c.i2cDevice.c_str(), c.i2cAddress, c.relayChannel, c.relayMaxOn);
   if (r.set(true)) {
     return 1;
   }
@@ -1,11 +1,38 @@
 #pragma once
 
-class Relay {
+#include "BlatPattern.h"
+#include "RelayWatchdog.h"
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+class Relay : public RelayChannels {
 public:
-  Relay();
-  ~Relay();
-  int set(bool enable);
+  // No relay is ever left on for longer than maxOn, even if whoever
+  // switched it on never gets round to switching it off. channel is the
+  // relay number on the board, 1-4, that set() switches.
+  Relay(const char *device, unsigned address, unsigned channel,
+        std::chrono::milliseconds maxOn);
+  int set(bool enable) { return setChannel(channel_, enable); }
+  // Any relay on the board. The watchdog runs from when the first one goes
+  // on until they are all off again.
+  int setChannel(unsigned channel, bool enable) override;
+
+  RelayWatchdogStats watchdogStats() { return watchdog_.stats(); }
 
 private:
-  int fd_;
+  int write(unsigned channel, bool enable);
+  bool forceOff();
+
+  // Closes the device on destruction. Declared before watchdog_, so that
+  // the watchdog thread is gone before the fd it writes to is closed.
+  struct Fd {
+    int fd = -1;
+    ~Fd();
+  } fd_;
+  const uint8_t channel_;
+  std::mutex lock_;
+  uint8_t on_; // Bit n for relay n.
+  RelayWatchdog watchdog_;
 };
@@ -0,0 +1,152 @@
+#include "RelayWatchdog.h"
+#include "Trace.h"
+
+#include <cstring>
+#include <poll.h>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+using std::chrono::milliseconds;
+
+RelayWatchdog::RelayWatchdog(milliseconds maxOn, std::function<bool()> expired)
+    : maxOn_(maxOn), expired_(std::move(expired)), fired_(false) {
+  timerFd_ = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (timerFd_ == -1) {
+    spdlog::error("Cannot create relay watchdog timer: {}", strerror(errno));
+    throw std::runtime_error("Cannot create relay watchdog timer.");
+  }
+  wakeFd_ = eventfd(0, EFD_CLOEXEC);
+  if (wakeFd_ == -1) {
+    spdlog::error("Cannot create relay watchdog eventfd: {}", strerror(errno));
+    close(timerFd_);
+    throw std::runtime_error("Cannot create relay watchdog eventfd.");
+  }
+
+  watchThread_ = std::thread([this] { this->watchThread(); });
+}
+
+RelayWatchdog::~RelayWatchdog() {
+  const uint64_t one = 1;
+  if (write(wakeFd_, &one, sizeof(one)) != sizeof(one)) {
+    spdlog::warn("Cannot wake relay watchdog: {}", strerror(errno));
+  }
+  watchThread_.join();
+  close(wakeFd_);
+  close(timerFd_);
+}
+
+void RelayWatchdog::arm() {
+  struct itimerspec its = {};
+  its.it_value.tv_sec = maxOn_.count() / 1000;
+  its.it_value.tv_nsec = (maxOn_.count() % 1000) * 1000000;
+
+  std::lock_guard<std::mutex> lock(lock_);
+  if (timerfd_settime(timerFd_, 0, &its, nullptr) == -1) {
+    spdlog::error("Cannot arm relay watchdog: {}", strerror(errno));
+  }
+  fired_ = false;
+}
+
+void RelayWatchdog::disarm() {
+  const struct itimerspec its = {};
+
+  std::lock_guard<std::mutex> lock(lock_);
+  if (timerfd_settime(timerFd_, 0, &its, nullptr) == -1) {
+    spdlog::error("Cannot disarm relay watchdog: {}", strerror(errno));
+  }
+  if (fired_) {
+    // The main loop finally got round to switching the relay off.
+    stats_.lastOverrun = std::chrono::duration_cast<milliseconds>(
+        std::chrono::steady_clock::now() - firedAt_);
+    if (stats_.lastOverrun > stats_.maxOverrun) {
+      stats_.maxOverrun = stats_.lastOverrun;
+    }
+    spdlog::warn("Main loop switched relay off {}ms after watchdog did.",
+                 stats_.lastOverrun.count());
+    fired_ = false;
+  }
+}
+
+bool RelayWatchdog::pending() const {
+  struct itimerspec its;
+  if (timerfd_gettime(timerFd_, &its) == -1) {
+    return false;
+  }
+  return its.it_value.tv_sec != 0 || its.it_value.tv_nsec != 0;
+}
+
+RelayWatchdogStats RelayWatchdog::stats() {
+  std::lock_guard<std::mutex> lock(lock_);
+  return stats_;
+}
+
+void RelayWatchdog::watchThread() {
+  Tracer::registerThread("relay-watchdog");
+  struct pollfd fds[2] = {{timerFd_, POLLIN, 0}, {wakeFd_, POLLIN, 0}};
+
+  while (1) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      spdlog::error("Relay watchdog poll() failed: {}", strerror(errno));
+      return;
+    }
+
+    if (fds[1].revents) {
+      return;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      uint64_t expirations;
+      if (read(timerFd_, &expirations, sizeof(expirations)) !=
+          sizeof(expirations)) {
+        continue; // Disarmed or re-armed under our feet.
+      }
+      const auto now = std::chrono::steady_clock::now();
+      if (expired_()) {
+        std::lock_guard<std::mutex> lock(lock_);
+        stats_.interventions++;
+        fired_ = true;
+        firedAt_ = now;
+      }
+    }
+  }
+}
+
+#ifdef RELAY_WATCHDOG_TEST
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+int main(void) {
+  std::atomic<int> fired{0};
+  RelayWatchdog wd(milliseconds(50), [&fired] {
+    fired++;
+    return true;
+  });
+
+  // Disarmed in time: nothing happens.
+  wd.arm();
+  assert(wd.pending());
+  usleep(20000);
+  wd.disarm();
+  assert(!wd.pending());
+  usleep(100000);
+  assert(fired == 0);
+
+  // Main loop "stalls": watchdog steps in, overrun recorded on disarm.
+  wd.arm();
+  usleep(150000);
+  assert(fired == 1);
+  assert(!wd.pending());
+  wd.disarm();
+  auto st = wd.stats();
+  assert(st.interventions == 1);
+  assert(st.lastOverrun >= milliseconds(90));
+  printf("Watchdog OK, overrun %lldms.\n", (long long)st.lastOverrun.count());
+  return 0;
+}
+#endif
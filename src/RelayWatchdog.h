@@ -0,0 +1,45 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+struct RelayWatchdogStats {
+  unsigned interventions = 0; // Times the watchdog had to switch the relay off.
+  std::chrono::milliseconds lastOverrun{0}; // How late the main loop was.
+  std::chrono::milliseconds maxOverrun{0};
+};
+
+// Last line of defence for the relay. Arm it when the relay is energised;
+// if it is not disarmed within maxOn, the expired callback is invoked from
+// the watchdog's own thread, whatever the dispatch thread is doing. The
+// callback returns true if it actually had to intervene.
+class RelayWatchdog {
+public:
+  RelayWatchdog(std::chrono::milliseconds maxOn,
+                std::function<bool()> expired);
+  ~RelayWatchdog();
+
+  void arm();
+  void disarm();
+  bool pending() const; // Armed and not yet expired.
+
+  std::chrono::milliseconds maxOn() const { return maxOn_; }
+  RelayWatchdogStats stats();
+
+private:
+  void watchThread();
+
+  const std::chrono::milliseconds maxOn_;
+  std::function<bool()> expired_;
+
+  int timerFd_;
+  int wakeFd_;
+  std::thread watchThread_;
+
+  std::mutex lock_;
+  bool fired_;
+  std::chrono::steady_clock::time_point firedAt_;
+  RelayWatchdogStats stats_;
+};
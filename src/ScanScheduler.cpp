@@ -0,0 +1,95 @@
+#include "ScanScheduler.h"
+
+#include <iterator>
+
+using std::chrono::microseconds;
+
+ScanScheduler::ScanScheduler(bool needScanResponses) {
+  const uint8_t type = needScanResponses ? 0x01 : 0x00;
+
+  // Continuous scanning: the clock is running on a motion event and every
+  // advertising interval we miss is added straight to the decision latency.
+  profiles_[static_cast<size_t>(ScanSituation::DECISION_PENDING)] = {
+      "decision", type, 0x0010, 0x0010}; // 10ms / 10ms, 100%.
+
+  // Relay is on; we still want to abort quickly but can afford to miss the
+  // odd advertisement.
+  profiles_[static_cast<size_t>(ScanSituation::RUNNING_WATCH)] = {
+      "watch", type, 0x0030, 0x0018}; // 30ms / 15ms, 50%.
+
+  // Pre-warming: a sighting only counts against motion for one scan
+  // timeout, so listen often enough that Nazbert, if about, has been heard
+  // within the last few advertising intervals.
+  profiles_[static_cast<size_t>(ScanSituation::IDLE)] = {
+      "idle", type, 0x0140, 0x0050}; // 200ms / 50ms, 25%.
+}
+
+void ScanScheduler::record(ScanSituation s, microseconds elapsed,
+                           microseconds cpu, uint64_t packets,
+                           std::optional<microseconds> firstSighting) {
+  const auto &profile = profileFor(s);
+  std::lock_guard<std::mutex> lock(lock_);
+  auto &st = stats_[static_cast<size_t>(s)];
+
+  st.scans++;
+  st.packets += packets;
+  st.scanTime += elapsed;
+  st.radioTime += microseconds(
+      static_cast<int64_t>(elapsed.count() * profile.dutyCycle()));
+  st.cpuTime += cpu;
+
+  if (firstSighting) {
+    if (!st.sightings || *firstSighting < st.firstSightingMin) {
+      st.firstSightingMin = *firstSighting;
+    }
+    if (*firstSighting > st.firstSightingMax) {
+      st.firstSightingMax = *firstSighting;
+    }
+    st.firstSightingTotal += *firstSighting;
+    st.sightings++;
+  }
+}
+
+ScanProfileStats ScanScheduler::stats(ScanSituation s) const {
+  std::lock_guard<std::mutex> lock(lock_);
+  return stats_[static_cast<size_t>(s)];
+}
+
+void ScanScheduler::publish(StatusBuffer &buf) const {
+  auto out = std::back_inserter(buf);
+  for (size_t i = 0; i < kScanSituations; ++i) {
+    const auto s = static_cast<ScanSituation>(i);
+    const auto &profile = profileFor(s);
+    const auto st = stats(s);
+    const double meanFirstMs =
+        st.sightings ? st.firstSightingTotal.count() / 1000.0 / st.sightings
+                     : 0.0;
+
+    fmt::format_to(out,
+                   "Scan {} ({}, {}, {:.1f}ms/{:.1f}ms): scans {}, "
+                   "sightings {}, packets {}\n",
+                   situationName(s), profile.name,
+                   profile.type ? "active" : "passive", profile.window * 0.625,
+                   profile.interval * 0.625, st.scans, st.sightings,
+                   st.packets);
+    fmt::format_to(out,
+                   "  first sighting ms: min {:.1f} mean {:.1f} max {:.1f}; "
+                   "scan {:.1f}s radio {:.1f}s cpu {:.3f}s\n",
+                   st.firstSightingMin.count() / 1000.0, meanFirstMs,
+                   st.firstSightingMax.count() / 1000.0,
+                   st.scanTime.count() / 1e6, st.radioTime.count() / 1e6,
+                   st.cpuTime.count() / 1e6);
+  }
+}
+
+const char *ScanScheduler::situationName(ScanSituation s) {
+  switch (s) {
+    case ScanSituation::DECISION_PENDING:
+      return "DECISION_PENDING";
+    case ScanSituation::RUNNING_WATCH:
+      return "RUNNING_WATCH";
+    case ScanSituation::IDLE:
+      return "IDLE";
+  }
+  return "Impossible!";
+}
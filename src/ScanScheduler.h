@@ -0,0 +1,77 @@
+#pragma once
+
+#include "StatusBuffer.h"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+
+// Why are we scanning? The answer decides how hard we hit the radio.
+enum class ScanSituation {
+  DECISION_PENDING, // Motion seen, must decide run/no-run before timeout.
+  RUNNING_WATCH,    // Relay is on, watching for Nazbert to abort.
+  IDLE,             // ARMED, pre-warming ahead of likely motion.
+};
+
+static constexpr size_t kScanSituations = 3;
+
+// Blessed device sightings weaker than this (dBm) are ignored: the device is
+// about, but not close enough to matter.
+static constexpr int kDefaultRssiThreshold = -70;
+
+// Parameters for hci_le_set_scan_parameters(). Interval and window are in
+// controller units of 0.625ms.
+struct ScanProfile {
+  const char *name;
+  uint8_t type; // 0 = passive, 1 = active (sends scan requests).
+  uint16_t interval;
+  uint16_t window;
+
+  double dutyCycle() const { return double(window) / double(interval); }
+};
+
+struct ScanProfileStats {
+  unsigned scans = 0;     // Scan segments run with this profile.
+  unsigned sightings = 0; // Segments in which a blessed device was seen.
+  uint64_t packets = 0;   // Advertising reports parsed.
+  std::chrono::microseconds scanTime{0};  // Wall time spent scanning.
+  std::chrono::microseconds radioTime{0}; // scanTime scaled by duty cycle.
+  std::chrono::microseconds cpuTime{0};   // Scan thread CPU time.
+  std::chrono::microseconds firstSightingTotal{0};
+  std::chrono::microseconds firstSightingMin{0};
+  std::chrono::microseconds firstSightingMax{0};
+};
+
+// Picks scan parameters for a situation and keeps score of what each choice
+// cost versus how quickly it found a blessed device.
+class ScanScheduler {
+public:
+  // Nobody currently needs scan response data (address and RSSI come in the
+  // advertising report itself), so scanning is passive unless asked.
+  explicit ScanScheduler(bool needScanResponses = false);
+
+  ScanProfile const &profileFor(ScanSituation s) const {
+    return profiles_[static_cast<size_t>(s)];
+  }
+
+  // Called by the scan thread at the end of each scan segment.
+  // firstSighting is measured from the start of the segment.
+  void record(ScanSituation s, std::chrono::microseconds elapsed,
+              std::chrono::microseconds cpu, uint64_t packets,
+              std::optional<std::chrono::microseconds> firstSighting);
+
+  ScanProfileStats stats(ScanSituation s) const;
+
+  // Append a human readable summary, for the status file.
+  void publish(StatusBuffer &buf) const;
+
+  static const char *situationName(ScanSituation s);
+
+private:
+  std::array<ScanProfile, kScanSituations> profiles_;
+
+  mutable std::mutex lock_;
+  std::array<ScanProfileStats, kScanSituations> stats_;
+};
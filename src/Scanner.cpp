@@ -1,46 +1,85 @@
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
 #include <bluetooth/hci_lib.h>
+#include <linux/sock_diag.h>
 #include <spdlog/spdlog.h>
+#include <sys/eventfd.h>
 #include <sys/select.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cstring>
 
 #include "Scanner.h"
+#include "SelfProfiler.h"
+#include "Trace.h"
 
-Scanner::Scanner(std::vector<std::string> const &blessedDevices,
+Scanner::Scanner(ConfigWatcher &config, FlightRecorder *recorder,
                  unsigned timeoutSeconds)
-    : timeoutSeconds_(timeoutSeconds), terminating_(false) {
-
-  for (const auto &addressStr : blessedDevices) {
-    bdaddr_t addr;
-
-    if (str2ba(addressStr.c_str(), &addr)) {
-      spdlog::error("Invalid bluetooth device address {}", addressStr);
-      throw std::runtime_error("Invalid bluetooth device address.");
-    }
-
-    blessedDevices_.push_back(addr);
-
-    spdlog::debug("Registered blessed device {}", addressStr);
-  }
+    : config_(config.reader()), timeoutSeconds_(timeoutSeconds),
+      recorder_(recorder), rcvbuf_(0), lastDrops_(0),
+      situation_(ScanSituation::DECISION_PENDING), eq_(nullptr),
+      scanRequested_(false), scanning_(false), shutdown_(false),
+      terminating_(false) {
+  static_assert(sizeof(BdAddr) == sizeof(bdaddr_t));
+  static_assert(FlightRecorder::kMaxPacket == HCI_MAX_EVENT_SIZE);
 
   // Get the default HCI device. If we had more than one,
   // this would have to be more clever.
-  int dev_id = hci_get_route(NULL);
-  hcidev_ = hci_open_dev(dev_id);
+  adapter_ = hci_get_route(NULL);
+  hcidev_ = hci_open_dev(adapter_);
   if (hcidev_ < 0) {
     spdlog::warn("Cannot open default HCI device: {}", strerror(errno));
     throw std::runtime_error("Scanner initialization failed.");
   }
+  wakeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wakeFd_ < 0) {
+    spdlog::warn("Cannot create scanner eventfd: {}", strerror(errno));
+    hci_close_dev(hcidev_);
+    throw std::runtime_error("Scanner initialization failed.");
+  }
+
+  // The default receive buffer holds a few hundred advertising reports,
+  // which a crowded room fills in well under a second if we fall behind.
+  // FORCE gets past rmem_max when we have CAP_NET_ADMIN, as we do for raw
+  // HCI anyway.
+  static constexpr int kRcvBuf = 1 << 20;
+  if (setsockopt(hcidev_, SOL_SOCKET, SO_RCVBUFFORCE, &kRcvBuf,
+                 sizeof(kRcvBuf)) < 0 &&
+      setsockopt(hcidev_, SOL_SOCKET, SO_RCVBUF, &kRcvBuf, sizeof(kRcvBuf)) <
+          0) {
+    spdlog::warn("Cannot size HCI receive buffer: {}", strerror(errno));
+  }
+  int rcvbuf = 0;
+  socklen_t len = sizeof(rcvbuf);
+  if (getsockopt(hcidev_, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len) == 0) {
+    rcvbuf_ = rcvbuf;
+    spdlog::debug("HCI receive buffer is {} bytes.", rcvbuf);
+  }
+
+  scanThread_ = std::thread([this] { this->scanThread(); });
 }
 
 Scanner::~Scanner() {
   stopScanning();
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    shutdown_ = true;
+  }
+  cv_.notify_all();
+  scanThread_.join();
   if (hcidev_ >= 0) {
     hci_close_dev(hcidev_);
   }
+  close(wakeFd_);
+}
+
+void Scanner::wake() {
+  const uint64_t one = 1;
+  if (write(wakeFd_, &one, sizeof(one)) != sizeof(one)) {
+    spdlog::warn("Cannot wake scan thread: {}", strerror(errno));
+  }
 }
 
 void Scanner::disableScanning() {
@@ -53,52 +92,134 @@ void Scanner::disableScanning() {
   }
 }
 
-void Scanner::scanThread(EventQueue &eq) {
-  const int timeoutMs =
-      timeoutSeconds_ * 1000; // milliseconds.
-                              // FIXME: what does this timeout even control??
+static std::chrono::nanoseconds threadCpuTime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+}
 
-  // If we crashed or something and scanning is left enabled, nothing
-  // works until we disable it. So just unconditionally force it off
-  // here. Ignore any errors
-  disableScanning();
+static PerfLoop gParseLoop("hci.parse");
+
+int Scanner::enableScanning(ScanProfile const &profile) {
+  // The "to" argument of the hci_le_* calls is how long hci_send_req() waits
+  // for the controller to acknowledge the command, not a scan duration.
+  const int hciTimeoutMs = timeoutSeconds_ * 1000;
 
-  // Now we can enable scanning.
   int rc = hci_le_set_scan_parameters(
       /*dev_id=*/hcidev_,
-      /*scan_type=*/0x01,         // ?? passive is 0, so I assume 1 is active?
-      /*interval=*/htobs(0x0010), // ?? ripped from hcitool.
-      /*window=*/htobs(0x0010),   // ?? ripped from hcitool.
+      /*scan_type=*/profile.type,
+      /*interval=*/htobs(profile.interval),
+      /*window=*/htobs(profile.window),
       /*own_type=*/LE_PUBLIC_ADDRESS, // LE_RANDOM_ADDRESS is alternative.
       /*filter=*/0x00,                // ?? 1 is "Whitelist"
-      /*to=*//*timeoutMs*/ 0);
+      /*to=*/hciTimeoutMs);
   if (rc < 0) {
     spdlog::warn("hci_le_set_scan_parameters failed: {}", strerror(errno));
-    return;
+    return rc;
   }
   rc = hci_le_set_scan_enable(
       /*dev_id=*/hcidev_,
       /*enable=*/1,
       /*filter_duplicates=*/0,
-      /*to=*/timeoutMs);
+      /*to=*/hciTimeoutMs);
   if (rc < 0) {
     spdlog::warn("hci_le_set_scan_enable(1) failed: {}", strerror(errno));
-    return;
+    return rc;
   }
+  return 0;
+}
 
-  spdlog::info("Scanning for BLE devices...");
+void Scanner::scanThread() {
+  Tracer::registerThread("scanner");
+  std::unique_lock<std::mutex> lock(lock_);
 
-  rc = checkAdvertisingDevices(eq);
+  while (1) {
+    cv_.wait(lock, [this] { return shutdown_ || scanRequested_; });
+    if (shutdown_) {
+      break;
+    }
+    scanRequested_ = false;
+    scanning_ = true;
+    EventQueue *eq = eq_;
+    const auto requested = requested_;
 
-  spdlog::info("Done scanning for BLE devices.");
+    lock.unlock();
+    scan(*eq, requested);
+    lock.lock();
+
+    scanning_ = false;
+    cv_.notify_all();
+  }
+}
 
+void Scanner::scan(EventQueue &eq, Clock::time_point requested) {
+  // If we crashed or something and scanning is left enabled, nothing
+  // works until we disable it. So just unconditionally force it off
+  // here. Ignore any errors
   disableScanning();
+
+  // The first segment is timed from the request so that thread wakeup and
+  // HCI setup count against time-to-first-sighting; they are part of the
+  // decision latency.
+  ScanSegment segment;
+  segment.start = requested;
+  segment.cpuStart = threadCpuTime();
+
+  while (!terminating_) {
+    const ScanSituation situation = situation_;
+    const ScanProfile &profile = scheduler_.profileFor(situation);
+
+    if (enableScanning(profile) < 0) {
+      return;
+    }
+
+    // blatlog times a scan from its first untagged segment, so pre-warming
+    // while ARMED, which can go on for hours, must not look like one.
+    spdlog::info("{} for BLE devices ({}, {:.1f}% duty)...",
+                 situation == ScanSituation::IDLE ? "Pre-warm scanning"
+                                                  : "Scanning",
+                 profile.name, profile.dutyCycle() * 100);
+
+    int rc = checkAdvertisingDevices(eq, segment);
+
+    disableScanning();
+
+    const auto now = Clock::now();
+    std::optional<std::chrono::microseconds> firstSighting;
+    if (segment.firstSighting) {
+      firstSighting = std::chrono::duration_cast<std::chrono::microseconds>(
+          *segment.firstSighting - segment.start);
+    }
+    scheduler_.record(
+        situation,
+        std::chrono::duration_cast<std::chrono::microseconds>(now -
+                                                              segment.start),
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            threadCpuTime() - segment.cpuStart),
+        segment.packets, firstSighting);
+
+    if (segment.drops && !segment.firstSighting) {
+      rx_.riskyScans.fetch_add(1, std::memory_order_relaxed);
+      spdlog::warn("{} HCI packets dropped during a {} scan that saw no "
+                   "blessed device; it may have been missed.",
+                   segment.drops, profile.name);
+    }
+
+    if (rc < 0) {
+      break;
+    }
+
+    segment = ScanSegment();
+    segment.start = now;
+    segment.cpuStart = threadCpuTime();
+  }
+
+  spdlog::info("Done scanning for BLE devices.");
 }
 
-int Scanner::checkAdvertisingDevices(EventQueue &eq) {
-  static constexpr Event ndEvent{.type = Event::Type::NAZBERT_DETECTED};
+int Scanner::checkAdvertisingDevices(EventQueue &eq, ScanSegment &segment) {
   struct hci_filter originalFilter, newFilter;
-  socklen_t originalFilterLen;
+  socklen_t originalFilterLen = sizeof(originalFilter);
   int rc;
 
   if (getsockopt(hcidev_, SOL_HCI, HCI_FILTER, &originalFilter,
@@ -117,141 +238,108 @@ int Scanner::checkAdvertisingDevices(EventQueue &eq) {
     return -1;
   }
 
-  struct timeval timeout;
-  timeout.tv_sec = 1; // ghetto timeout to wake and poll terminating flag.
-  timeout.tv_usec = 0;
-  fd_set readFds;
-  FD_ZERO(&readFds);
-  FD_SET(hcidev_, &readFds);
+  // Packets are drained kBatch at a time with recvmmsg() until the socket
+  // is empty, so a burst costs a few syscalls rather than a select() and a
+  // read() per packet.
+  static constexpr unsigned kBatch = 16;
+  uint8_t buffers[kBatch][HCI_MAX_EVENT_SIZE];
+  struct iovec iovs[kBatch];
+  struct mmsghdr msgs[kBatch];
+  for (unsigned i = 0; i < kBatch; ++i) {
+    iovs[i] = {buffers[i], sizeof(buffers[i])};
+  }
 
-  while ((rc = select(hcidev_ + 1, &readFds, nullptr, nullptr, &timeout)) >=
-         0) {
-    uint8_t buffer[HCI_MAX_EVENT_SIZE];
-    ssize_t len, needed = 0;
-
-    if (terminating_) {
-      break;
-    }
+  const ScanSituation situation = situation_;
 
+  while (1) {
+    // Nothing from the config snapshot is held across this point, so it is
+    // where a new one gets picked up.
+    config_.refresh();
+
+    // select() overwrites both on return, so set them up every time round.
+    // The timeout only keeps config refreshes coming in a quiet room;
+    // stopping and re-tuning come through wakeFd_.
+    struct timeval timeout;
     timeout.tv_sec = 1;
     timeout.tv_usec = 0;
-
-    if (!rc) {
-      continue;
+    fd_set readFds;
+    FD_ZERO(&readFds);
+    FD_SET(hcidev_, &readFds);
+    FD_SET(wakeFd_, &readFds);
+    {
+      TRACE_SPAN("scan.select");
+      rc = select(std::max(hcidev_, wakeFd_) + 1, &readFds, nullptr, nullptr,
+                  &timeout);
     }
-
-    len = read(hcidev_, buffer, sizeof(buffer));
-
-    if (len < 0) {
-      if (errno == EINTR || errno == EAGAIN) {
+    if (rc < 0) {
+      if (errno == EINTR) {
         continue;
       }
-
-      spdlog::warn("read() from HCI device failed: {}", strerror(errno));
-      // Might as well keep trying I guess?
-      continue;
-    }
-
-    // Parsing code optimized for sanity checking and readability.
-    // It would be more efficient to make sure that we had enough data
-    // for a type + hci_event_hdr + evt_le_meta_event + le_advertising_info
-    // up front.
-
-    // The first byte is a packet type. Doesn't seem to be an associated
-    // structure in bluetooth headers, which I guess is OK since it is just
-    // a byte.
-
-    needed = 1;
-    if (len < needed) {
-      spdlog::warn("Read short packet from HCI device: got {}, needed {} for "
-                   "packet type",
-                   len, needed);
-      continue;
-    }
-
-    const uint8_t *type = buffer;
-    if (*type != HCI_EVENT_PKT) {
-      spdlog::info("Got non-packet type {} from HCI device.", *type);
-      continue;
-    }
-
-    needed += HCI_EVENT_HDR_SIZE;
-    if (len < needed) {
-      spdlog::warn("Read short packet from HCI device: got {}, needed {} for "
-                   "hc_event_hdr",
-                   len, needed);
-      continue;
+      break;
     }
 
-    const hci_event_hdr *event_hdr = (hci_event_hdr *)(type + 1);
-    if (event_hdr->evt != EVT_LE_META_EVENT) {
-      spdlog::info("Got non-meta event from HCI device: {}", event_hdr->evt);
-      continue;
+    if (FD_ISSET(wakeFd_, &readFds)) {
+      uint64_t wakes;
+      if (read(wakeFd_, &wakes, sizeof(wakes)) < 0) {
+        spdlog::debug("Scanner eventfd read failed: {}", strerror(errno));
+      }
     }
 
-    needed += EVT_LE_META_EVENT_SIZE;
-    if (len < needed) {
-      spdlog::warn("Read short packet{} from HCI device, got {}, needed {} for "
-                   "evt_le_meta_event.",
-                   len, needed);
-      continue;
+    if (terminating_ || situation_ != situation) {
+      break;
     }
 
-    const evt_le_meta_event *meta = (evt_le_meta_event *)(event_hdr + 1);
-    if (meta->subevent != EVT_LE_ADVERTISING_REPORT) {
-      spdlog::info("Got non-advertising report meta event {}", meta->subevent);
+    if (!FD_ISSET(hcidev_, &readFds)) {
       continue;
     }
 
-    // There is a single byte following the evt_le_meta_event which is the
-    // number of following le_advertising_info structures.
-    needed += 1;
-    if (len < needed) {
-      spdlog::warn("Read short packet{} from HCI device, got {}, needed {} for "
-                   "le_advertising_info count.",
-                   len, needed);
-      continue;
-    }
+    checkRxQueue(segment);
 
-    const uint8_t *numReports = (uint8_t *)(meta + 1);
-    const uint8_t *nextReport = (numReports + 1);
-    for (auto i = 0; i < *numReports; ++i) {
-      needed += LE_ADVERTISING_INFO_SIZE;
-      if (len < needed) {
-        spdlog::warn(
-            "Read short packet{} from HCI device, got {}, needed {} for "
-            "le_advertising_info #{} header.",
-            len, needed, i);
-        break;
+    unsigned batch = 0;
+    while (1) {
+      for (unsigned i = 0; i < kBatch; ++i) {
+        msgs[i] = {};
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
       }
-      const le_advertising_info *info = (le_advertising_info *)nextReport;
-      needed += info->length + 1; // +1 for trailing RSSI byte.
-      if (len < needed) {
-        spdlog::warn(
-            "Read short packet{} from HCI device, got {}, needed {} for "
-            "le_advertising_info #{} body with length {}.",
-            len, needed, i, info->length);
+      int n;
+      {
+        TRACE_SPAN("scan.read");
+        n = recvmmsg(hcidev_, msgs, kBatch, MSG_DONTWAIT, nullptr);
+      }
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          spdlog::warn("recvmmsg() from HCI device failed: {}",
+                       strerror(errno));
+        }
         break;
       }
-
-      const int8_t rssi = (int8_t)info->data[info->length];
-      char addr[18];
-      ba2str(&info->bdaddr, addr);
-
-      // spdlog::debug("Device {} rssi {}.", addr, (int)rssi);
-
-      for (const auto &bd : blessedDevices_) {
-        if (!bacmp(&bd, &info->bdaddr)) {
-          if (rssi > -70) { // FIXME: configurable!!
-            spdlog::info("Blessed device {} is in range with RSSI {}", addr,
-                         rssi);
-            eq.send(ndEvent);
-            break;
-          }
+      PerfScope perf(gParseLoop);
+      if (recorder_) {
+        // One timestamp per batch: they arrived together, near enough.
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        const int64_t timeUs = now.tv_sec * 1000000ll + now.tv_nsec / 1000;
+        for (int i = 0; i < n; ++i) {
+          recorder_->record(buffers[i], msgs[i].msg_len, timeUs);
         }
       }
+      for (int i = 0; i < n; ++i) {
+        handlePacket(eq, segment, buffers[i], msgs[i].msg_len);
+      }
+      batch += n;
+      if (unsigned(n) < kBatch) {
+        break; // Drained.
+      }
+    }
 
-      nextReport += LE_ADVERTISING_INFO_SIZE + info->length + 1;
+    rx_.wakeups.fetch_add(1, std::memory_order_relaxed);
+    rx_.packets.fetch_add(batch, std::memory_order_relaxed);
+    if (batch > rx_.maxBatch.load(std::memory_order_relaxed)) {
+      rx_.maxBatch.store(batch, std::memory_order_relaxed);
     }
   }
 
@@ -267,21 +355,214 @@ int Scanner::checkAdvertisingDevices(EventQueue &eq) {
   return rc;
 }
 
-int Scanner::startScanning(EventQueue &eq) {
-  if (scanThread_.joinable()) {
-    spdlog::warn("Scanner already running.");
-    return -EBUSY;
+// Samples the socket's receive queue: how much is waiting, and how much the
+// kernel has thrown away since last time because the queue was full.
+void Scanner::checkRxQueue(ScanSegment &segment) {
+  uint32_t meminfo[SK_MEMINFO_VARS];
+  socklen_t len = sizeof(meminfo);
+  if (getsockopt(hcidev_, SOL_SOCKET, SO_MEMINFO, meminfo, &len) < 0) {
+    return;
+  }
+
+  const uint32_t backlog = meminfo[SK_MEMINFO_RMEM_ALLOC];
+  if (backlog > rx_.maxBacklog.load(std::memory_order_relaxed)) {
+    rx_.maxBacklog.store(backlog, std::memory_order_relaxed);
+  }
+
+  const uint32_t drops = meminfo[SK_MEMINFO_DROPS];
+  const uint32_t dropped = drops - lastDrops_; // Wraps correctly.
+  lastDrops_ = drops;
+  if (dropped) {
+    if (!segment.drops) {
+      spdlog::warn("HCI receive queue overflowed ({} of {} bytes queued), {} "
+                   "packets dropped.",
+                   backlog, meminfo[SK_MEMINFO_RCVBUF], dropped);
+    }
+    segment.drops += dropped;
+    rx_.drops.fetch_add(dropped, std::memory_order_relaxed);
+  }
+}
+
+void Scanner::handlePacket(EventQueue &eq, ScanSegment &segment,
+                           const uint8_t *buffer, ssize_t len) {
+  segment.packets += parsePacket(*config_, adapter_, situation_, eq, buffer,
+                                 len, segment.firstSighting);
+}
+
+unsigned Scanner::parsePacket(Config const &config, int adapter,
+                              ScanSituation situation, EventQueue &eq,
+                              const uint8_t *buffer, ssize_t len,
+                              std::optional<Clock::time_point> &firstSighting) {
+  ssize_t needed = 0;
+  unsigned reports = 0;
+
+  // Parsing code optimized for sanity checking and readability.
+  // It would be more efficient to make sure that we had enough data
+  // for a type + hci_event_hdr + evt_le_meta_event + le_advertising_info
+  // up front.
+
+  // The first byte is a packet type. Doesn't seem to be an associated
+  // structure in bluetooth headers, which I guess is OK since it is just
+  // a byte.
+
+  needed = 1;
+  if (len < needed) {
+    spdlog::warn("Read short packet from HCI device: got {}, needed {} for "
+                 "packet type",
+                 len, needed);
+    return reports;
+  }
+
+  const uint8_t *type = buffer;
+  if (*type != HCI_EVENT_PKT) {
+    spdlog::info("Got non-packet type {} from HCI device.", *type);
+    return reports;
+  }
+
+  needed += HCI_EVENT_HDR_SIZE;
+  if (len < needed) {
+    spdlog::warn("Read short packet from HCI device: got {}, needed {} for "
+                 "hc_event_hdr",
+                 len, needed);
+    return reports;
   }
 
-  terminating_ = false;
-  scanThread_ = std::thread([&eq, this] { this->scanThread(eq); });
+  const hci_event_hdr *event_hdr = (hci_event_hdr *)(type + 1);
+  if (event_hdr->evt != EVT_LE_META_EVENT) {
+    spdlog::info("Got non-meta event from HCI device: {}", event_hdr->evt);
+    return reports;
+  }
+
+  needed += EVT_LE_META_EVENT_SIZE;
+  if (len < needed) {
+    spdlog::warn("Read short packet from HCI device, got {}, needed {} for "
+                 "evt_le_meta_event.",
+                 len, needed);
+    return reports;
+  }
+
+  const evt_le_meta_event *meta = (evt_le_meta_event *)(event_hdr + 1);
+  if (meta->subevent != EVT_LE_ADVERTISING_REPORT) {
+    spdlog::info("Got non-advertising report meta event {}", meta->subevent);
+    return reports;
+  }
+
+  // There is a single byte following the evt_le_meta_event which is the
+  // number of following le_advertising_info structures.
+  needed += 1;
+  if (len < needed) {
+    spdlog::warn("Read short packet from HCI device, got {}, needed {} for "
+                 "le_advertising_info count.",
+                 len, needed);
+    return reports;
+  }
+
+  const uint8_t *numReports = (uint8_t *)(meta + 1);
+  const uint8_t *nextReport = (numReports + 1);
+  for (auto i = 0; i < *numReports; ++i) {
+    needed += LE_ADVERTISING_INFO_SIZE;
+    if (len < needed) {
+      spdlog::warn(
+          "Read short packet from HCI device, got {}, needed {} for "
+          "le_advertising_info #{} header.",
+          len, needed, i);
+      break;
+    }
+    const le_advertising_info *info = (le_advertising_info *)nextReport;
+    needed += info->length + 1; // +1 for trailing RSSI byte.
+    if (len < needed) {
+      spdlog::warn(
+          "Read short packet from HCI device, got {}, needed {} for "
+          "le_advertising_info #{} body with length {}.",
+          len, needed, i, info->length);
+      break;
+    }
+
+    const int8_t rssi = (int8_t)info->data[info->length];
+    char addr[18];
+    ba2str(&info->bdaddr, addr);
+
+    // spdlog::debug("Device {} rssi {}.", addr, (int)rssi);
+
+    reports++;
+
+    for (const auto &bd : config.blessedDevices) {
+      if (!memcmp(bd.data(), &info->bdaddr, bd.size())) {
+        if (rssi > config.rssiThreshold) {
+          const auto now = Clock::now();
+          if (!firstSighting) {
+            firstSighting = now;
+          }
+          // Pre-warming sees every advertisement of a blessed device that
+          // is at home; only sightings that decide something are news.
+          spdlog::log(situation == ScanSituation::IDLE
+                          ? spdlog::level::debug
+                          : spdlog::level::info,
+                      "Blessed device {} is in range with RSSI {}", addr,
+                      rssi);
+          Event::Nazbert n;
+          memcpy(n.addr, &info->bdaddr, sizeof(n.addr));
+          n.rssi = rssi;
+          n.adapter = adapter;
+          n.whenNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         now.time_since_epoch())
+                         .count();
+          eq.send(Event::nazbertDetected(n));
+          break;
+        }
+      }
+    }
+
+    nextReport += LE_ADVERTISING_INFO_SIZE + info->length + 1;
+  }
+  return reports;
+}
+
+HciRxStats Scanner::rxStats() const {
+  HciRxStats st;
+  st.wakeups = rx_.wakeups.load(std::memory_order_relaxed);
+  st.packets = rx_.packets.load(std::memory_order_relaxed);
+  st.maxBatch = rx_.maxBatch.load(std::memory_order_relaxed);
+  st.drops = rx_.drops.load(std::memory_order_relaxed);
+  st.maxBacklog = rx_.maxBacklog.load(std::memory_order_relaxed);
+  st.riskyScans = rx_.riskyScans.load(std::memory_order_relaxed);
+  st.rcvbuf = rcvbuf_;
+  return st;
+}
+
+int Scanner::startScanning(EventQueue &eq, ScanSituation situation) {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    if (scanning_ || scanRequested_) {
+      spdlog::warn("Scanner already running.");
+      return -EBUSY;
+    }
+
+    terminating_ = false;
+    situation_ = situation;
+    eq_ = &eq;
+    requested_ = Clock::now();
+    scanRequested_ = true;
+  }
+  cv_.notify_all();
   return 0;
 }
 
+void Scanner::setSituation(ScanSituation situation) {
+  if (situation_.exchange(situation) != situation) {
+    spdlog::debug("Scan situation now {}.",
+                  ScanScheduler::situationName(situation));
+    wake();
+  }
+}
+
 int Scanner::stopScanning() {
-  if (scanThread_.joinable()) {
+  std::unique_lock<std::mutex> lock(lock_);
+  scanRequested_ = false;
+  if (scanning_) {
     terminating_ = true;
-    scanThread_.join();
+    wake();
+    cv_.wait(lock, [this] { return !scanning_; });
   }
   return 0;
 }
@@ -291,11 +572,8 @@ int Scanner::stopScanning() {
 int main(void) {
   // spdlog::set_level(spdlog::level::debug);
 
-  std::vector<std::string> blessedDevices;
-
-  blessedDevices.push_back("F1:15:32:5B:7E:66");
-
-  Scanner scanner(blessedDevices);
+  ConfigWatcher config; // Defaults, which include Nazbert's tag.
+  Scanner scanner(config);
   EventQueue eq;
 
   while (1) {
@@ -1,33 +1,120 @@
 #pragma once
 
+#include <atomic>
 #include <bluetooth/bluetooth.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <sys/types.h>
+#include <thread>
 #include <vector>
 
+#include "Config.h"
 #include "EventQueue.h"
+#include "FlightRecorder.h"
+#include "ScanScheduler.h"
+
+// Receive side of the HCI socket, across all scans.
+struct HciRxStats {
+  uint64_t wakeups = 0;    // select() returns with something to read.
+  uint64_t packets = 0;    // HCI events read.
+  unsigned maxBatch = 0;   // Most events drained in one wakeup.
+  uint64_t drops = 0;      // Thrown away by the kernel, receive queue full.
+  unsigned maxBacklog = 0; // Most bytes queued at a wakeup.
+  unsigned rcvbuf = 0;     // Receive buffer the kernel actually gave us.
+  uint64_t riskyScans = 0; // Scan segments with drops and no sighting.
+};
 
 class Scanner {
 public:
-  explicit Scanner(std::vector<std::string> const &blessedDevices,
+  // Blessed devices and the RSSI threshold come from config, and changes to
+  // them apply from the next packet. timeoutSeconds bounds how long we wait
+  // for the controller to complete each HCI command. Every HCI event read
+  // is copied into recorder, if given, which must outlive the Scanner.
+  explicit Scanner(ConfigWatcher &config, FlightRecorder *recorder = nullptr,
                    unsigned timeoutSeconds = 5);
   ~Scanner();
 
-  int startScanning(EventQueue &); // Spin up a thread to scan for blessed
-                                   // devices and post events when detected.
-  int stopScanning(); // Kill the scan thread (synchronously, it is dead when
-                      // this fn returns). either use an eventfs to wake up the
-                      // select() in scanning thread, or use ghetto 1 sec
-                      // timeout on select() and check terminating flag "trick".
+  // Ask the scan thread to scan for blessed devices and post events when
+  // detected. The situation picks the scan profile.
+  int startScanning(EventQueue &,
+                    ScanSituation situation = ScanSituation::DECISION_PENDING);
+  void setSituation(ScanSituation situation); // Re-tune a running scan, at
+                                              // once.
+  int stopScanning(); // Stop scanning (synchronously, the scan thread is idle
+                      // when this fn returns). Both wake the scan thread's
+                      // select() through wakeFd_.
+
+  ScanScheduler const &scheduler() const { return scheduler_; }
+  HciRxStats rxStats() const;
+
+  using Clock = std::chrono::steady_clock;
+
+  // Parses one HCI event as read from adapter, sending eq a sighting for
+  // each blessed device in range and noting when the first was. Returns the
+  // number of advertising reports in it. Needs no device, so that it can be
+  // run on captured packets.
+  static unsigned parsePacket(Config const &config, int adapter,
+                              ScanSituation situation, EventQueue &eq,
+                              const uint8_t *buffer, ssize_t len,
+                              std::optional<Clock::time_point> &firstSighting);
 
 private:
+
+  // Bookkeeping for one stretch of scanning with a single profile.
+  struct ScanSegment {
+    Clock::time_point start;
+    std::chrono::nanoseconds cpuStart;
+    uint64_t packets = 0;
+    uint64_t drops = 0;
+    std::optional<Clock::time_point> firstSighting;
+  };
+
+  // Written by the scan thread, read by anyone.
+  struct RxCounters {
+    std::atomic<uint64_t> wakeups{0};
+    std::atomic<uint64_t> packets{0};
+    std::atomic<unsigned> maxBatch{0};
+    std::atomic<uint64_t> drops{0};
+    std::atomic<unsigned> maxBacklog{0};
+    std::atomic<uint64_t> riskyScans{0};
+  };
+
+  int adapter_; // HCI device id.
   int hcidev_;
-  int checkAdvertisingDevices(EventQueue &);
+  int wakeFd_; // eventfd: the scan thread has something new to look at.
+  int checkAdvertisingDevices(EventQueue &, ScanSegment &);
+  void checkRxQueue(ScanSegment &);
+  void handlePacket(EventQueue &, ScanSegment &, const uint8_t *buffer,
+                    ssize_t len);
+  int enableScanning(ScanProfile const &);
   void disableScanning();
-  void scanThread(EventQueue &);
+  void scan(EventQueue &, Clock::time_point requested);
+  void scanThread();
+  void wake();
 
-  std::vector<bdaddr_t> blessedDevices_;
+  ConfigWatcher::Reader config_; // Scan thread only.
   unsigned timeoutSeconds_;
+  FlightRecorder *const recorder_;
+  unsigned rcvbuf_;
+  uint32_t lastDrops_; // Scan thread only.
+  RxCounters rx_;
+
+  ScanScheduler scheduler_;
+  std::atomic<ScanSituation> situation_;
 
+  // The scan thread lives as long as the Scanner and idles between scans,
+  // rather than being spawned for every scan.
   std::thread scanThread_;
-  bool terminating_;
+  std::mutex lock_;
+  std::condition_variable cv_;
+  EventQueue *eq_;
+  Clock::time_point requested_;
+  bool scanRequested_;
+  bool scanning_;
+  bool shutdown_;
+  std::atomic<bool> terminating_; // Current scan should stop.
 };
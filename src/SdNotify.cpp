@@ -0,0 +1,93 @@
+#include "SdNotify.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <spdlog/spdlog.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+bool sdNotify(const char *state) {
+  const char *path = getenv("NOTIFY_SOCKET");
+  if (!path || !*path) {
+    return true;
+  }
+
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  const size_t len = strlen(path);
+  if (len >= sizeof(addr.sun_path) || (path[0] != '/' && path[0] != '@')) {
+    spdlog::warn("Unusable NOTIFY_SOCKET {}.", path);
+    return false;
+  }
+  memcpy(addr.sun_path, path, len);
+  if (path[0] == '@') {
+    addr.sun_path[0] = 0; // Abstract namespace.
+  }
+
+  const int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    spdlog::warn("Cannot create notify socket: {}", strerror(errno));
+    return false;
+  }
+  const bool ok =
+      sendto(fd, state, strlen(state), MSG_NOSIGNAL,
+             reinterpret_cast<struct sockaddr *>(&addr),
+             offsetof(struct sockaddr_un, sun_path) + len) != -1;
+  if (!ok) {
+    spdlog::warn("Cannot notify systemd: {}", strerror(errno));
+  }
+  close(fd);
+  return ok;
+}
+
+std::chrono::microseconds sdWatchdogInterval() {
+  const char *usec = getenv("WATCHDOG_USEC");
+  if (!usec) {
+    return std::chrono::microseconds(0);
+  }
+  // If set, WATCHDOG_PID says which process the watchdog is meant for.
+  const char *pid = getenv("WATCHDOG_PID");
+  if (pid && atol(pid) != getpid()) {
+    return std::chrono::microseconds(0);
+  }
+  return std::chrono::microseconds(strtoull(usec, nullptr, 10));
+}
+
+#ifdef SD_NOTIFY_TEST
+#include <cassert>
+int main(void) {
+  assert(sdNotify("READY=1")); // Not under systemd: quietly does nothing.
+
+  char path[] = "/tmp/pounceblat-notify-XXXXXX";
+  assert(mkdtemp(path));
+  const std::string sock = std::string(path) + "/notify";
+  const int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, sock.c_str());
+  assert(bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) ==
+         0);
+
+  setenv("NOTIFY_SOCKET", sock.c_str(), 1);
+  assert(sdNotify("READY=1\nSTATUS=Blatting"));
+  char buf[64];
+  const ssize_t n = recv(fd, buf, sizeof(buf) - 1, 0);
+  assert(n > 0);
+  buf[n] = 0;
+  assert(!strcmp(buf, "READY=1\nSTATUS=Blatting"));
+
+  setenv("WATCHDOG_USEC", "30000000", 1);
+  assert(sdWatchdogInterval() == std::chrono::seconds(30));
+  setenv("WATCHDOG_PID", "1", 1);
+  assert(sdWatchdogInterval() == std::chrono::microseconds(0));
+
+  close(fd);
+  unlink(sock.c_str());
+  rmdir(path);
+  puts("sd_notify OK.");
+  return 0;
+}
+#endif
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <chrono>
+
+// Just enough of sd_notify(3) to be a Type=notify service, without linking
+// libsystemd. Both are no-ops when not started by systemd.
+
+// Sends state, e.g. "READY=1" or "WATCHDOG=1". Returns false on failure.
+bool sdNotify(const char *state);
+
+// How often systemd expects WATCHDOG=1, or zero if it isn't watching us.
+std::chrono::microseconds sdWatchdogInterval();
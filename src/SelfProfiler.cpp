@@ -0,0 +1,326 @@
+#include "SelfProfiler.h"
+#include "Trace.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iterator>
+#include <linux/perf_event.h>
+#include <spdlog/spdlog.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Reads a small /proc file into buf, NUL-terminated. Returns false if it
+// has gone (the thread exited).
+static bool readProcFile(const char *path, char *buf, size_t size) {
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  const ssize_t n = read(fd, buf, size - 1);
+  close(fd);
+  if (n <= 0) {
+    return false;
+  }
+  buf[n] = 0;
+  return true;
+}
+
+static uint64_t statusField(const char *status, const char *field) {
+  const char *p = strstr(status, field);
+  return p ? strtoull(p + strlen(field), nullptr, 10) : 0;
+}
+
+SelfProfiler::SelfProfiler(std::chrono::milliseconds period)
+    : period_(period), lastCount_(0), stopping_(false), rateCount_(0) {
+  lastCount_ = sample(last_);
+  lastTime_ = std::chrono::steady_clock::now();
+  thread_ = std::thread([this] { this->sampleThread(); });
+}
+
+SelfProfiler::~SelfProfiler() {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+}
+
+// Everything is read with plain open()/read() into fixed buffers and the
+// task directory with getdents64(), so sampling never allocates.
+size_t SelfProfiler::sample(std::array<Sample, kMaxThreads> &out) const {
+  const int dir = open("/proc/self/task", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir == -1) {
+    return 0;
+  }
+
+  size_t count = 0;
+  alignas(struct dirent64) char dents[4096];
+  long n;
+  while ((n = syscall(SYS_getdents64, dir, dents, sizeof(dents))) > 0) {
+    for (long off = 0; off < n;) {
+      const auto *d = reinterpret_cast<const struct dirent64 *>(dents + off);
+      off += d->d_reclen;
+      if (d->d_name[0] < '0' || d->d_name[0] > '9' || count == kMaxThreads) {
+        continue;
+      }
+
+      Sample &s = out[count];
+      s.tid = atoi(d->d_name);
+      char path[64], buf[2048];
+
+      // "<ns on cpu> <ns waiting on a run queue> <timeslices>"
+      snprintf(path, sizeof(path), "/proc/self/task/%d/schedstat", s.tid);
+      if (!readProcFile(path, buf, sizeof(buf)) ||
+          sscanf(buf, "%llu %llu %llu",
+                 reinterpret_cast<unsigned long long *>(&s.cpuNs),
+                 reinterpret_cast<unsigned long long *>(&s.waitNs),
+                 reinterpret_cast<unsigned long long *>(&s.slices)) != 3) {
+        continue;
+      }
+      snprintf(path, sizeof(path), "/proc/self/task/%d/status", s.tid);
+      if (!readProcFile(path, buf, sizeof(buf))) {
+        continue;
+      }
+      s.voluntary = statusField(buf, "\nvoluntary_ctxt_switches:");
+      s.involuntary = statusField(buf, "\nnonvoluntary_ctxt_switches:");
+      count++;
+    }
+  }
+  close(dir);
+  return count;
+}
+
+void SelfProfiler::sampleThread() {
+  Tracer::registerThread("profiler");
+  std::array<Sample, kMaxThreads> now;
+  std::array<ThreadRates, kMaxThreads> rates;
+  std::unique_lock<std::mutex> lock(lock_);
+
+  while (!cv_.wait_for(lock, period_, [this] { return stopping_; })) {
+    lock.unlock();
+
+    const size_t count = sample(now);
+    const auto t = std::chrono::steady_clock::now();
+    const double secs = std::chrono::duration<double>(t - lastTime_).count();
+    size_t rateCount = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+      const Sample &s = now[i];
+      Sample prev;
+      for (size_t j = 0; j < lastCount_; ++j) {
+        if (last_[j].tid == s.tid) {
+          prev = last_[j];
+          break;
+        }
+      }
+      ThreadRates &r = rates[rateCount++];
+      r.tid = s.tid;
+      const char *traced = Tracer::threadName(s.tid);
+      char path[64];
+      snprintf(path, sizeof(path), "/proc/self/task/%d/comm", s.tid);
+      if (traced) {
+        snprintf(r.name, sizeof(r.name), "%s", traced);
+      } else if (readProcFile(path, r.name, sizeof(r.name))) {
+        r.name[strcspn(r.name, "\n")] = 0;
+      } else {
+        r.name[0] = 0;
+      }
+      r.cpuPct = (s.cpuNs - prev.cpuNs) / 1e9 / secs * 100;
+      r.wakeupsPerSec = (s.voluntary - prev.voluntary) / secs;
+      r.preemptsPerSec = (s.involuntary - prev.involuntary) / secs;
+      const uint64_t slices = s.slices - prev.slices;
+      r.runDelayUs = slices ? (s.waitNs - prev.waitNs) / 1e3 / slices : 0;
+    }
+
+    last_ = now;
+    lastCount_ = count;
+    lastTime_ = t;
+
+    lock.lock();
+    rates_ = rates;
+    rateCount_ = rateCount;
+  }
+}
+
+void SelfProfiler::publish(StatusBuffer &buf) const {
+  auto out = std::back_inserter(buf);
+  std::lock_guard<std::mutex> lock(lock_);
+  if (!rateCount_) {
+    return;
+  }
+  fmt::format_to(out, "Threads, last {}s: tid name cpu% wakeups/s "
+                      "preempts/s runq-delay-us\n",
+                 period_.count() / 1000.0);
+  for (size_t i = 0; i < rateCount_; ++i) {
+    const auto &r = rates_[i];
+    fmt::format_to(out, "  {} {} {:.2f} {:.1f} {:.1f} {:.1f}\n", r.tid, r.name,
+                   r.cpuPct, r.wakeupsPerSec, r.preemptsPerSec, r.runDelayUs);
+  }
+  PerfLoop::publish(buf);
+}
+
+std::atomic<bool> PerfLoop::enabled_{false};
+
+namespace {
+
+constexpr size_t kMaxLoops = 8;
+std::array<PerfLoop *, kMaxLoops> gLoops;
+size_t gLoopCount = 0; // Only grows during static initialisation.
+
+// Per-thread counter group, cycles leading instructions. -2 until the
+// thread first asks, -1 if the PMU is not available to us.
+thread_local int tPerfFd = -2;
+
+int openCounter(uint64_t config, int group) {
+  struct perf_event_attr attr = {};
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  attr.exclude_kernel = 1; // Allowed at perf_event_paranoid 2.
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0 /* this thread */,
+                 -1 /* any cpu */, group, PERF_FLAG_FD_CLOEXEC);
+}
+
+int threadPerfFd() {
+  if (tPerfFd != -2) {
+    return tPerfFd;
+  }
+  const int cycles = openCounter(PERF_COUNT_HW_CPU_CYCLES, -1);
+  const int instructions =
+      cycles == -1 ? -1 : openCounter(PERF_COUNT_HW_INSTRUCTIONS, cycles);
+  if (instructions == -1) {
+    static std::atomic<bool> warned{false};
+    if (!warned.exchange(true)) {
+      spdlog::warn("perf_event_open() failed, no cycle counts: {}",
+                   strerror(errno));
+    }
+    if (cycles != -1) {
+      close(cycles);
+    }
+    tPerfFd = -1;
+    return -1;
+  }
+  // The instructions fd stays open for as long as the thread; it is read
+  // through the group leader.
+  tPerfFd = cycles;
+  return cycles;
+}
+
+bool readGroup(int fd, uint64_t &cycles, uint64_t &instructions) {
+  uint64_t values[3]; // nr, cycles, instructions.
+  if (read(fd, values, sizeof(values)) != sizeof(values)) {
+    return false;
+  }
+  cycles = values[1];
+  instructions = values[2];
+  return true;
+}
+
+} // namespace
+
+PerfLoop::PerfLoop(const char *name) : name_(name) {
+  if (gLoopCount < kMaxLoops) {
+    gLoops[gLoopCount++] = this;
+  }
+}
+
+void PerfLoop::enable() {
+  enabled_.store(true, std::memory_order_relaxed);
+  spdlog::info("Perf counters enabled.");
+}
+
+void PerfLoop::publish(StatusBuffer &buf) {
+  if (!enabled()) {
+    return;
+  }
+  auto out = std::back_inserter(buf);
+  for (size_t i = 0; i < gLoopCount; ++i) {
+    const PerfLoop &l = *gLoops[i];
+    const uint64_t passes = l.passes_.load(std::memory_order_relaxed);
+    const uint64_t cycles = l.cycles_.load(std::memory_order_relaxed);
+    const uint64_t instructions =
+        l.instructions_.load(std::memory_order_relaxed);
+    fmt::format_to(out,
+                   "Perf {}: passes {} cycles/pass {:.0f} "
+                   "instructions/pass {:.0f} IPC {:.2f}\n",
+                   l.name_, passes, passes ? double(cycles) / passes : 0.0,
+                   passes ? double(instructions) / passes : 0.0,
+                   cycles ? double(instructions) / cycles : 0.0);
+  }
+}
+
+PerfScope::PerfScope(PerfLoop &loop)
+    : loop_(loop), fd_(PerfLoop::enabled() ? threadPerfFd() : -1) {
+  if (fd_ != -1 && !readGroup(fd_, cycles_, instructions_)) {
+    fd_ = -1;
+  }
+}
+
+PerfScope::~PerfScope() {
+  uint64_t cycles, instructions;
+  if (fd_ == -1 || !readGroup(fd_, cycles, instructions)) {
+    return;
+  }
+  loop_.passes_.fetch_add(1, std::memory_order_relaxed);
+  loop_.cycles_.fetch_add(cycles - cycles_, std::memory_order_relaxed);
+  loop_.instructions_.fetch_add(instructions - instructions_,
+                                std::memory_order_relaxed);
+}
+
+#ifdef SELF_PROFILER_TEST
+#include <cassert>
+#include <string>
+
+static PerfLoop gTestLoop("test");
+
+int main(void) {
+  std::atomic<bool> done{false};
+
+  std::thread busy([&done] {
+    Tracer::registerThread("busy");
+    volatile uint64_t x = 0;
+    while (!done) {
+      PerfScope scope(gTestLoop);
+      for (int i = 0; i < 1000; ++i) {
+        x = x + i;
+      }
+    }
+  });
+  std::thread sleeper([&done] {
+    Tracer::registerThread("sleeper");
+    while (!done) {
+      usleep(10000);
+    }
+  });
+
+  PerfLoop::enable();
+  SelfProfiler profiler(std::chrono::milliseconds(1000));
+  sleep(2);
+
+  StatusBuffer buf;
+  profiler.publish(buf);
+  done = true;
+  busy.join();
+  sleeper.join();
+  printf("%.*s", int(buf.size()), buf.data());
+
+  const std::string text(buf.data(), buf.size());
+  assert(text.find(" busy ") != std::string::npos);
+  assert(text.find(" sleeper ") != std::string::npos);
+  // The sleeper wakes ~100 times a second.
+  const size_t line = text.find(" sleeper ");
+  double cpu, wakeups;
+  assert(sscanf(text.c_str() + line, " sleeper %lf %lf", &cpu, &wakeups) ==
+         2);
+  assert(wakeups > 50 && wakeups < 150);
+  puts("Self profiler OK.");
+  return 0;
+}
+#endif
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "StatusBuffer.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <sys/types.h>
+#include <thread>
+
+// Per-thread CPU time, wakeups, preemptions and run-queue delay for every
+// thread in the process, sampled from /proc/self/task every period and
+// published as rates over the last period.
+class SelfProfiler {
+public:
+  explicit SelfProfiler(
+      std::chrono::milliseconds period = std::chrono::seconds(10));
+  ~SelfProfiler();
+
+  SelfProfiler(SelfProfiler const &) = delete;
+  SelfProfiler &operator=(SelfProfiler const &) = delete;
+
+  // Append a table of per-thread rates and any PerfLoop counters, for the
+  // status file.
+  void publish(StatusBuffer &buf) const;
+
+  static constexpr size_t kMaxThreads = 32;
+
+  struct ThreadRates {
+    pid_t tid;
+    char name[16];
+    double cpuPct;         // Of one core.
+    double wakeupsPerSec;  // Voluntary context switches.
+    double preemptsPerSec; // Involuntary context switches.
+    double runDelayUs;     // Mean wait on the run queue per timeslice.
+  };
+
+private:
+  struct Sample {
+    pid_t tid = 0;
+    uint64_t cpuNs = 0;
+    uint64_t waitNs = 0;
+    uint64_t slices = 0;
+    uint64_t voluntary = 0;
+    uint64_t involuntary = 0;
+  };
+
+  void sampleThread();
+  size_t sample(std::array<Sample, kMaxThreads> &out) const;
+
+  const std::chrono::milliseconds period_;
+  std::array<Sample, kMaxThreads> last_;
+  size_t lastCount_;
+  std::chrono::steady_clock::time_point lastTime_;
+
+  mutable std::mutex lock_;
+  std::condition_variable cv_;
+  bool stopping_;
+  std::array<ThreadRates, kMaxThreads> rates_;
+  size_t rateCount_;
+  std::thread thread_;
+};
+
+// Hardware cycle and instruction counts for one named loop body, read with
+// perf_event_open(2) around each pass. Off (and free apart from a relaxed
+// load) unless enabled; each thread opens its own counters on first use.
+class PerfLoop {
+public:
+  explicit PerfLoop(const char *name); // Static storage duration only.
+
+  static void enable();
+  static bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+  static void publish(StatusBuffer &buf);
+
+private:
+  friend class PerfScope;
+  static std::atomic<bool> enabled_;
+
+  const char *name_;
+  std::atomic<uint64_t> passes_{0};
+  std::atomic<uint64_t> cycles_{0};
+  std::atomic<uint64_t> instructions_{0};
+};
+
+class PerfScope {
+public:
+  explicit PerfScope(PerfLoop &loop);
+  ~PerfScope();
+
+  PerfScope(PerfScope const &) = delete;
+  PerfScope &operator=(PerfScope const &) = delete;
+
+private:
+  PerfLoop &loop_;
+  int fd_; // -1 when not counting.
+  uint64_t cycles_;
+  uint64_t instructions_;
+};
@@ -1,9 +1,10 @@
 #include "Sensor.h"
+#include "Trace.h"
 
-Sensor::Sensor() : chip_("gpiochip0") {
+Sensor::Sensor(std::string const &chip, unsigned line) : chip_(chip) {
   terminating_ = false;
 
-  line_ = chip_.get_line(4);
+  line_ = chip_.get_line(line);
 
   ::gpiod::line_request req;
   req.consumer = "nazbert";
@@ -25,14 +26,21 @@ void Sensor::monitor(EventQueue &eq) {
     throw std::runtime_error("monitor can only be called once.");
   }
   monitorThread_ = std::thread([&eq, this]() {
-    static constexpr Event mdEvent{.type = Event::Type::MOTION_DETECTED};
+    Tracer::registerThread("sensor");
     while (!this->terminating_) {
-
-      if (this->line_.event_wait(::std::chrono::seconds(1))) {
+      bool ready;
+      {
+        TRACE_SPAN("sensor.event_wait");
+        ready = this->line_.event_wait(::std::chrono::seconds(1));
+      }
+      if (ready) {
+        TraceFlow flow(Tracer::newFlow()); // Follows the edge to the relay.
+        TRACE_SPAN("sensor.edge");
         auto e = this->line_.event_read();
         switch (e.event_type) {
           case ::gpiod::line_event::RISING_EDGE:
-            eq.send(mdEvent);
+            eq.send(Event::motionDetected(
+                {this->line_.offset(), 1, int64_t(e.timestamp.count())}));
             break;
           default:
             spdlog::error("Unexpected GPIO event {} received.",
@@ -46,10 +54,12 @@ void Sensor::monitor(EventQueue &eq) {
 }
 
 #ifdef SENSOR_TEST
+#include "Config.h"
 #include <iostream>
 int main(void) {
   EventQueue eq;
-  Sensor s;
+  const Config c;
+  Sensor s(c.gpioChip, c.gpioLine);
 
   s.monitor(eq);
 
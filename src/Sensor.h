@@ -4,11 +4,12 @@
 
 #include <gpiod.hpp>
 
+#include <string>
 #include <thread>
 
 class Sensor {
 public:
-  Sensor();
+  Sensor(std::string const &chip, unsigned line);
   ~Sensor();
 
   void monitor(EventQueue &);
@@ -0,0 +1,696 @@
+// blatsim: drives the real BlatMachine on virtual time with synthetic or
+// recorded motion/presence traces, sweeping timings and RSSI threshold
+// across all cores.
+
+#include "ActivityForecast.h"
+#include "BlatMachine.h"
+#include "ScanScheduler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <getopt.h>
+#include <limits>
+#include <random>
+#include <spdlog/spdlog.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+constexpr double kDay = 24 * 60 * 60;
+constexpr double kNever = std::numeric_limits<double>::infinity();
+
+enum class Whereabouts { AWAY, NEAR, IN };
+
+struct Segment {
+  double start;
+  Whereabouts where;
+};
+
+struct Visit {
+  double start, end;
+};
+
+// Ground truth for one stretch of time. Times are seconds from its start.
+struct Trace {
+  double length = 0;
+  std::vector<double> motion;    // PIR rising edges, sorted.
+  std::vector<Segment> nazbert;  // Where Nazbert is; first starts at 0.
+  std::vector<Visit> visits;     // Target cat in the room.
+};
+
+// Knobs for synthetic traces and for the radio.
+struct Model {
+  double advInterval = 1.0;   // Tag advertising interval, s.
+  double receiveProb = 0.95;  // Chance of hearing an adv while listening.
+  double setupLatency = 0.03; // From startScanning() to radio listening, s.
+  double rssiIn = -62;        // Mean RSSI when Nazbert is in the room.
+  double rssiNear = -80;      // ...and when he is next door.
+  double rssiSigma = 6;
+  double awayMean = 2 * 3600, nearMean = 600, inMean = 300; // Dwell, s.
+  double nazbertMotionEvery = 20; // Mean s between PIR edges from Nazbert.
+  double visitsPerDay = 6;        // Target cat.
+  double visitMean = 180;
+  double visitMotionEvery = 15;
+  // Nazbert comes in for his meals, so the week has some shape to learn.
+  std::array<double, 2> meals{7.5 * 3600, 18 * 3600};
+  double mealJitter = 600; // Standard deviation of the start, s.
+  double mealMean = 1200;
+};
+
+struct Params {
+  int grace, scan, run; // Seconds.
+  int rssi;             // dBm threshold.
+  int prewarm;          // prewarm_pct; 0 is the reactive baseline.
+};
+
+struct Result {
+  uint64_t runs = 0;
+  uint64_t targetRuns = 0;   // Runs with the target cat about.
+  uint64_t wrongfulRuns = 0; // Runs with Nazbert in the room at any point.
+  uint64_t missedDetections = 0; // Nazbert in the room while SCANNING, but
+                                 // we ran anyway.
+  uint64_t disallowed = 0;
+  uint64_t aborts = 0;
+  uint64_t visits = 0;
+  uint64_t visitsBlatted = 0;
+  double relayOn = 0;  // s.
+  double exposure = 0; // Relay-on s with Nazbert in the room.
+  double days = 0;
+  double scanning = 0;        // s in SCANNING.
+  double disallowLatency = 0; // Motion to decision, summed over disallowed.
+  double prewarmScan = 0;     // s scanning while ARMED.
+  uint64_t atOnce = 0;        // Disallowed without SCANNING at all.
+};
+
+uint64_t mix(uint64_t a, uint64_t b) {
+  // splitmix64 of a combined seed, so neighbouring days are unrelated.
+  uint64_t z = a * 0x9e3779b97f4a7c15 + b + 0x632be59bd9b4e5d9;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  return z ^ (z >> 31);
+}
+
+void addMotion(Trace &t, std::mt19937_64 &rng, double start, double end,
+               double every) {
+  std::exponential_distribution<double> gap(1.0 / every);
+  for (double m = start + gap(rng); m < end && m < t.length; m += gap(rng)) {
+    t.motion.push_back(m);
+  }
+}
+
+// Puts Nazbert in w over [start, end), whatever he was doing before.
+void setWhereabouts(Trace &t, double start, double end, Whereabouts w) {
+  auto &segs = t.nazbert;
+  const auto after = [](double when, Segment const &s) {
+    return when < s.start;
+  };
+  start = std::max(start, 0.0);
+  end = std::min(end, t.length);
+  if (start >= end) {
+    return;
+  }
+  const Whereabouts then =
+      (std::upper_bound(segs.begin(), segs.end(), end, after) - 1)->where;
+  auto first = std::lower_bound(
+      segs.begin(), segs.end(), start,
+      [](Segment const &s, double when) { return s.start < when; });
+  auto last = std::upper_bound(first, segs.end(), end, after);
+  auto it = segs.erase(first, last);
+  segs.insert(it, {{start, w}, {end, then}});
+}
+
+Trace syntheticDay(Model const &m, uint64_t seed) {
+  std::mt19937_64 rng(seed);
+  std::uniform_real_distribution<double> uniform(0, 1);
+  Trace t;
+  t.length = kDay;
+
+  // Nazbert wanders AWAY <-> NEAR <-> IN.
+  Whereabouts w = Whereabouts::AWAY;
+  for (double now = 0; now < t.length;) {
+    t.nazbert.push_back({now, w});
+    const double mean = w == Whereabouts::AWAY   ? m.awayMean
+                        : w == Whereabouts::NEAR ? m.nearMean
+                                                 : m.inMean;
+    const double end =
+        now + std::exponential_distribution<double>(1 / mean)(rng);
+    if (w == Whereabouts::IN) {
+      addMotion(t, rng, now, end, m.nazbertMotionEvery);
+    }
+    now = end;
+    switch (w) {
+      case Whereabouts::AWAY:
+      case Whereabouts::IN:
+        w = Whereabouts::NEAR;
+        break;
+      case Whereabouts::NEAR:
+        w = uniform(rng) < 0.5 ? Whereabouts::IN : Whereabouts::AWAY;
+        break;
+    }
+  }
+
+  for (double meal : m.meals) {
+    const double start =
+        meal + std::normal_distribution<double>(0, m.mealJitter)(rng);
+    const double end =
+        start + std::exponential_distribution<double>(1 / m.mealMean)(rng);
+    setWhereabouts(t, start, end, Whereabouts::IN);
+    addMotion(t, rng, start, end, m.nazbertMotionEvery);
+  }
+
+  const int visits = std::poisson_distribution<int>(m.visitsPerDay)(rng);
+  for (int i = 0; i < visits; ++i) {
+    const double start = uniform(rng) * t.length;
+    const double end =
+        start + std::exponential_distribution<double>(1 / m.visitMean)(rng);
+    t.visits.push_back({start, end});
+    addMotion(t, rng, start, end, m.visitMotionEvery);
+  }
+
+  std::sort(t.motion.begin(), t.motion.end());
+  std::sort(t.visits.begin(), t.visits.end(),
+            [](Visit const &a, Visit const &b) { return a.start < b.start; });
+  return t;
+}
+
+// Recorded trace, one observation per line:
+//   <seconds> motion
+//   <seconds> nazbert away|near|in
+//   <seconds> cat 1|0
+// Lines starting with '#' are ignored. The activity forecast takes the
+// trace to start on a Monday at 00:00.
+bool loadTrace(const char *path, Trace &t) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  char line[256];
+  double catSince = -1;
+  t.nazbert.push_back({0, Whereabouts::AWAY});
+  int lineNo = 0;
+  while (fgets(line, sizeof(line), f)) {
+    lineNo++;
+    double when;
+    char kind[16], value[16] = "";
+    if (line[0] == '#' || line[0] == '\n') {
+      continue;
+    }
+    if (sscanf(line, "%lf %15s %15s", &when, kind, value) < 2) {
+      fprintf(stderr, "%s:%d: cannot parse.\n", path, lineNo);
+      fclose(f);
+      return false;
+    }
+    t.length = std::max(t.length, when);
+    if (!strcmp(kind, "motion")) {
+      t.motion.push_back(when);
+    } else if (!strcmp(kind, "nazbert")) {
+      const Whereabouts w = !strcmp(value, "in")     ? Whereabouts::IN
+                            : !strcmp(value, "near") ? Whereabouts::NEAR
+                                                     : Whereabouts::AWAY;
+      t.nazbert.push_back({when, w});
+    } else if (!strcmp(kind, "cat")) {
+      if (atoi(value) && catSince < 0) {
+        catSince = when;
+      } else if (!atoi(value) && catSince >= 0) {
+        t.visits.push_back({catSince, when});
+        catSince = -1;
+      }
+    } else {
+      fprintf(stderr, "%s:%d: unknown observation '%s'.\n", path, lineNo,
+              kind);
+      fclose(f);
+      return false;
+    }
+  }
+  fclose(f);
+  if (catSince >= 0) {
+    t.visits.push_back({catSince, t.length});
+  }
+  std::sort(t.motion.begin(), t.motion.end());
+  std::stable_sort(
+      t.nazbert.begin(), t.nazbert.end(),
+      [](Segment const &a, Segment const &b) { return a.start < b.start; });
+  return true;
+}
+
+// One parameter set on one continuous stretch of virtual time. Implements
+// BlatActions so that the real state machine can be driven directly.
+class SimRun : private BlatActions {
+public:
+  SimRun(Params const &p, Model const &m, ScanScheduler const &scheduler)
+      : p_(p), m_(m), scheduler_(scheduler),
+        machine_(*this, timingsFor(p)) {}
+
+  // start is where the trace begins in the week, in s from Monday 00:00.
+  void run(Trace const &t, double start, uint64_t seed, Result &r);
+
+private:
+  static BlatTimings timingsFor(Params const &p) {
+    BlatTimings timings;
+    timings.grace = std::chrono::seconds(p.grace);
+    timings.scan = std::chrono::seconds(p.scan);
+    timings.run = std::chrono::seconds(p.run);
+    return timings;
+  }
+
+  Whereabouts whereabouts(double when) const;
+  double timeIn(double from, double to) const;
+  int64_t nowNs() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               now().time_since_epoch())
+        .count();
+  }
+  uint32_t tick() const {
+    return uint32_t((start_ + now_) / ActivityForecast::kSlotSeconds);
+  }
+  void newSlot();
+  void accountRelayOn();
+
+  // BlatActions
+  void setRelay(bool enable) override;
+  void startScanning(ScanSituation situation) override {
+    scanning_ = true;
+    situation_ = situation;
+    listeningFrom_ = now_ + m_.setupLatency;
+  }
+  void setScanSituation(ScanSituation situation) override {
+    situation_ = situation;
+  }
+  void stopScanning() override { scanning_ = false; }
+  void setTimeout(Event::Timer which,
+                  std::chrono::milliseconds delay) override {
+    timeoutAt_ = now_ + delay.count() / 1000.0;
+    timer_ = which;
+  }
+  void clearTimeout() override { timeoutAt_ = kNever; }
+  void stateChanged() override;
+  std::chrono::steady_clock::time_point now() const override {
+    return std::chrono::steady_clock::time_point(
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(start_ + now_)));
+  }
+
+  Params const p_;
+  Model const &m_;
+  ScanScheduler const &scheduler_;
+  BlatMachine machine_;
+  ActivityForecast forecast_; // Learns whether or not it is used.
+
+  // Per-trace state. Times are relative to the start of the trace; the
+  // machine does not care, it only ever sees relative delays.
+  Trace const *trace_ = nullptr;
+  Result *result_ = nullptr;
+  std::vector<bool> blatted_;
+  double start_ = 0;
+  double now_ = 0;
+  double timeoutAt_ = kNever;
+  Event::Timer timer_ = Event::Timer::GRACE;
+  bool scanning_ = false;
+  ScanSituation situation_ = ScanSituation::DECISION_PENDING;
+  double listeningFrom_ = 0;
+  bool relayOn_ = false;
+  bool runExposed_ = false; // Nazbert in the room during the current run.
+  double relayOnSince_ = 0;
+  double scanningSince_ = 0;
+  BlatMachine::State state_ = BlatMachine::State::ARMED;
+};
+
+Whereabouts SimRun::whereabouts(double when) const {
+  auto it = std::upper_bound(
+      trace_->nazbert.begin(), trace_->nazbert.end(), when,
+      [](double w, Segment const &s) { return w < s.start; });
+  return it == trace_->nazbert.begin() ? Whereabouts::AWAY : (it - 1)->where;
+}
+
+double SimRun::timeIn(double from, double to) const {
+  const auto &segs = trace_->nazbert;
+  double total = 0;
+  auto it = std::upper_bound(
+      segs.begin(), segs.end(), from,
+      [](double w, Segment const &s) { return w < s.start; });
+  if (it != segs.begin()) {
+    --it;
+  }
+  for (; it != segs.end() && it->start < to; ++it) {
+    const double end = it + 1 == segs.end() ? trace_->length : (it + 1)->start;
+    if (it->where == Whereabouts::IN) {
+      total += std::max(0.0, std::min(to, end) - std::max(from, it->start));
+    }
+  }
+  return total;
+}
+
+void SimRun::setRelay(bool enable) {
+  if (enable && !relayOn_) {
+    relayOn_ = true;
+    relayOnSince_ = now_;
+    runExposed_ = false;
+  } else if (!enable && relayOn_) {
+    relayOn_ = false;
+    accountRelayOn();
+    if (runExposed_) {
+      result_->wrongfulRuns++;
+    }
+  }
+}
+
+// Relay time from relayOnSince_ to now, within the current trace. A run
+// spanning traces is accounted piecewise, but only counted once, when it
+// ends.
+void SimRun::accountRelayOn() {
+  result_->relayOn += now_ - relayOnSince_;
+  const double exposure = timeIn(relayOnSince_, now_);
+  result_->exposure += exposure;
+  runExposed_ = runExposed_ || exposure > 0;
+  for (size_t i = 0; i < trace_->visits.size(); ++i) {
+    const auto &v = trace_->visits[i];
+    if (v.start < now_ && v.end > relayOnSince_) {
+      blatted_[i] = true;
+    }
+  }
+}
+
+void SimRun::newSlot() {
+  forecast_.visit(tick());
+  machine_.setPrewarm(p_.prewarm && forecast_.hot(tick(), p_.prewarm));
+}
+
+void SimRun::stateChanged() {
+  if (state_ == BlatMachine::State::SCANNING) {
+    result_->scanning += now_ - scanningSince_;
+  }
+  state_ = machine_.state();
+  switch (state_) {
+    case BlatMachine::State::SCANNING:
+      scanningSince_ = now_;
+      break;
+    case BlatMachine::State::RUNNING:
+      if (timeIn(scanningSince_, now_) > 0) {
+        result_->missedDetections++;
+      }
+      for (const auto &v : trace_->visits) {
+        if (v.start <= now_ && v.end > now_) {
+          result_->targetRuns++;
+          break;
+        }
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+void SimRun::run(Trace const &t, double start, uint64_t seed, Result &r) {
+  std::mt19937_64 rng(seed);
+  std::uniform_real_distribution<double> uniform(0, 1);
+  std::normal_distribution<double> noise(0, m_.rssiSigma);
+  const double advPhase = uniform(rng) * m_.advInterval;
+  const BlatStats before = machine_.stats();
+  const PrewarmStats prewarmBefore = machine_.prewarmStats();
+
+  trace_ = &t;
+  result_ = &r;
+  blatted_.assign(t.visits.size(), false);
+  // Carry pending timeouts and scan state over from the previous trace.
+  if (timeoutAt_ != kNever) {
+    timeoutAt_ -= now_;
+  }
+  listeningFrom_ -= now_;
+  relayOnSince_ -= now_;
+  scanningSince_ -= now_;
+  start_ = start;
+  now_ = 0;
+  newSlot();
+
+  size_t nextMotion = 0;
+  double lastAdv = -1;
+  while (1) {
+    const double motionAt =
+        nextMotion < t.motion.size() ? t.motion[nextMotion] : kNever;
+    const double slotAt =
+        (tick() + 1.0) * ActivityForecast::kSlotSeconds - start_;
+    double advAt = kNever;
+    if (scanning_) {
+      const double from = std::max(lastAdv + 1e-9, listeningFrom_);
+      advAt = advPhase +
+              std::ceil((from - advPhase) / m_.advInterval) * m_.advInterval;
+    }
+
+    const double next = std::min({motionAt, advAt, timeoutAt_, slotAt});
+    if (next >= t.length) {
+      break;
+    }
+    now_ = next;
+
+    if (next == timeoutAt_) {
+      timeoutAt_ = kNever;
+      machine_.handle(Event::timeout(timer_));
+    } else if (next == slotAt) {
+      newSlot();
+    } else if (next == motionAt) {
+      nextMotion++;
+      forecast_.record(ActivityForecast::Kind::MOTION, tick());
+      machine_.handle(Event::motionDetected({0, 1, nowNs()}));
+    } else {
+      lastAdv = advAt;
+      const Whereabouts w = whereabouts(now_);
+      if (w == Whereabouts::AWAY) {
+        continue;
+      }
+      const double duty = scheduler_.profileFor(situation_).dutyCycle();
+      if (uniform(rng) >= duty * m_.receiveProb) {
+        continue;
+      }
+      const double rssi =
+          (w == Whereabouts::IN ? m_.rssiIn : m_.rssiNear) + noise(rng);
+      if (rssi > p_.rssi) {
+        forecast_.record(ActivityForecast::Kind::SIGHTING, tick());
+        machine_.handle(Event::nazbertDetected(
+            {{}, int8_t(std::clamp(rssi, -127.0, 20.0)), 0, nowNs()}));
+      }
+    }
+  }
+
+  // Close out a run in progress at the end of the trace.
+  now_ = t.length;
+  if (relayOn_) {
+    accountRelayOn();
+    relayOnSince_ = now_;
+  }
+
+  const BlatStats &after = machine_.stats();
+  const PrewarmStats &prewarmAfter = machine_.prewarmStats();
+  const auto seconds = [](std::chrono::microseconds us) {
+    return us.count() / 1e6;
+  };
+  r.disallowLatency +=
+      seconds(prewarmAfter.coldLatency - prewarmBefore.coldLatency) +
+      seconds(prewarmAfter.warmLatency - prewarmBefore.warmLatency);
+  r.prewarmScan += seconds(prewarmAfter.scanTime - prewarmBefore.scanTime);
+  r.atOnce += prewarmAfter.atOnce - prewarmBefore.atOnce;
+  r.runs += after.runs - before.runs;
+  r.disallowed += after.disallowed - before.disallowed;
+  r.aborts += after.aborts - before.aborts;
+  r.visits += t.visits.size();
+  r.visitsBlatted += std::count(blatted_.begin(), blatted_.end(), true);
+  r.days += t.length / kDay;
+}
+
+std::vector<int> parseList(const char *s) {
+  std::vector<int> v;
+  for (const char *p = s; *p;) {
+    char *end;
+    v.push_back(strtol(p, &end, 10));
+    if (end == p) {
+      fprintf(stderr, "Bad list '%s'.\n", s);
+      exit(1);
+    }
+    p = *end == ',' ? end + 1 : end;
+  }
+  return v;
+}
+
+void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  --days N         simulated days per parameter set (1000)\n"
+          "  --trace FILE     replay a recorded trace instead\n"
+          "  --grace LIST     GRACE timeouts, s (10)\n"
+          "  --scan LIST      SCANNING timeouts, s (5)\n"
+          "  --run LIST       RUNNING timeouts, s (5)\n"
+          "  --rssi LIST      RSSI thresholds, dBm (%d)\n"
+          "  --prewarm LIST   prewarm_pct, 0 for the reactive baseline (0,50)\n"
+          "  --threads N      worker threads (all cores)\n"
+          "  --seed N         trace seed (1)\n"
+          "LISTs are comma separated; every combination is simulated.\n",
+          argv0, kDefaultRssiThreshold);
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  static constexpr struct option long_options[] = {
+      {"days", required_argument, nullptr, 'd'},
+      {"trace", required_argument, nullptr, 't'},
+      {"grace", required_argument, nullptr, 'g'},
+      {"scan", required_argument, nullptr, 's'},
+      {"run", required_argument, nullptr, 'r'},
+      {"rssi", required_argument, nullptr, 'R'},
+      {"prewarm", required_argument, nullptr, 'p'},
+      {"threads", required_argument, nullptr, 'j'},
+      {"seed", required_argument, nullptr, 'S'},
+      {"help", no_argument, nullptr, 'h'},
+      {nullptr, 0, nullptr, 0},
+  };
+  int days = 1000;
+  const char *tracePath = nullptr;
+  std::vector<int> graces{10}, scans{5}, runs{5}, rssis{kDefaultRssiThreshold};
+  std::vector<int> prewarms{0, 50};
+  unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+  uint64_t seed = 1;
+  int ch;
+
+  while ((ch = getopt_long(argc, argv, "d:t:g:s:r:R:p:j:S:h", long_options,
+                           nullptr)) != -1) {
+    switch (ch) {
+      case 'd':
+        days = atoi(optarg);
+        break;
+      case 't':
+        tracePath = optarg;
+        break;
+      case 'g':
+        graces = parseList(optarg);
+        break;
+      case 's':
+        scans = parseList(optarg);
+        break;
+      case 'r':
+        runs = parseList(optarg);
+        break;
+      case 'R':
+        rssis = parseList(optarg);
+        break;
+      case 'p':
+        prewarms = parseList(optarg);
+        break;
+      case 'j':
+        threads = std::max(1, atoi(optarg));
+        break;
+      case 'S':
+        seed = strtoull(optarg, nullptr, 0);
+        break;
+      default:
+        usage(argv[0]);
+        return ch == 'h' ? 0 : 1;
+    }
+  }
+
+  // The state machine chats at info level about every event.
+  spdlog::set_level(spdlog::level::off);
+
+  Trace recorded;
+  if (tracePath && !loadTrace(tracePath, recorded)) {
+    return 1;
+  }
+
+  std::vector<Params> sweep;
+  for (int g : graces) {
+    for (int s : scans) {
+      for (int r : runs) {
+        for (int rssi : rssis) {
+          for (int pw : prewarms) {
+            sweep.push_back({g, s, r, rssi, pw});
+          }
+        }
+      }
+    }
+  }
+
+  const Model model;
+  const ScanScheduler scheduler;
+  std::vector<Result> results(sweep.size());
+  std::atomic<size_t> nextJob{0};
+
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (unsigned i = 0; i < std::min<size_t>(threads, sweep.size()); ++i) {
+    workers.emplace_back([&] {
+      for (size_t job; (job = nextJob++) < sweep.size();) {
+        SimRun sim(sweep[job], model, scheduler);
+        if (tracePath) {
+          sim.run(recorded, 0, mix(seed, job), results[job]);
+          continue;
+        }
+        // Every parameter set sees the same days, so differences between
+        // them are down to the parameters and not the luck of the draw.
+        for (int day = 0; day < days; ++day) {
+          sim.run(syntheticDay(model, mix(seed, day)), day * kDay,
+                  mix(seed + 1, day), results[job]);
+        }
+      }
+    });
+  }
+  for (auto &w : workers) {
+    w.join();
+  }
+  const double elapsed = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+
+  const auto latencyMs = [](Result const &r) {
+    return r.disallowed ? 1000 * r.disallowLatency / r.disallowed : 0.0;
+  };
+  printf("grace,scan,run,rssi,prewarm,days,runs,target_runs,wrongful_runs,"
+         "missed_detections,disallowed,aborts,relay_on_s,exposure_s,"
+         "visits,visits_blatted_pct,scanning_s,disallow_latency_ms,"
+         "prewarm_scan_s,disallowed_at_once\n");
+  double simulatedDays = 0;
+  for (size_t i = 0; i < sweep.size(); ++i) {
+    const auto &p = sweep[i];
+    const auto &r = results[i];
+    simulatedDays += r.days;
+    printf("%d,%d,%d,%d,%d,%.2f,%llu,%llu,%llu,%llu,%llu,%llu,%.0f,%.1f,%llu,"
+           "%.1f,%.0f,%.0f,%.0f,%llu\n",
+           p.grace, p.scan, p.run, p.rssi, p.prewarm, r.days,
+           (unsigned long long)r.runs, (unsigned long long)r.targetRuns,
+           (unsigned long long)r.wrongfulRuns,
+           (unsigned long long)r.missedDetections,
+           (unsigned long long)r.disallowed, (unsigned long long)r.aborts,
+           r.relayOn, r.exposure, (unsigned long long)r.visits,
+           r.visits ? 100.0 * r.visitsBlatted / r.visits : 0.0, r.scanning,
+           latencyMs(r), r.prewarmScan, (unsigned long long)r.atOnce);
+  }
+
+  // What pre-warming bought, against the reactive baseline with the same
+  // everything else, when that was simulated too.
+  for (size_t i = 0; i < sweep.size(); ++i) {
+    const auto &p = sweep[i];
+    auto base = std::find_if(sweep.begin(), sweep.end(), [&p](Params const &b) {
+      return b.grace == p.grace && b.scan == p.scan && b.run == p.run &&
+             b.rssi == p.rssi && b.prewarm == 0;
+    });
+    if (!p.prewarm || base == sweep.end()) {
+      continue;
+    }
+    const auto &r = results[i];
+    const auto &b = results[base - sweep.begin()];
+    fprintf(stderr,
+            "grace %d scan %d run %d rssi %d prewarm %d%%: SCANNING %.0fs/day "
+            "saved, disallow latency %.0fms -> %.0fms, for %.0fs/day "
+            "pre-warm scanning\n",
+            p.grace, p.scan, p.run, p.rssi, p.prewarm,
+            (b.scanning - r.scanning) / r.days, latencyMs(b), latencyMs(r),
+            r.prewarmScan / r.days);
+  }
+  fprintf(stderr, "%zu parameter sets, %.0f simulated days in %.2fs (%.0f "
+                  "days/s)\n",
+          sweep.size(), simulatedDays, elapsed, simulatedDays / elapsed);
+  return 0;
+}
@@ -0,0 +1,422 @@
+#include "StatsStore.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <fcntl.h>
+#include <iterator>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static constexpr uint64_t kMagic = 0x3153544154534250; // "PBSTATS1"
+static constexpr uint32_t kVersion = 1;
+
+static constexpr time_t kGranularity[] = {60, 60 * 60, 24 * 60 * 60};
+static constexpr uint32_t kMinutes = 2 * 24 * 60; // Two days of minutes,
+static constexpr uint32_t kHours = 92 * 24;       // three months of hours,
+static constexpr uint32_t kDays = 10 * 366;       // ten years of days.
+static constexpr uint32_t kRingSize[] = {kMinutes, kHours, kDays};
+
+// Each record is one cache line, which also keeps it inside a single disk
+// sector so that it cannot be torn across two of them.
+struct alignas(64) StatsStore::Bucket {
+  uint32_t period; // Start time / granularity; 0 if never used.
+  uint32_t counts[4];
+  uint32_t latencyCount;
+  uint32_t latencyMaxUs;
+  uint32_t pad;
+  uint64_t latencySumUs;
+  uint64_t check; // Written last.
+};
+
+struct alignas(64) StatsStore::Counters {
+  uint64_t seq;
+  uint64_t counts[4];
+  uint64_t check; // Written last.
+};
+
+struct StatsStore::Layout {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t size;
+  Counters counters[2];
+  Bucket minutes[kMinutes];
+  Bucket hours[kHours];
+  Bucket days[kDays];
+};
+
+template <typename T> static uint64_t checksum(T const &r) {
+  // FNV-1a over everything before the check field.
+  const auto *p = reinterpret_cast<const uint8_t *>(&r);
+  uint64_t h = 0xcbf29ce484222325;
+  for (size_t i = 0; i < offsetof(T, check); ++i) {
+    h = (h ^ p[i]) * 0x100000001b3;
+  }
+  return h;
+}
+
+template <typename T> static void seal(T &r) {
+  // Payload stores must reach memory before the check does.
+  __atomic_store_n(&r.check, checksum(r), __ATOMIC_RELEASE);
+}
+
+template <typename T> static bool valid(T const &r) {
+  return r.check == checksum(r);
+}
+
+StatsStore::StatsStore(const char *path) : activeCounters_(0) {
+  static_assert(sizeof(Bucket) == 64, "Bucket must be one cache line.");
+
+  fd_ = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd_ == -1) {
+    spdlog::error("Cannot open stats file {}: {}", path, strerror(errno));
+    throw std::runtime_error("Cannot open stats file.");
+  }
+
+  struct stat st;
+  if (fstat(fd_, &st) == -1) {
+    spdlog::error("Cannot stat stats file {}: {}", path, strerror(errno));
+    close(fd_);
+    throw std::runtime_error("Cannot stat stats file.");
+  }
+
+  const bool fresh = st.st_size != sizeof(Layout);
+  if (fresh) {
+    if (st.st_size != 0) {
+      spdlog::warn("Stats file {} has unexpected size {}, starting afresh.",
+                   path, st.st_size);
+    }
+    if (ftruncate(fd_, 0) == -1 || ftruncate(fd_, sizeof(Layout)) == -1) {
+      spdlog::error("Cannot size stats file {}: {}", path, strerror(errno));
+      close(fd_);
+      throw std::runtime_error("Cannot size stats file.");
+    }
+  }
+
+  // Writeback only covers data, so the blocks must exist and be known to
+  // the file system before it is relied on.
+  const int err = posix_fallocate(fd_, 0, sizeof(Layout));
+  if (err) {
+    spdlog::warn("Cannot allocate stats file {}: {}", path, strerror(err));
+  } else if (fresh && fsync(fd_) == -1) {
+    spdlog::warn("Cannot sync stats file {}: {}", path, strerror(errno));
+  }
+
+  void *p = mmap(nullptr, sizeof(Layout), PROT_READ | PROT_WRITE, MAP_SHARED,
+                 fd_, 0);
+  if (p == MAP_FAILED) {
+    spdlog::error("Cannot map stats file {}: {}", path, strerror(errno));
+    close(fd_);
+    throw std::runtime_error("Cannot map stats file.");
+  }
+  layout_ = static_cast<Layout *>(p);
+
+  if (!fresh &&
+      (layout_->magic != kMagic || layout_->version != kVersion ||
+       layout_->size != sizeof(Layout))) {
+    spdlog::warn("Stats file {} has an unknown format, starting afresh.",
+                 path);
+    memset(layout_, 0, sizeof(Layout));
+  }
+
+  if (layout_->magic != kMagic) {
+    layout_->magic = kMagic;
+    layout_->version = kVersion;
+    layout_->size = sizeof(Layout);
+    seal(layout_->counters[0]);
+  }
+
+  recover();
+}
+
+void StatsStore::flush() const {
+  if (sync_file_range(fd_, 0, sizeof(Layout), SYNC_FILE_RANGE_WRITE) == -1) {
+    spdlog::warn("Cannot flush stats: {}", strerror(errno));
+  }
+}
+
+// Waits until everything written so far is on disk. The last flush() has
+// usually got there already.
+void StatsStore::settle() const {
+  if (sync_file_range(fd_, 0, sizeof(Layout),
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                          SYNC_FILE_RANGE_WAIT_AFTER) == -1) {
+    spdlog::warn("Cannot write back stats: {}", strerror(errno));
+  }
+}
+
+StatsStore::~StatsStore() {
+  flush();
+  munmap(layout_, sizeof(Layout));
+  close(fd_);
+}
+
+void StatsStore::recover() {
+  unsigned torn = 0;
+  for (int level = MINUTE; level < LEVELS; ++level) {
+    Bucket *r = ring(static_cast<Level>(level));
+    for (uint32_t i = 0; i < kRingSize[level]; ++i) {
+      Bucket &b = r[i];
+      if (b.period == 0 && b.check == 0) {
+        continue; // Never used.
+      }
+      if (!valid(b)) {
+        memset(&b, 0, sizeof(b));
+        torn++;
+      }
+    }
+  }
+  if (torn) {
+    spdlog::warn("Dropped {} torn stats buckets.", torn);
+  }
+
+  const Counters *c = layout_->counters;
+  const bool ok0 = valid(c[0]), ok1 = valid(c[1]);
+  if (ok0 && ok1) {
+    activeCounters_ = c[1].seq > c[0].seq ? 1 : 0;
+  } else if (ok0 || ok1) {
+    activeCounters_ = ok1 ? 1 : 0;
+  } else {
+    // Should be impossible, but the daily history still has it all.
+    spdlog::warn("Stats counters are corrupt, rebuilding from history.");
+    Counters rebuilt = {};
+    for (const auto &b : layout_->days) {
+      for (int i = 0; i < 4; ++i) {
+        rebuilt.counts[i] += b.counts[i];
+      }
+    }
+    activeCounters_ = 1;
+    writeCounters(rebuilt);
+  }
+}
+
+void StatsStore::writeCounters(Counters const &c) {
+  const unsigned next = activeCounters_ ^ 1;
+  Counters &dst = layout_->counters[next];
+  dst.seq = layout_->counters[activeCounters_].seq + 1;
+  memcpy(dst.counts, c.counts, sizeof(dst.counts));
+  seal(dst);
+  activeCounters_ = next;
+}
+
+StatsStore::Bucket *StatsStore::ring(Level level) const {
+  switch (level) {
+    case MINUTE:
+      return layout_->minutes;
+    case HOUR:
+      return layout_->hours;
+    default:
+      return layout_->days;
+  }
+}
+
+StatsStore::Bucket &StatsStore::bucketFor(Level level, time_t now) {
+  const uint32_t period = now / kGranularity[level];
+  Bucket &b = ring(level)[period % kRingSize[level]];
+  if (b.period != period) {
+    if (level == MINUTE) {
+      settle(); // Older buckets reach the disk first; see StatsStore.h.
+    }
+    memset(&b, 0, sizeof(b));
+    b.period = period;
+  }
+  return b;
+}
+
+void StatsStore::add(Counter c, time_t now) {
+  const int i = static_cast<int>(c);
+  for (int level = MINUTE; level < LEVELS; ++level) {
+    Bucket &b = bucketFor(static_cast<Level>(level), now);
+    b.counts[i]++;
+    seal(b);
+  }
+
+  Counters next = layout_->counters[activeCounters_];
+  next.counts[i]++;
+  writeCounters(next);
+}
+
+void StatsStore::addLatency(std::chrono::microseconds latency, time_t now) {
+  const uint32_t us = latency.count() > UINT32_MAX ? UINT32_MAX
+                                                   : latency.count();
+  for (int level = MINUTE; level < LEVELS; ++level) {
+    Bucket &b = bucketFor(static_cast<Level>(level), now);
+    b.latencyCount++;
+    b.latencySumUs += us;
+    if (us > b.latencyMaxUs) {
+      b.latencyMaxUs = us;
+    }
+    seal(b);
+  }
+}
+
+StatsTotals StatsStore::lifetime() const {
+  const Counters &c = layout_->counters[activeCounters_];
+  StatsTotals t;
+  t.motion = c.counts[0];
+  t.runs = c.counts[1];
+  t.disallowed = c.counts[2];
+  t.aborts = c.counts[3];
+  return t;
+}
+
+void StatsStore::sumRange(Level level, time_t from, time_t to,
+                          StatsTotals &t) const {
+  const Bucket *r = ring(level);
+  const time_t g = kGranularity[level];
+  time_t first = from / g;
+  const time_t last = (to + g - 1) / g;
+  if (last - first > kRingSize[level]) {
+    first = last - kRingSize[level]; // Older than that is gone anyway.
+  }
+
+  for (time_t p = first; p < last; ++p) {
+    const Bucket &b = r[p % kRingSize[level]];
+    if (b.period != p) {
+      continue;
+    }
+    t.motion += b.counts[0];
+    t.runs += b.counts[1];
+    t.disallowed += b.counts[2];
+    t.aborts += b.counts[3];
+    t.latencyCount += b.latencyCount;
+    t.latencySumUs += b.latencySumUs;
+    if (b.latencyMaxUs > t.latencyMaxUs) {
+      t.latencyMaxUs = b.latencyMaxUs;
+    }
+  }
+}
+
+// Whole periods come from the coarsest ring; the ragged edges are filled in
+// from successively finer ones. Minute resolution is the floor: a partial
+// minute at either end counts in full.
+void StatsStore::sumLevel(Level level, time_t from, time_t to,
+                          StatsTotals &t) const {
+  if (from >= to) {
+    return;
+  }
+  if (level == MINUTE) {
+    sumRange(MINUTE, from, to, t);
+    return;
+  }
+  const time_t g = kGranularity[level];
+  const time_t a = (from + g - 1) / g * g;
+  const time_t b = to / g * g;
+  const Level finer = static_cast<Level>(level - 1);
+  if (a < b) {
+    sumRange(level, a, b, t);
+    sumLevel(finer, from, a, t);
+    sumLevel(finer, b, to, t);
+  } else {
+    sumLevel(finer, from, to, t);
+  }
+}
+
+StatsTotals StatsStore::query(time_t from, time_t to) const {
+  StatsTotals t;
+  sumLevel(DAY, from, to, t);
+  return t;
+}
+
+void StatsStore::publish(StatusBuffer &buf, time_t now) const {
+  static constexpr struct {
+    const char *name;
+    time_t span;
+  } windows[] = {
+      {"hour", 60 * 60}, {"day", 24 * 60 * 60}, {"30 days", 30 * 24 * 60 * 60}};
+  auto out = std::back_inserter(buf);
+
+  for (const auto &w : windows) {
+    const auto t = query(now - w.span, now + 1);
+    fmt::format_to(out,
+                   "Last {}: motion {} runs {} disallowed {} aborts {}; "
+                   "detection latency ms mean {:.1f} max {:.1f}\n",
+                   w.name, t.motion, t.runs, t.disallowed, t.aborts,
+                   t.latencyCount ? t.latencySumUs / 1000.0 / t.latencyCount
+                                  : 0.0,
+                   t.latencyMaxUs / 1000.0);
+  }
+}
+
+#ifdef STATS_STORE_TEST
+#include <cassert>
+#include <cstdio>
+int main(void) {
+  using std::chrono::microseconds;
+  const char *path = "/tmp/pounceblat-stats-test.db";
+  static constexpr time_t day = 24 * 60 * 60;
+  static constexpr int days = 400;
+
+  // Pick the start day so that the newest day lands in the last slot of the
+  // file, where the test can find it to corrupt it.
+  const time_t base = ((20000 / kDays + 1) * kDays - days) * day;
+  const time_t end = base + days * day;
+
+  unlink(path);
+  {
+    StatsStore s(path);
+    for (time_t t = base; t < end; t += 60 * 60) {
+      s.add(StatsStore::Counter::MOTION, t);
+      if ((t / 3600) % 3 == 0) {
+        s.add(StatsStore::Counter::RUNS, t + 30);
+      } else {
+        s.add(StatsStore::Counter::DISALLOWED, t + 30);
+        s.addLatency(microseconds(1500), t + 30);
+      }
+    }
+    assert(s.lifetime().motion == days * 24);
+    assert(s.query(base, end).motion == days * 24);
+    assert(s.query(end - 30 * day, end).motion == 30 * 24);
+    assert(s.query(end - 90 * 60, end).motion == 1); // Partial hour edge.
+  }
+
+  // Everything comes back after a "restart".
+  {
+    StatsStore s(path);
+    assert(s.lifetime().motion == days * 24);
+    assert(s.lifetime().runs + s.lifetime().disallowed == days * 24);
+    const auto t = s.query(end - 30 * day, end);
+    assert(t.motion == 30 * 24);
+    assert(t.latencyCount == t.disallowed);
+    assert(t.latencyMaxUs == 1500);
+
+    const auto start = std::chrono::steady_clock::now();
+    static constexpr int queries = 10000;
+    uint64_t sink = 0;
+    for (int i = 0; i < queries; ++i) {
+      sink += s.query(end - (300 - i % 7) * day - i, end - i).motion;
+    }
+    const auto us = std::chrono::duration<double, std::micro>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+    printf("300-day query: %.2fus (%llu)\n", us / queries,
+           (unsigned long long)sink);
+  }
+
+  // Tear the newest day bucket, as a power cut mid-write might. It is the
+  // last record in the file.
+  {
+    int fd = open(path, O_RDWR);
+    struct stat st;
+    assert(fstat(fd, &st) == 0);
+    const uint8_t junk[8] = {0xde, 0xad, 0xbe, 0xef, 0xde, 0xad, 0xbe, 0xef};
+    assert(pwrite(fd, junk, sizeof(junk), st.st_size - 64 + 4) ==
+           sizeof(junk));
+    close(fd);
+
+    StatsStore s(path);
+    assert(s.lifetime().motion == days * 24);
+    // Only the torn day is lost from the daily ring...
+    assert(s.query(end - 2 * day, end).motion == 24);
+    // ...and the same hours are still there at finer resolution.
+    assert(s.query(end - day + 60, end).motion == 23);
+  }
+
+  unlink(path);
+  puts("Stats store OK.");
+  return 0;
+}
+#endif
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "StatusBuffer.h"
+
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+
+struct StatsTotals {
+  uint64_t motion = 0;
+  uint64_t runs = 0;
+  uint64_t disallowed = 0;
+  uint64_t aborts = 0;
+  uint64_t latencyCount = 0; // Detection latency samples.
+  uint64_t latencySumUs = 0;
+  uint32_t latencyMaxUs = 0;
+};
+
+// Persistent counters plus per minute/hour/day history, kept in a
+// memory-mapped file so that they survive restarts.
+//
+// Nothing is ever fsync()ed on the hot path. flush() starts writeback of
+// whatever is dirty without waiting for it, and the daemon calls it
+// whenever it publishes stats. Before a new minute bucket is first written,
+// everything written so far is waited for, which is normally already done
+// by then; so a power cut loses at most the latest minute, and the hour and
+// day totals and lifetime counters it had added to. What does reach the
+// disk can be torn, since the ordering in the file is CPU store order, not
+// disk write order; but every record carries a checksum written after its
+// payload, so a torn record is detected and dropped when the file is next
+// opened. Lifetime counters are double-buffered, so an older valid copy
+// survives a torn newer one.
+class StatsStore {
+public:
+  enum class Counter { MOTION, RUNS, DISALLOWED, ABORTS };
+
+  explicit StatsStore(const char *path); // Creates the file if needed.
+  ~StatsStore();
+
+  StatsStore(StatsStore const &) = delete;
+  StatsStore &operator=(StatsStore const &) = delete;
+
+  void add(Counter c, time_t now = time(nullptr));
+  void addLatency(std::chrono::microseconds latency,
+                  time_t now = time(nullptr));
+
+  StatsTotals lifetime() const;
+  StatsTotals query(time_t from, time_t to) const; // [from, to)
+
+  // Starts writing dirty pages back, without waiting. Cheap enough to call
+  // on every state change.
+  void flush() const;
+
+  // Recent history summary, for the status file.
+  void publish(StatusBuffer &buf, time_t now = time(nullptr)) const;
+
+private:
+  struct Bucket;
+  struct Counters;
+  struct Layout;
+  enum Level { MINUTE, HOUR, DAY, LEVELS };
+
+  Bucket *ring(Level level) const;
+  Bucket &bucketFor(Level level, time_t now);
+  void sumLevel(Level level, time_t from, time_t to, StatsTotals &t) const;
+  void sumRange(Level level, time_t from, time_t to, StatsTotals &t) const;
+  void writeCounters(Counters const &c);
+  void settle() const;
+  void recover();
+
+  int fd_;
+  Layout *layout_;
+  unsigned activeCounters_; // Index of the newest valid Counters copy.
+};
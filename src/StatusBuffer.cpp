@@ -0,0 +1,47 @@
+#include "StatusBuffer.h"
+
+#include <climits>
+#include <cstring>
+#include <spdlog/spdlog.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int writeStatusFile(const char *path, StatusBuffer const &buf) {
+  char tmpName[PATH_MAX];
+  if (snprintf(tmpName, sizeof(tmpName), "%s.XXXXXX", path) >=
+      (int)sizeof(tmpName)) {
+    spdlog::warn("Status file name {} too long.", path);
+    return -1;
+  }
+  int tmpFd = mkstemp(tmpName);
+  if (tmpFd == -1) {
+    spdlog::warn("Cannot create temporary status file: {}", strerror(errno));
+    return -1;
+  }
+
+  if (write(tmpFd, buf.data(), buf.size()) != (ssize_t)buf.size()) {
+    spdlog::warn("Error writing temporary status file: {}", strerror(errno));
+    close(tmpFd);
+    unlink(tmpName);
+    return -1;
+  }
+
+  if (close(tmpFd) == -1) {
+    spdlog::warn("Error writing temporary status file: {}", strerror(errno));
+    unlink(tmpName);
+    return -1;
+  }
+
+  if (chmod(tmpName, 0444) == -1) {
+    spdlog::warn("Error chmoding temporary status file: {}", strerror(errno));
+    unlink(tmpName);
+    return -1;
+  }
+
+  if (rename(tmpName, path) == -1) {
+    spdlog::warn("Error renaming temporary stats file: {}", strerror(errno));
+    unlink(tmpName);
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <spdlog/fmt/fmt.h>
+
+// Status text is formatted into a fixed inline buffer so that publishing
+// it does not touch the heap unless it outgrows the buffer.
+using StatusBuffer = fmt::basic_memory_buffer<char, 4096>;
+
+// Atomically replace path with the contents of buf, readable by everyone.
+// Returns 0 on success, -1 (after logging) on failure.
+int writeStatusFile(const char *path, StatusBuffer const &buf);
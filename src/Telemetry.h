@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+
+// Wire format of the telemetry stream from pounceblat to blatagg, over a
+// unix stream socket. Both ends run on the same host, so everything is in
+// host byte order.
+//
+// The stream is a sequence of frames, each a FrameHeader followed by
+// `length` bytes of payload. A connection starts with HELLO. The first
+// STATS after it carries absolute totals and each later one the change
+// since the previous STATS, so a reconnect resynchronises the aggregator.
+// Receivers skip frame types they do not know.
+namespace telemetry {
+
+constexpr uint8_t kVersion = 2; // 2: Stats counters went to 64 bits.
+
+enum class FrameType : uint8_t {
+  HELLO = 1,
+  STATE = 2,   // Current state of the machine.
+  STATS = 3,   // BlatStats delta.
+  LATENCY = 4, // Detection latency summary since the previous one.
+};
+
+struct FrameHeader {
+  uint8_t type;
+  uint8_t length; // Of the payload.
+};
+
+struct Hello {
+  uint8_t version;
+  uint8_t pad[3];
+  uint32_t pid;
+  char name[24]; // NUL-padded, not necessarily terminated.
+};
+
+struct State {
+  uint64_t timeUs; // CLOCK_REALTIME.
+  uint8_t state;   // BlatMachine::State.
+  uint8_t pad[7];
+};
+
+struct Stats {
+  uint64_t motion;
+  uint64_t runs;
+  uint64_t disallowed;
+  uint64_t aborts;
+};
+
+struct Latency {
+  uint32_t count;
+  uint32_t maxUs;
+  uint64_t sumUs;
+};
+
+static_assert(sizeof(FrameHeader) == 2, "FrameHeader layout changed.");
+static_assert(sizeof(Hello) == 32, "Hello layout changed.");
+static_assert(sizeof(State) == 16, "State layout changed.");
+static_assert(sizeof(Stats) == 32, "Stats layout changed.");
+static_assert(sizeof(Latency) == 16, "Latency layout changed.");
+
+} // namespace telemetry
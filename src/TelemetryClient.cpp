@@ -0,0 +1,143 @@
+#include "TelemetryClient.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <spdlog/spdlog.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+// Everything one update() can send, in one write.
+class FrameBuffer {
+public:
+  template <typename T> void add(telemetry::FrameType type, T const &payload) {
+    static_assert(sizeof(T) <= 255, "Payload too big for a frame.");
+    const telemetry::FrameHeader h{static_cast<uint8_t>(type),
+                                   static_cast<uint8_t>(sizeof(T))};
+    memcpy(buf_ + len_, &h, sizeof(h));
+    memcpy(buf_ + len_ + sizeof(h), &payload, sizeof(T));
+    len_ += sizeof(h) + sizeof(T);
+  }
+
+  const uint8_t *data() const { return buf_; }
+  size_t size() const { return len_; }
+
+private:
+  uint8_t buf_[4 * (sizeof(telemetry::FrameHeader) + 32)];
+  size_t len_ = 0;
+};
+
+} // namespace
+
+TelemetryClient::TelemetryClient(std::string path, std::string name,
+                                 std::chrono::milliseconds retry)
+    : path_(std::move(path)), name_(std::move(name)), retry_(retry), fd_(-1),
+      primed_(false), pending_{} {
+  if (name_.size() > sizeof(telemetry::Hello::name)) {
+    spdlog::warn("Telemetry name {} will be cut to {} characters.", name_,
+                 sizeof(telemetry::Hello::name));
+  }
+}
+
+TelemetryClient::~TelemetryClient() { disconnect(); }
+
+bool TelemetryClient::connect() {
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (path_.size() >= sizeof(addr.sun_path)) {
+    spdlog::warn("Telemetry socket path {} is too long.", path_);
+    return false;
+  }
+  memcpy(addr.sun_path, path_.c_str(), path_.size());
+
+  fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd_ == -1) {
+    spdlog::warn("Cannot create telemetry socket: {}", strerror(errno));
+    return false;
+  }
+  if (::connect(fd_, reinterpret_cast<struct sockaddr *>(&addr),
+                offsetof(struct sockaddr_un, sun_path) + path_.size()) ==
+      -1) {
+    spdlog::debug("Cannot connect to aggregator at {}: {}", path_,
+                  strerror(errno));
+    disconnect();
+    return false;
+  }
+  spdlog::info("Streaming telemetry to {}.", path_);
+  sent_ = BlatStats{};
+  return true;
+}
+
+void TelemetryClient::disconnect() {
+  if (fd_ != -1) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+void TelemetryClient::update(BlatMachine::State state, BlatStats const &stats,
+                             std::chrono::microseconds lastLatency) {
+  if (primed_ && stats.disallowed != seen_.disallowed) {
+    const uint64_t us = lastLatency.count();
+    pending_.count++;
+    pending_.sumUs += us;
+    pending_.maxUs = std::max<uint64_t>(pending_.maxUs, us);
+  }
+  seen_ = stats;
+  primed_ = true;
+
+  FrameBuffer frames;
+  if (fd_ == -1) {
+    const auto now = Clock::now();
+    if (now < nextAttempt_) {
+      return;
+    }
+    nextAttempt_ = now + retry_;
+    if (!connect()) {
+      return;
+    }
+    telemetry::Hello hello = {};
+    hello.version = telemetry::kVersion;
+    hello.pid = getpid();
+    memcpy(hello.name, name_.data(),
+           std::min(name_.size(), sizeof(hello.name)));
+    frames.add(telemetry::FrameType::HELLO, hello);
+  }
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  telemetry::State s = {};
+  s.timeUs = ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+  s.state = static_cast<uint8_t>(state);
+  frames.add(telemetry::FrameType::STATE, s);
+
+  const telemetry::Stats delta{stats.motion - sent_.motion,
+                               stats.runs - sent_.runs,
+                               stats.disallowed - sent_.disallowed,
+                               stats.aborts - sent_.aborts};
+  if (delta.motion || delta.runs || delta.disallowed || delta.aborts) {
+    frames.add(telemetry::FrameType::STATS, delta);
+  }
+  if (pending_.count) {
+    frames.add(telemetry::FrameType::LATENCY, pending_);
+  }
+
+  // A unix stream socket takes a write this small whole or not at all; a
+  // short write is treated like a failed one all the same, since the
+  // framing is lost either way.
+  const ssize_t n =
+      send(fd_, frames.data(), frames.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (n != ssize_t(frames.size())) {
+    spdlog::warn("Telemetry to {} failed, reconnecting later: {}", path_,
+                 n == -1 ? strerror(errno) : "short write");
+    disconnect();
+    return;
+  }
+  sent_ = stats;
+  pending_ = {};
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "BlatMachine.h"
+#include "Telemetry.h"
+
+#include <chrono>
+#include <string>
+
+// Streams state changes, stats deltas and detection latencies to a blatagg
+// aggregator. Sending never blocks: if the aggregator is gone or not keeping
+// up, the connection is dropped and retried later, and the next connection
+// catches it up.
+class TelemetryClient {
+public:
+  TelemetryClient(std::string path, std::string name,
+                  std::chrono::milliseconds retry = std::chrono::seconds(5));
+  ~TelemetryClient();
+
+  TelemetryClient(TelemetryClient const &) = delete;
+  TelemetryClient &operator=(TelemetryClient const &) = delete;
+
+  // Call whenever the machine changes state, and every retry() besides:
+  // only update() reconnects, and only sending notices that the aggregator
+  // has gone away. lastLatency is BlatMachine::lastLatency(); it is counted
+  // when disallowed has gone up.
+  void update(BlatMachine::State state, BlatStats const &stats,
+              std::chrono::microseconds lastLatency);
+
+  bool connected() const { return fd_ != -1; }
+  std::chrono::milliseconds retry() const { return retry_; }
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  bool connect();
+  void disconnect();
+
+  const std::string path_;
+  const std::string name_;
+  const std::chrono::milliseconds retry_;
+  int fd_;
+  Clock::time_point nextAttempt_;
+
+  BlatStats sent_; // What the aggregator has been told, while connected.
+  bool primed_;    // seen_ is valid.
+  BlatStats seen_; // As of the previous update().
+  telemetry::Latency pending_;
+};
@@ -0,0 +1,271 @@
+#include "Trace.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <pthread.h>
+#include <spdlog/spdlog.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+std::atomic<bool> Tracer::enabled_{false};
+thread_local uint64_t Tracer::flow_ = 0;
+
+namespace {
+
+constexpr size_t kRecordsPerThread = 8192;
+constexpr size_t kMaxThreads = 16;
+
+struct ThreadRing {
+  pid_t tid;
+  std::atomic<const char *> name{nullptr}; // Set last; null until usable.
+  std::atomic<uint64_t> head{0}; // Records ever written.
+  // Allocated for every ring at static initialisation, whether or not a
+  // thread ever registers for it, but left uninitialised and only touched
+  // when tracing, so the pages cost nothing until then.
+  std::unique_ptr<TraceRecord[]> records{new TraceRecord[kRecordsPerThread]};
+};
+
+std::atomic<size_t> gThreadCount{0};
+std::atomic<uint64_t> gFlows{0};
+ThreadRing gRings[kMaxThreads];
+thread_local ThreadRing *tRing = nullptr;
+
+} // namespace
+
+void Tracer::registerThread(const char *name) {
+  const pid_t tid = syscall(SYS_gettid);
+  // Renaming the main thread renames the process, as far as ps and pkill
+  // are concerned.
+  if (tid != getpid()) {
+    pthread_setname_np(pthread_self(), name);
+  }
+  if (tRing) {
+    return;
+  }
+  const size_t i = gThreadCount.fetch_add(1);
+  if (i >= kMaxThreads) {
+    spdlog::warn("Too many threads to trace, not tracing {}.", name);
+    return;
+  }
+  gRings[i].tid = tid;
+  gRings[i].name.store(name, std::memory_order_release);
+  tRing = &gRings[i];
+}
+
+const char *Tracer::threadName(pid_t tid) {
+  const size_t threads = std::min(gThreadCount.load(), kMaxThreads);
+  for (size_t i = 0; i < threads; ++i) {
+    const char *name = gRings[i].name.load(std::memory_order_acquire);
+    if (name && gRings[i].tid == tid) {
+      return name;
+    }
+  }
+  return nullptr;
+}
+
+void Tracer::enable(bool on) {
+  enabled_.store(on, std::memory_order_relaxed);
+  spdlog::info("Tracing {}.", on ? "enabled" : "disabled");
+}
+
+uint64_t Tracer::newFlow() {
+  return enabled() ? gFlows.fetch_add(1, std::memory_order_relaxed) + 1 : 0;
+}
+
+uint64_t Tracer::now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void Tracer::record(const char *name, uint64_t startNs, uint64_t endNs,
+                    uint64_t arg) {
+  ThreadRing *ring = tRing;
+  if (!ring) {
+    return;
+  }
+  const uint64_t head = ring->head.load(std::memory_order_relaxed);
+  TraceRecord &r = ring->records[head % kRecordsPerThread];
+  r.startNs = startNs;
+  r.durNs = endNs - startNs;
+  r.name = name;
+  r.arg = arg;
+  r.flow = flow_;
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+int Tracer::dump(const char *path) {
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    spdlog::warn("Cannot open trace file {}: {}", path, strerror(errno));
+    return -1;
+  }
+
+  const pid_t pid = getpid();
+  const size_t threads = std::min(gThreadCount.load(), kMaxThreads);
+  std::vector<TraceRecord> copy(kRecordsPerThread);
+  size_t written = 0;
+  const char *sep = "";
+
+  struct FlowPoint {
+    uint64_t flow;
+    uint64_t ts;
+    pid_t tid;
+  };
+  std::vector<FlowPoint> flows;
+
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  for (size_t t = 0; t < threads; ++t) {
+    ThreadRing &ring = gRings[t];
+    const char *name = ring.name.load(std::memory_order_acquire);
+    if (!name) {
+      continue; // Still registering.
+    }
+    fprintf(f,
+            "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,"
+            "\"args\":{\"name\":\"%s\"}}",
+            sep, pid, ring.tid, name);
+    sep = ",\n";
+
+    // The owner may keep writing while we copy: take the head before and
+    // after, and keep only records that cannot have been overwritten. The
+    // owner may be part way through record `after`, which shares a slot
+    // with record after - kRecordsPerThread, so that one is out too.
+    const uint64_t before = ring.head.load(std::memory_order_acquire);
+    const uint64_t first =
+        before > kRecordsPerThread ? before - kRecordsPerThread : 0;
+    for (uint64_t i = first; i < before; ++i) {
+      copy[i - first] = ring.records[i % kRecordsPerThread];
+    }
+    const uint64_t after = ring.head.load(std::memory_order_acquire);
+    const uint64_t valid =
+        after >= kRecordsPerThread ? after - kRecordsPerThread + 1 : 0;
+
+    for (uint64_t i = std::max(first, valid); i < before; ++i) {
+      const TraceRecord &r = copy[i - first];
+      if (r.durNs) {
+        fprintf(f,
+                ",\n{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,"
+                "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"arg\":%llu}}",
+                r.name, pid, ring.tid, r.startNs / 1000.0, r.durNs / 1000.0,
+                (unsigned long long)r.arg);
+      } else {
+        fprintf(f,
+                ",\n{\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\",\"pid\":%d,"
+                "\"tid\":%d,\"ts\":%.3f,\"args\":{\"arg\":%llu}}",
+                r.name, pid, ring.tid, r.startNs / 1000.0,
+                (unsigned long long)r.arg);
+      }
+      if (r.flow) {
+        flows.push_back({r.flow, r.startNs, ring.tid});
+      }
+      written++;
+    }
+  }
+
+  // Draw each flow from its first span to its last, through the first span
+  // of every stretch it spends on another thread. Flow events bind to the
+  // span enclosing their timestamp on their thread.
+  std::sort(flows.begin(), flows.end(), [](auto const &a, auto const &b) {
+    return a.flow != b.flow ? a.flow < b.flow : a.ts < b.ts;
+  });
+  auto point = [&](const char *ph, FlowPoint const &p) {
+    fprintf(f,
+            ",\n{\"ph\":\"%s\",\"bp\":\"e\",\"id\":%llu,\"name\":\"event\","
+            "\"cat\":\"event\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f}",
+            ph, (unsigned long long)p.flow, pid, p.tid, p.ts / 1000.0);
+  };
+  for (size_t b = 0, e; b < flows.size(); b = e) {
+    for (e = b + 1; e < flows.size() && flows[e].flow == flows[b].flow; ++e) {
+    }
+    if (e - b < 2) {
+      continue; // Nothing to link.
+    }
+    point("s", flows[b]);
+    pid_t tid = flows[b].tid;
+    for (size_t i = b + 1; i < e - 1; ++i) {
+      if (flows[i].tid != tid) {
+        point("t", flows[i]);
+        tid = flows[i].tid;
+      }
+    }
+    point("f", flows[e - 1]);
+  }
+  fprintf(f, "\n]}\n");
+
+  if (fclose(f) != 0) {
+    spdlog::warn("Error writing trace file {}: {}", path, strerror(errno));
+    return -1;
+  }
+  spdlog::info("Wrote {} trace events to {}.", written, path);
+  return 0;
+}
+
+#ifdef TRACE_TEST
+#include <cassert>
+#include <thread>
+int main(void) {
+  Tracer::registerThread("main");
+
+  { TRACE_SPAN("before-enable"); }
+  Tracer::enable(true);
+
+  std::thread worker([] {
+    Tracer::registerThread("worker");
+    for (int i = 0; i < 3 * (int)kRecordsPerThread; ++i) {
+      TRACE_SPAN("worker.loop", i);
+    }
+  });
+  {
+    TRACE_SPAN("main.outer");
+    TRACE_INSTANT("main.instant", 42);
+  }
+  worker.join();
+
+  // One flow, started here and finished on another thread.
+  const uint64_t id = Tracer::newFlow();
+  assert(id);
+  {
+    TraceFlow flow(id);
+    TRACE_SPAN("main.send");
+  }
+  std::thread([id] {
+    Tracer::registerThread("receiver");
+    TraceFlow flow(id);
+    TRACE_SPAN("receiver.handle");
+  }).join();
+  assert(!Tracer::flow());
+
+  // Cost of a span when tracing is off.
+  Tracer::enable(false);
+  const uint64_t start = Tracer::now();
+  static constexpr int kSpans = 10000000;
+  for (int i = 0; i < kSpans; ++i) {
+    TRACE_SPAN("off");
+  }
+  printf("Disabled span: %.2fns\n", double(Tracer::now() - start) / kSpans);
+
+  assert(Tracer::dump("/tmp/pounceblat-trace-test.json") == 0);
+  FILE *f = fopen("/tmp/pounceblat-trace-test.json", "r");
+  static char buf[4 << 20];
+  size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+  buf[n] = 0;
+  fclose(f);
+  assert(strstr(buf, "\"main.outer\""));
+  assert(strstr(buf, "\"main.instant\""));
+  assert(!strstr(buf, "before-enable"));
+  assert(!strstr(buf, "\"off\""));
+  char from[64], to[64];
+  snprintf(from, sizeof(from), "\"ph\":\"s\",\"bp\":\"e\",\"id\":%llu,",
+           (unsigned long long)id);
+  snprintf(to, sizeof(to), "\"ph\":\"f\",\"bp\":\"e\",\"id\":%llu,",
+           (unsigned long long)id);
+  assert(strstr(buf, from) && strstr(buf, to));
+  puts("Trace OK.");
+  return 0;
+}
+#endif
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <sys/types.h>
+
+// Low-overhead span tracing, exported as Chrome trace JSON (load it in
+// chrome://tracing or ui.perfetto.dev).
+//
+// Each registered thread owns a ring of records which only it writes to,
+// so recording takes no locks. When tracing is off a span costs one relaxed
+// load and a branch; building with -DNO_TRACE removes even that.
+//
+// A flow ties together the spans, on whatever threads, that one event passes
+// through: a GPIO edge, its send, the machine handling it and the relay
+// writes it leads to. Spans record the flow current on their thread, set
+// with TraceFlow, and the export links each flow's spans with flow arrows.
+
+struct TraceRecord {
+  uint64_t startNs;
+  uint64_t durNs; // 0 for an instant event.
+  const char *name; // Must be a string literal.
+  uint64_t arg;
+  uint64_t flow; // 0 if not part of a flow.
+};
+
+class Tracer {
+public:
+  // Call at the top of every thread that should be traced. Also names the
+  // thread (other than the main one), which shows up in ps and /proc too.
+  // name must be a literal.
+  static void registerThread(const char *name);
+  static const char *threadName(pid_t tid); // Null if never registered.
+
+  static bool enabled() {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+  static void enable(bool on);
+
+  static uint64_t now();
+  static void record(const char *name, uint64_t startNs, uint64_t endNs,
+                     uint64_t arg);
+
+  // A fresh flow id, or 0 (no flow) while tracing is off.
+  static uint64_t newFlow();
+  static uint64_t flow() { return flow_; } // This thread's current flow.
+
+  // Write everything still in the rings as Chrome JSON. Returns 0 on
+  // success.
+  static int dump(const char *path);
+
+private:
+  static std::atomic<bool> enabled_;
+  static thread_local uint64_t flow_;
+
+  friend class TraceFlow;
+};
+
+// Make id this thread's current flow for the rest of the enclosing scope.
+class TraceFlow {
+public:
+  explicit TraceFlow(uint64_t id) : saved_(Tracer::flow_) {
+    Tracer::flow_ = id;
+  }
+  ~TraceFlow() { Tracer::flow_ = saved_; }
+
+  TraceFlow(TraceFlow const &) = delete;
+  TraceFlow &operator=(TraceFlow const &) = delete;
+
+private:
+  uint64_t saved_;
+};
+
+class TraceSpan {
+public:
+  explicit TraceSpan(const char *name, uint64_t arg = 0)
+      : name_(name), arg_(arg), start_(Tracer::enabled() ? Tracer::now() : 0) {
+  }
+  ~TraceSpan() {
+    if (start_) {
+      Tracer::record(name_, start_, Tracer::now(), arg_);
+    }
+  }
+
+  TraceSpan(TraceSpan const &) = delete;
+  TraceSpan &operator=(TraceSpan const &) = delete;
+
+private:
+  const char *name_;
+  uint64_t arg_;
+  uint64_t start_;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+#ifdef NO_TRACE
+#define TRACE_SPAN(...)
+#define TRACE_INSTANT(name, arg)
+#else
+// Trace the rest of the enclosing scope: TRACE_SPAN("name"[, arg]).
+#define TRACE_SPAN(...)                                                        \
+  TraceSpan TRACE_CONCAT(traceSpan_, __LINE__)(__VA_ARGS__)
+#define TRACE_INSTANT(name, arg)                                               \
+  do {                                                                         \
+    if (Tracer::enabled()) {                                                   \
+      const uint64_t traceNow_ = Tracer::now();                                \
+      Tracer::record(name, traceNow_, traceNow_, arg);                         \
+    }                                                                          \
+  } while (0)
+#endif
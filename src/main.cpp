@@ -3,34 +3,72 @@
 #include "spdlog/sinks/rotating_file_sink.h"
 #include <getopt.h>
 #include <spdlog/spdlog.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+static constexpr const char *gStatsDir = "/var/lib/pounceblat";
+static constexpr const char *gStatsFile = "/var/lib/pounceblat/stats.db";
+static constexpr const char *gForecastFile =
+    "/var/lib/pounceblat/forecast.db";
+static constexpr const char *gConfigFile = "/etc/pounceblat.conf";
+
 static constexpr struct option long_options[] = {
+    {"config", required_argument, nullptr, 'c'},
     {"debug", no_argument, nullptr, 'd'},
+    {"forecastfile", required_argument, nullptr, 'f'},
+    {"no-forecastfile", no_argument, nullptr, 'F'},
     {"logfile", required_argument, nullptr, 'l'},
+    {"perf-counters", no_argument, nullptr, 'P'},
+    {"statsfile", required_argument, nullptr, 's'},
+    {"no-statsfile", no_argument, nullptr, 'S'},
     {nullptr, 0, nullptr, 0},
 };
 
 int main(int argc, char *argv[]) {
   int ch;
+  const char *statsPath = gStatsFile;
+  const char *forecastPath = gForecastFile;
+  const char *configPath = gConfigFile;
 
   spdlog::flush_every(std::chrono::seconds(5));
-  while ((ch = getopt_long(argc, argv, "dl:", long_options, nullptr)) != -1) {
+  while ((ch = getopt_long(argc, argv, "c:df:Fl:Ps:S", long_options,
+                           nullptr)) != -1) {
     switch (ch) {
+      case 'c':
+        configPath = optarg;
+        break;
       case 'd':
         spdlog::set_level(spdlog::level::debug);
         break;
+      case 'f':
+        forecastPath = optarg;
+        break;
+      case 'F':
+        forecastPath = nullptr;
+        break;
       case 'l':
         spdlog::set_default_logger(spdlog::rotating_logger_mt(
             "pounceblat", optarg, 16 * 1024 * 1024, 3));
         break;
+      case 'P':
+        PerfLoop::enable();
+        break;
+      case 's':
+        statsPath = optarg;
+        break;
+      case 'S':
+        statsPath = nullptr;
+        break;
     }
   }
   spdlog::info("Here starts blatting!");
 
-  std::vector<std::string> blessedDevices;
-  blessedDevices.push_back("F1:15:32:5B:7E:66");
-  PounceBlat blatter(blessedDevices);
+  ConfigWatcher config(configPath);
+  if ((statsPath == gStatsFile || forecastPath == gForecastFile) &&
+      mkdir(gStatsDir, 0755) == -1 && errno != EEXIST) {
+    spdlog::warn("Cannot create {}: {}", gStatsDir, strerror(errno));
+  }
+  PounceBlat blatter(config, statsPath, forecastPath);
 
   blatter.run();
 